@@ -0,0 +1,436 @@
+#include "dbscan_factory.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Benchmarks the dbscan implementations on synthetic corpora, printing a
+// JSON array with one object per run to stdout, and progress to stderr.
+// Each run happens in a child process of its own, so the peak RSS reported
+// is that run's alone.
+
+struct bench_config {
+    // Everything swept over; each run takes one value from each list
+    std::vector<std::string> kinds = {"blobs", "uniform", "bow"};
+    std::vector<std::string> backends = {
+        "nonsparse/euclidean", "sparse/euclidean", "sparse/cosine"
+    };
+    std::vector<std::string> precisions = {"single", "double"};
+    std::vector<long> rows = {2000, 5000};
+    // Columns of the dense kinds
+    std::vector<long> cols = {2, 32};
+    // Columns and fraction of nonzeros of the bag-of-words kind
+    std::vector<long> vocab = {1000};
+    std::vector<double> density = {0.01, 0.05};
+    // eps is picked for each corpus so that a typical vector has about this
+    // many neighbours
+    std::vector<long> neighbours = {10, 40};
+    std::vector<long> min_pts = {10};
+};
+
+struct bench_case {
+    std::string kind;
+    std::string array_type;
+    std::string distance_metric;
+    std::string precision;
+    long rows;
+    long cols;
+    double density;
+    long neighbours;
+    long min_pts;
+};
+
+std::vector<double> generate_corpus(const bench_case& c, unsigned seed) {
+    // blobs: gaussian clusters (standard deviation 1) around 8 centres
+    // scattered over [-10, 10]^cols. uniform: uniform over [0, 1]^cols.
+    // bow: word counts, each column nonzero with probability density, and
+    // every row with at least one word.
+    std::mt19937 rng(seed);
+    std::vector<double> corpus(c.rows * c.cols, 0.0);
+    if (c.kind == "blobs") {
+        const long num_centers = 8;
+        std::uniform_real_distribution<double> center_dist(-10, 10);
+        std::vector<double> centers(num_centers * c.cols);
+        for (auto& x : centers) {
+            x = center_dist(rng);
+        }
+        std::uniform_int_distribution<long> pick(0, num_centers - 1);
+        std::normal_distribution<double> noise(0, 1);
+        for (long i=0; i < c.rows; i++) {
+            const double* center = &centers[pick(rng) * c.cols];
+            for (long j=0; j < c.cols; j++) {
+                corpus[i * c.cols + j] = center[j] + noise(rng);
+            }
+        }
+    } else if (c.kind == "uniform") {
+        std::uniform_real_distribution<double> dist(0, 1);
+        for (auto& x : corpus) {
+            x = dist(rng);
+        }
+    } else {
+        std::bernoulli_distribution present(c.density);
+        std::geometric_distribution<int> count(0.5);
+        std::uniform_int_distribution<long> any_col(0, c.cols - 1);
+        for (long i=0; i < c.rows; i++) {
+            double* row = &corpus[i * c.cols];
+            for (long j=0; j < c.cols; j++) {
+                if (present(rng)) {
+                    row[j] = 1 + count(rng);
+                }
+            }
+            if (std::count(row, row + c.cols, 0.0) == c.cols) {
+                row[any_col(rng)] = 1;
+            }
+        }
+    }
+    return corpus;
+}
+
+double calibrate_eps(const std::vector<double>& corpus, const bench_case& c) {
+    // The median, over a sample of vectors, of the distance (or for cosine,
+    // similarity) to their neighbours-th nearest neighbour
+    const long cols = c.cols;
+    const bool cosine = c.distance_metric == "cosine";
+    auto norm = [&] (long i) {
+        double sum = 0;
+        for (long j=0; j < cols; j++) {
+            sum += corpus[i * cols + j] * corpus[i * cols + j];
+        }
+        return std::sqrt(sum);
+    };
+
+    const long samples = std::min(c.rows, 100L);
+    const long k = std::min(c.neighbours, c.rows - 1);
+    std::vector<double> kth;
+    std::vector<double> scores;
+    for (long s=0; s < samples; s++) {
+        const long q = s * c.rows / samples;
+        const double q_norm = norm(q);
+        scores.clear();
+        for (long i=0; i < c.rows; i++) {
+            if (i == q) {
+                continue;
+            }
+            double sum = 0;
+            for (long j=0; j < cols; j++) {
+                const double x = corpus[q * cols + j];
+                const double y = corpus[i * cols + j];
+                sum += cosine ? x * y : (x - y) * (x - y);
+            }
+            // scored so that lower is nearer either way
+            scores.push_back(cosine ? -sum / (q_norm * norm(i)) :
+                std::sqrt(sum));
+        }
+        std::nth_element(scores.begin(), scores.begin() + (k - 1),
+            scores.end());
+        kth.push_back(scores[k - 1]);
+    }
+    std::nth_element(kth.begin(), kth.begin() + kth.size() / 2, kth.end());
+    double eps = kth[kth.size() / 2];
+    return cosine ? -eps : eps;
+}
+
+bool is_approximate(const std::string& array_type) {
+    // Whether the array type can miss neighbours, so its recall against an
+    // exact run is worth reporting
+    return array_type == "lsh" || array_type == "approx";
+}
+
+double pair_recall(const std::vector<libdbscan::index_t>& exact,
+        const std::vector<libdbscan::index_t>& approximate) {
+    // Of the pairs of vectors in the same cluster in the exact labels, the
+    // fraction also in the same cluster as each other in the approximate
+    // ones, from the sizes of the clusters and of their intersections
+    std::map<libdbscan::index_t, double> exact_sizes;
+    std::map<std::pair<libdbscan::index_t, libdbscan::index_t>, double> both;
+    for (size_t i=0; i < exact.size(); i++) {
+        if (exact[i] != -1) {
+            exact_sizes[exact[i]]++;
+            if (approximate[i] != -1) {
+                both[std::make_pair(exact[i], approximate[i])]++;
+            }
+        }
+    }
+    double exact_pairs = 0;
+    double found_pairs = 0;
+    for (const auto& size : exact_sizes) {
+        exact_pairs += size.second * (size.second - 1) / 2;
+    }
+    for (const auto& size : both) {
+        found_pairs += size.second * (size.second - 1) / 2;
+    }
+    return exact_pairs ? found_pairs / exact_pairs : 1;
+}
+
+template <typename TNum>
+std::string run_case(const bench_case& c, unsigned seed) {
+    // Runs one case, returning its results as JSON members
+    std::vector<double> generated = generate_corpus(c, seed);
+    const double eps = calibrate_eps(generated, c);
+    std::vector<TNum> corpus(generated.begin(), generated.end());
+    generated = std::vector<double>();
+
+    typedef std::chrono::steady_clock clock;
+    auto start = clock::now();
+    auto dbscan = libdbscan::create_dbscan<TNum>(c.array_type,
+        c.distance_metric, corpus.data(), c.rows, c.cols);
+    libdbscan::dbscan_stats stats;
+    dbscan->set_stats(&stats);
+    auto built = clock::now();
+    std::vector<libdbscan::index_t> results, noise;
+    dbscan->run(eps, c.min_pts, results, noise);
+    auto finished = clock::now();
+
+    const double build_seconds =
+        std::chrono::duration<double>(built - start).count();
+    const double run_seconds =
+        std::chrono::duration<double>(finished - built).count();
+    const double distance_evals = stats.distance_evaluations;
+    std::set<libdbscan::index_t> clusters(results.begin(), results.end());
+    clusters.erase(-1);
+
+    std::ostringstream o;
+    o.precision(9);
+    o << "\"eps\": " << eps
+        << ", \"clusters\": " << clusters.size()
+        << ", \"unclustered\": "
+        << std::count(results.begin(), results.end(), -1)
+        << ", \"build_seconds\": " << build_seconds
+        << ", \"run_seconds\": " << run_seconds
+        << ", \"query_seconds\": " << stats.query_seconds
+        << ", \"distance_evals\": " << distance_evals
+        << ", \"distance_evals_per_second\": " << distance_evals / run_seconds;
+
+    // Approximate backends are compared with an exact full scan
+    if (is_approximate(c.array_type)) {
+        auto exact = libdbscan::create_dbscan<TNum>("nonsparse",
+            c.distance_metric, corpus.data(), c.rows, c.cols);
+        std::vector<libdbscan::index_t> exact_results;
+        exact->run(eps, c.min_pts, exact_results, noise);
+        o << ", \"recall\": " << pair_recall(exact_results, results);
+    }
+    return o.str();
+}
+
+bool run_in_child(const bench_case& c, unsigned seed, std::string& json,
+        long& peak_rss_kb) {
+    // Runs the case in a child process, so its memory use is measured on
+    // its own, returning false if it fails
+    int fds[2];
+    if (pipe(fds) == -1) {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        int status = 0;
+        try {
+            std::string result = c.precision == "double" ?
+                run_case<double>(c, seed) : run_case<float>(c, seed);
+            if (write(fds[1], result.data(), result.size()) !=
+                    ssize_t(result.size())) {
+                status = 1;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            status = 1;
+        }
+        _exit(status);
+    }
+
+    close(fds[1]);
+    json.clear();
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        json.append(buffer, n);
+    }
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+        return false;
+    }
+    // in kilobytes on Linux
+    peak_rss_kb = usage.ru_maxrss;
+    return true;
+}
+
+template <typename T>
+bool parse_list(const std::string& value, std::vector<T>& list) {
+    list.clear();
+    std::istringstream s(value);
+    std::string item;
+    while (std::getline(s, item, ',')) {
+        std::istringstream item_s(item);
+        T parsed;
+        if (!(item_s >> parsed)) {
+            return false;
+        }
+        list.push_back(parsed);
+    }
+    return !list.empty();
+}
+
+int main(int argc, char** argv) {
+    const char* usage =
+        "usage: dbscan_bench [options]\n"
+        "Runs each combination of the options' values, printing the results\n"
+        "as JSON. Each option takes a comma separated list.\n"
+        "options:\n"
+        "  --kinds=K:      corpora to generate: blobs (gaussian clusters),\n"
+        "                  uniform (noise) and bow (sparse word counts);\n"
+        "                  default all\n"
+        "  --backends=B:   array_type/distance_metric pairs to run, any\n"
+        "                  of nonsparse/euclidean, nonsparse/cosine,\n"
+        "                  sparse/euclidean, sparse/cosine, grid/euclidean,\n"
+        "                  kdtree/euclidean, quantized/euclidean,\n"
+        "                  approx/euclidean, inverted/cosine and\n"
+        "                  lsh/cosine; approx and lsh also report their\n"
+        "                  recall against an exact run, approx only\n"
+        "                  for up to 6 columns; default\n"
+        "                  nonsparse/euclidean,sparse/euclidean,sparse/cosine\n"
+        "  --precisions=P: single and/or double, default both\n"
+        "  --rows=N:       default 2000,5000\n"
+        "  --cols=N:       columns of blobs and uniform, default 2,32\n"
+        "  --vocab=N:      columns of bow, default 1000\n"
+        "  --density=D:    fraction of nonzeros in bow, default 0.01,0.05\n"
+        "  --neighbours=N: eps is set so that a typical vector has about this\n"
+        "                  many neighbours, default 10,40\n"
+        "  --min-pts=N:    default 10\n"
+        "  --seed=N:       seed for generating corpora, default 1\n"
+        "  --kernel=K:     force the distance kernel, as for dbscan";
+
+    const std::set<std::string> known_backends = {
+        "nonsparse/euclidean", "nonsparse/cosine",
+        "sparse/euclidean", "sparse/cosine",
+        "grid/euclidean", "kdtree/euclidean", "quantized/euclidean",
+        "approx/euclidean", "inverted/cosine", "lsh/cosine"
+    };
+
+    bench_config config;
+    unsigned seed = 1;
+    for (int i=1; i < argc; i++) {
+        std::string option = argv[i];
+        std::string name = option.substr(0, option.find('='));
+        std::string value = option.substr(option.find('=') + 1);
+        bool ok = true;
+        if (option.find('=') == std::string::npos) {
+            ok = false;
+        } else if (name == "--kinds") {
+            ok = parse_list(value, config.kinds);
+            for (const auto& kind : config.kinds) {
+                ok = ok && (kind == "blobs" || kind == "uniform" ||
+                    kind == "bow");
+            }
+        } else if (name == "--backends") {
+            ok = parse_list(value, config.backends);
+            for (const auto& backend : config.backends) {
+                ok = ok && known_backends.count(backend);
+            }
+        } else if (name == "--precisions") {
+            ok = parse_list(value, config.precisions);
+            for (const auto& precision : config.precisions) {
+                ok = ok && (precision == "single" || precision == "double");
+            }
+        } else if (name == "--rows") {
+            ok = parse_list(value, config.rows);
+        } else if (name == "--cols") {
+            ok = parse_list(value, config.cols);
+        } else if (name == "--vocab") {
+            ok = parse_list(value, config.vocab);
+        } else if (name == "--density") {
+            ok = parse_list(value, config.density);
+        } else if (name == "--neighbours") {
+            ok = parse_list(value, config.neighbours);
+        } else if (name == "--min-pts") {
+            ok = parse_list(value, config.min_pts);
+        } else if (name == "--seed") {
+            seed = std::atol(value.c_str());
+        } else if (name == "--kernel") {
+            ok = libdbscan::set_distance_kernel(value);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << "Bad option " << option << std::endl;
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<bench_case> cases;
+    for (const auto& kind : config.kinds) {
+        bool sparse = kind == "bow";
+        std::vector<long> cols = sparse ? config.vocab : config.cols;
+        std::vector<double> density = sparse ? config.density :
+            std::vector<double>(1, 1.0);
+        for (auto rows : config.rows) for (auto c : cols)
+        for (auto d : density) for (auto neighbours : config.neighbours)
+        for (auto min_pts : config.min_pts)
+        for (const auto& precision : config.precisions)
+        for (const auto& backend : config.backends) {
+            std::string array_type = backend.substr(0, backend.find('/'));
+            std::string metric = backend.substr(backend.find('/') + 1);
+            if (array_type == "approx" &&
+                    c > libdbscan::dbscan_rho_approx<float>::max_cols) {
+                continue;
+            }
+            cases.push_back(bench_case{kind, array_type, metric, precision,
+                rows, c, d, neighbours, min_pts});
+        }
+    }
+
+    const char* kernel = libdbscan::distance_kernel_name(
+        libdbscan::get_distance_kernel());
+    std::cout << "[" << std::endl;
+    int failures = 0;
+    int printed = 0;
+    for (size_t k=0; k < cases.size(); k++) {
+        const bench_case& c = cases[k];
+        std::cerr << "[" << k + 1 << "/" << cases.size() << "] " << c.kind
+            << " " << c.rows << "x" << c.cols << " " << c.array_type << "/"
+            << c.distance_metric << " " << c.precision << std::endl;
+
+        std::string json;
+        long peak_rss_kb;
+        if (!run_in_child(c, seed, json, peak_rss_kb)) {
+            std::cerr << "  failed" << std::endl;
+            failures++;
+            continue;
+        }
+        std::cout << (printed++ ? ",\n" : "")
+            << "{\"kind\": \"" << c.kind << "\""
+            << ", \"array_type\": \"" << c.array_type << "\""
+            << ", \"distance_metric\": \"" << c.distance_metric << "\""
+            << ", \"precision\": \"" << c.precision << "\""
+            << ", \"kernel\": \"" << kernel << "\""
+            << ", \"rows\": " << c.rows
+            << ", \"cols\": " << c.cols
+            << ", \"density\": " << c.density
+            << ", \"neighbours\": " << c.neighbours
+            << ", \"min_pts\": " << c.min_pts
+            << ", " << json
+            << ", \"peak_rss_kb\": " << peak_rss_kb << "}";
+        std::cout.flush();
+    }
+    std::cout << "\n]" << std::endl;
+    return failures ? 1 : 0;
+}
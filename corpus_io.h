@@ -0,0 +1,533 @@
+#ifndef __CORPUS_IO_H__
+#define __CORPUS_IO_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <ios>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// std::from_chars for floating point needs C++17 and a recent standard
+// library (libstdc++ 11+); strtod is used where it's missing
+#if defined(__has_include)
+#if __has_include(<charconv>) && __cplusplus >= 201703L
+#include <charconv>
+#endif
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dbscan.h"
+#include "thread_pool.h"
+
+namespace libdbscan {
+
+class mapped_file {
+    // A whole file mapped read-only into memory, unmapped on destruction.
+    // Throws std::ios_base::failure if the file can't be opened or mapped.
+public:
+    explicit mapped_file(const std::string& path);
+    ~mapped_file();
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator = (const mapped_file&) = delete;
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    const char* _data;
+    size_t _size;
+};
+
+inline mapped_file::mapped_file(const std::string& path) :
+    _data(nullptr),
+    _size(0)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::ios_base::failure("couldn't open file");
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) == -1) {
+        ::close(fd);
+        throw std::ios_base::failure("couldn't stat file");
+    }
+    _size = st.st_size;
+
+    // mmap won't map nothing, but an empty file is fine
+    if (_size > 0) {
+        void* mapped = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            ::close(fd);
+            throw std::ios_base::failure("couldn't map file");
+        }
+        _data = static_cast<const char*>(mapped);
+    }
+    // the mapping holds its own reference to the file
+    ::close(fd);
+}
+
+inline mapped_file::~mapped_file()
+{
+    if (_data) {
+        ::munmap(const_cast<char*>(_data), _size);
+    }
+}
+
+// Element types of the binary corpus format
+enum binary_dtype : uint32_t {
+    float32_dtype = 1,
+    float64_dtype = 2
+};
+
+template <typename TNum> struct binary_dtype_of;
+template <> struct binary_dtype_of<float> {
+    static const binary_dtype value = float32_dtype;
+};
+template <> struct binary_dtype_of<double> {
+    static const binary_dtype value = float64_dtype;
+};
+
+struct binary_corpus_header {
+    // The binary corpus format is this header, in native byte order,
+    // followed immediately by rows * cols elements of dtype in C-style
+    // (row-major) order. The header's size keeps the data 8-byte aligned,
+    // so a mapped file can be used as the corpus in place.
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint64_t rows;
+    uint64_t cols;
+
+    static const char* expected_magic() { return "DBSCANB"; }
+    static const uint32_t current_version = 1;
+};
+
+static_assert(sizeof(binary_corpus_header) == 32,
+    "binary corpus header must be packed");
+
+inline size_t binary_dtype_size(uint32_t dtype)
+{
+    switch (dtype) {
+    case float32_dtype: return sizeof(float);
+    case float64_dtype: return sizeof(double);
+    default: return 0;
+    }
+}
+
+inline bool is_binary_corpus(const mapped_file& file)
+{
+    // Whether the file starts with the binary corpus format's magic
+    return file.size() >= sizeof(binary_corpus_header) &&
+        std::memcmp(file.data(), binary_corpus_header::expected_magic(),
+            sizeof(binary_corpus_header::magic)) == 0;
+}
+
+inline void check_binary_corpus_header(const binary_corpus_header& header,
+        size_t file_size)
+{
+    // Throws std::ios_base::failure unless the header is consistent with a
+    // file of file_size bytes
+    if (header.version != binary_corpus_header::current_version) {
+        throw std::ios_base::failure("unsupported binary corpus version");
+    }
+    size_t element_size = binary_dtype_size(header.dtype);
+    if (element_size == 0) {
+        throw std::ios_base::failure("unknown binary corpus dtype");
+    }
+    if (header.cols > 0 &&
+            header.rows > (file_size / element_size) / header.cols) {
+        throw std::ios_base::failure("binary corpus file is truncated");
+    }
+    if (file_size != sizeof(header) +
+            header.rows * header.cols * element_size) {
+        throw std::ios_base::failure("binary corpus file has the wrong size");
+    }
+}
+
+inline const binary_corpus_header& read_binary_corpus_header(
+        const mapped_file& file)
+{
+    // The header of a mapped binary corpus file, after checking it's
+    // consistent with the file. Throws std::ios_base::failure if not.
+    if (!is_binary_corpus(file)) {
+        throw std::ios_base::failure("not a binary corpus file");
+    }
+    const binary_corpus_header& header =
+        *reinterpret_cast<const binary_corpus_header*>(file.data());
+    check_binary_corpus_header(header, file.size());
+    return header;
+}
+
+template <typename TNum>
+const TNum* binary_corpus_data(const mapped_file& file,
+        index_t& rows, index_t& cols)
+{
+    // The corpus in a mapped binary corpus file, in place, if its dtype is
+    // TNum; nullptr if it's another dtype
+    const binary_corpus_header& header = read_binary_corpus_header(file);
+    rows = header.rows;
+    cols = header.cols;
+    if (header.dtype != binary_dtype_of<TNum>::value) {
+        return nullptr;
+    }
+    return reinterpret_cast<const TNum*>(file.data() + sizeof(header));
+}
+
+inline char* parse_number(const char* s, float& value)
+{
+    char* end;
+    value = std::strtof(s, &end);
+    return end;
+}
+
+inline char* parse_number(const char* s, double& value)
+{
+    char* end;
+    value = std::strtod(s, &end);
+    return end;
+}
+
+template <typename TNum>
+const char* parse_csv_value(const char* first, const char* last, TNum& value)
+{
+    // Parses one number at the start of [first, last), at TNum's full
+    // precision, returning the end of it, or nullptr if there isn't one
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    std::from_chars_result result = std::from_chars(first, last, value);
+    return result.ec == std::errc() ? result.ptr : nullptr;
+#else
+    // strtod needs a terminated string, which the end of a mapped file
+    // isn't, so copy the field
+    char buffer[64];
+    size_t n = std::min<size_t>(last - first, sizeof(buffer) - 1);
+    std::memcpy(buffer, first, n);
+    buffer[n] = 0;
+    char* end = parse_number(buffer, value);
+    return end == buffer ? nullptr : first + (end - buffer);
+#endif
+}
+
+inline const char* skip_csv_space(const char* p, const char* last)
+{
+    while (p < last && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+template <typename TNum>
+bool parse_csv_line(const char* p, const char* eol, index_t cols, TNum* out,
+        index_t line, std::string& error)
+{
+    // Parses line number line, [p, eol), which isn't blank and starts at its
+    // first value, into out's cols values. Returns false, describing the
+    // problem in error, if it has the wrong number of values or one of them
+    // isn't a number.
+    index_t found = 0;
+    bool bad_value = false;
+    while (true) {
+        TNum value;
+        const char* next = parse_csv_value(p, eol, value);
+        if (!next) {
+            bad_value = true;
+            break;
+        }
+        if (found < cols) {
+            out[found] = value;
+        }
+        found++;
+        p = skip_csv_space(next, eol);
+        if (p == eol) {
+            break;
+        }
+        if (*p != ',') {
+            bad_value = true;
+            break;
+        }
+        p = skip_csv_space(p + 1, eol);
+    }
+
+    if (bad_value || found != cols) {
+        std::ostringstream o;
+        o << "line " << line;
+        if (bad_value) {
+            o << ": couldn't parse value " << found + 1;
+        } else {
+            o << " has " << found << " values, expected " << cols;
+        }
+        error = o.str();
+        return false;
+    }
+    return true;
+}
+
+template <typename TNum>
+std::vector<TNum> parse_csv_corpus(const mapped_file& file, long threads,
+        index_t& rows, index_t& cols)
+{
+    // Parses a mapped CSV file of numbers, one vector per line, into a
+    // C-style (row-major) array, splitting the file into line-aligned chunks
+    // that are parsed on threads threads straight into their rows. Blank
+    // lines are skipped. Throws std::ios_base::failure, naming the line, if
+    // a line has the wrong number of values (the first sets how many) or
+    // one of them isn't a number.
+    const char* const data = file.data();
+    const char* const end = data + file.size();
+
+    auto line_end = [&] (const char* p) {
+        const char* newline = static_cast<const char*>(
+            std::memchr(p, '\n', end - p));
+        return newline ? newline : end;
+    };
+
+    // Chunk k is [chunk_starts[k], chunk_starts[k + 1]), each starting at
+    // the beginning of a line; small files aren't worth splitting much
+    threads = std::max(1L, std::min<long>(threads, file.size() / 65536 + 1));
+    std::vector<const char*> chunk_starts(threads + 1, end);
+    chunk_starts[0] = data;
+    for (long k=1; k < threads; k++) {
+        const char* p = std::max(chunk_starts[k - 1],
+            data + file.size() * k / threads);
+        if (p != data && p != end && p[-1] != '\n') {
+            p = std::min(end, line_end(p) + 1);
+        }
+        chunk_starts[k] = p;
+    }
+
+    // The first line that isn't blank sets the number of columns
+    cols = 0;
+    for (const char* p=data; p < end; p = line_end(p) + 1) {
+        const char* eol = line_end(p);
+        if (skip_csv_space(p, eol) != eol) {
+            cols = std::count(p, eol, ',') + 1;
+            break;
+        }
+    }
+
+    // Count the lines and rows in each chunk, so each knows the line number
+    // and row it starts at
+    thread_pool pool(threads);
+    std::vector<index_t> chunk_lines(threads + 1, 0);
+    std::vector<index_t> chunk_rows(threads + 1, 0);
+    pool.parallel_for(threads, [&] (long thread_i, long begin, long finish) {
+        for (long k=begin; k < finish; k++) {
+            for (const char* p=chunk_starts[k]; p < chunk_starts[k + 1]; ) {
+                const char* eol = line_end(p);
+                chunk_lines[k + 1]++;
+                if (skip_csv_space(p, eol) != eol) {
+                    chunk_rows[k + 1]++;
+                }
+                p = eol + 1;
+            }
+        }
+    });
+    for (long k=0; k < threads; k++) {
+        chunk_lines[k + 1] += chunk_lines[k];
+        chunk_rows[k + 1] += chunk_rows[k];
+    }
+    rows = chunk_rows[threads];
+
+    // Then parse, noting the first bad line in each chunk
+    std::vector<TNum> values(rows * cols);
+    std::vector<std::string> errors(threads);
+    pool.parallel_for(threads, [&] (long thread_i, long begin, long finish) {
+        for (long k=begin; k < finish; k++) {
+            index_t line = chunk_lines[k];
+            TNum* out = values.data() + chunk_rows[k] * cols;
+            for (const char* p=chunk_starts[k]; p < chunk_starts[k + 1];
+                    p = line_end(p) + 1) {
+                const char* eol = line_end(p);
+                line++;
+                p = skip_csv_space(p, eol);
+                if (p == eol) {
+                    continue;
+                }
+                if (!parse_csv_line(p, eol, cols, out, line, errors[k])) {
+                    break;
+                }
+                out += cols;
+            }
+        }
+    });
+
+    // chunks are in file order, so the first error found is the first in
+    // the file
+    for (const auto& error : errors) {
+        if (!error.empty()) {
+            throw std::ios_base::failure(error);
+        }
+    }
+    return values;
+}
+
+template <typename TNum>
+class corpus_reader {
+    // Reads a corpus file, binary or CSV (told apart as load_corpus does), a
+    // batch of rows at a time, for going over corpora too big to hold in
+    // memory. CSVs are parsed on the calling thread. Throws
+    // std::ios_base::failure as read_binary_corpus_header and
+    // parse_csv_corpus do.
+public:
+    explicit corpus_reader(const std::string& path);
+
+    index_t cols() const { return _cols; }
+
+    // Reads up to max_rows more rows into values, C-style, returning how
+    // many; 0 once they've all been read
+    index_t read(index_t max_rows, std::vector<TNum>& values);
+    // Goes back to the first row
+    void rewind();
+
+private:
+    template <typename TFrom>
+    void convert(index_t count, std::vector<TNum>& values);
+
+    std::ifstream _file;
+    bool _binary;
+    uint32_t _dtype;
+    index_t _cols;
+    // Rows in a binary file, and rows read so far
+    index_t _rows;
+    index_t _next_row;
+    // Lines of a CSV read so far, for errors
+    index_t _line;
+    std::string _text;
+    std::vector<char> _buffer;
+};
+
+template <typename TNum>
+corpus_reader<TNum>::corpus_reader(const std::string& path) :
+    _binary(false),
+    _dtype(0),
+    _cols(0),
+    _rows(0),
+    _next_row(0),
+    _line(0)
+{
+    _file.open(path, std::ios::binary);
+    if (!_file) {
+        throw std::ios_base::failure("couldn't open file");
+    }
+
+    binary_corpus_header header;
+    _file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (_file.gcount() == sizeof(header) &&
+            std::memcmp(header.magic, binary_corpus_header::expected_magic(),
+                sizeof(header.magic)) == 0) {
+        _file.seekg(0, std::ios::end);
+        check_binary_corpus_header(header, _file.tellg());
+        _binary = true;
+        _dtype = header.dtype;
+        _rows = header.rows;
+        _cols = header.cols;
+        rewind();
+        return;
+    }
+
+    // The first line that isn't blank sets the number of columns
+    rewind();
+    while (std::getline(_file, _text)) {
+        const char* p = _text.data();
+        const char* eol = p + _text.size();
+        if (skip_csv_space(p, eol) != eol) {
+            _cols = std::count(p, eol, ',') + 1;
+            break;
+        }
+    }
+    rewind();
+}
+
+template <typename TNum>
+void corpus_reader<TNum>::rewind()
+{
+    _file.clear();
+    _file.seekg(_binary ? sizeof(binary_corpus_header) : 0);
+    _next_row = 0;
+    _line = 0;
+}
+
+template <typename TNum>
+template <typename TFrom>
+void corpus_reader<TNum>::convert(index_t count, std::vector<TNum>& values)
+{
+    _buffer.resize(count * _cols * sizeof(TFrom));
+    if (!_file.read(_buffer.data(), _buffer.size())) {
+        throw std::ios_base::failure("binary corpus file is truncated");
+    }
+    values.resize(count * _cols);
+    for (index_t k=0; k < count * _cols; k++) {
+        TFrom value;
+        std::memcpy(&value, &_buffer[k * sizeof(TFrom)], sizeof(TFrom));
+        values[k] = value;
+    }
+}
+
+template <typename TNum>
+index_t corpus_reader<TNum>::read(index_t max_rows, std::vector<TNum>& values)
+{
+    if (_binary) {
+        const index_t count = std::min(max_rows, _rows - _next_row);
+        if (_dtype == float32_dtype) {
+            convert<float>(count, values);
+        } else {
+            convert<double>(count, values);
+        }
+        _next_row += count;
+        return count;
+    }
+
+    values.resize(max_rows * _cols);
+    index_t count = 0;
+    std::string error;
+    while (count < max_rows && std::getline(_file, _text)) {
+        _line++;
+        const char* p = _text.data();
+        const char* eol = p + _text.size();
+        p = skip_csv_space(p, eol);
+        if (p == eol) {
+            continue;
+        }
+        if (!parse_csv_line(p, eol, _cols, &values[count * _cols], _line,
+                error)) {
+            throw std::ios_base::failure(error);
+        }
+        count++;
+    }
+    values.resize(count * _cols);
+    return count;
+}
+
+template <typename TNum>
+void write_binary_corpus(const std::string& path, const TNum* corpus,
+        index_t rows, index_t cols)
+{
+    binary_corpus_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::strncpy(header.magic, binary_corpus_header::expected_magic(),
+        sizeof(header.magic));
+    header.version = binary_corpus_header::current_version;
+    header.dtype = binary_dtype_of<TNum>::value;
+    header.rows = rows;
+    header.cols = cols;
+
+    std::ofstream s;
+    s.exceptions(s.failbit | s.badbit);
+    s.open(path, std::ios::binary | std::ios::trunc);
+    s.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    s.write(reinterpret_cast<const char*>(corpus),
+        rows * cols * sizeof(TNum));
+}
+
+}
+
+#endif
@@ -4,11 +4,18 @@
 #include <cmath>
 #include <cstring>
 #include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
 #include <memory>
+#include <queue>
+#include <random>
+#include <stdexcept>
 #include <stdio.h>
-#include <unordered_set>
 #include <vector>
 
+#include "thread_pool.h"
 #include "util.h"
 
 namespace libdbscan {
@@ -17,8 +24,99 @@ namespace libdbscan {
 // 64-bit platforms; on LP64 this works, would need extra love for windows.
 typedef long index_t;
 
-// Expected to be a hash-based set with O(1) operations
-typedef std::unordered_set<index_t> index_set;
+// List of vector indexes, in no particular order. Used for region query
+// results so that callers can reuse the same buffer across queries.
+typedef std::vector<index_t> index_list;
+
+enum dbscan_engine {
+    // The classic algorithm: one region query at a time, growing each
+    // cluster from the results of the previous queries
+    sequential_engine,
+    // Finds every vector's neighbours in parallel first, then merges core
+    // vectors into clusters with a concurrent union-find. Uses memory
+    // proportional to the total number of neighbour pairs.
+    parallel_engine,
+    // DBSCAN++: only a sample of the vectors are region queried, so only
+    // they can be core, and every other vector joins the cluster of the
+    // nearest core vector within eps. Approximate; see set_sampling.
+    sampled_engine
+};
+
+enum dbscan_sampling {
+    // How the sampled engine picks the vectors it queries: at random, or
+    // each in turn the furthest from those picked so far (greedy k-center),
+    // which covers the corpus more evenly
+    uniform_sampling,
+    kcenter_sampling
+};
+
+struct dbscan_stats {
+    // What a run() did and where its time went, filled in if set with
+    // dbscan::set_stats. The sequential engine spends its time in
+    // region queries and in expanding clusters; the parallel and sampled
+    // engines in finding (their sample's) neighbours, merging core vectors
+    // and then labelling.
+    index_t region_queries = 0;
+    // Pairs of vectors compared, as counted by the implementation; index
+    // structures compare far fewer than rows * (rows - 1)
+    index_t distance_evaluations = 0;
+    // Vectors visited: picked as a seed or reached while expanding a
+    // cluster (sequential engine), labelled from their neighbours (parallel
+    // engine), or sampled or reached by a sampled core vector (sampled engine)
+    index_t points_visited = 0;
+    // Passes over a growing frontier in expand_cluster, and the largest the
+    // frontier got (sequential engine only)
+    index_t expand_waves = 0;
+    index_t peak_frontier = 0;
+
+    // Wall time, in seconds, of prepare_region_query, the region queries,
+    // cluster expansion (everything else the sequential engine does), the
+    // parallel engine's union-find merging and labelling, and the whole run
+    double prepare_seconds = 0;
+    double query_seconds = 0;
+    double expand_seconds = 0;
+    double merge_seconds = 0;
+    double label_seconds = 0;
+    double total_seconds = 0;
+
+    // Calls visit(name, value) for each field, for printing them
+    template <typename TVisit>
+    void visit(TVisit visit) const {
+        visit("region_queries", region_queries);
+        visit("distance_evaluations", distance_evaluations);
+        visit("points_visited", points_visited);
+        visit("expand_waves", expand_waves);
+        visit("peak_frontier", peak_frontier);
+        visit("prepare_seconds", prepare_seconds);
+        visit("query_seconds", query_seconds);
+        visit("expand_seconds", expand_seconds);
+        visit("merge_seconds", merge_seconds);
+        visit("label_seconds", label_seconds);
+        visit("total_seconds", total_seconds);
+    }
+};
+
+template <typename TNum>
+struct optics_ordering {
+    // Result of dbscan::optics. Distances are in the units of the
+    // implementation's neighbour_score (e.g. squared distance for
+    // euclidean), with infinity meaning further than max_eps.
+    TNum max_eps;
+    index_t min_pts;
+    // Every vector, in the order OPTICS visited them
+    std::vector<index_t> order;
+    // Indexed by vector: the smallest distance at which it's reachable
+    // from a core vector visited before it
+    std::vector<TNum> reachability;
+    // Indexed by vector: the distance to its min_pts'th nearest
+    // neighbour, i.e. the smallest at which it's a core vector
+    std::vector<TNum> core_distance;
+    // Indexed by vector: the smallest reachability distance from any core
+    // vector, visited before it or not, and that core vector, for
+    // attaching border vectors to a cluster
+    std::vector<TNum> attach_distance;
+    std::vector<index_t> attach_to;
+};
 
 template <typename TNum>
 class dbscan {
@@ -32,129 +130,1131 @@ class dbscan {
     //
     //  * Their own constructor, which must initialize at _rows and _cols
     //  * region_query.
+    //
+    // and may implement prepare_region_query and region_query_batch, or
+    // replace the engines altogether by overriding cluster.
 public:
     void run(TNum eps, index_t min_pts, std::vector<index_t>& results, 
         std::vector<index_t>& noise);
+
+    // As run(), also setting core[i] to 1 if vector i is a core vector (has
+    // at least min_pts neighbours) and 0 if not
+    void run(TNum eps, index_t min_pts, std::vector<index_t>& results,
+        std::vector<index_t>& noise, std::vector<index_t>& core);
+
+    // Runs for each of eps_values in turn, filling results[k] and noise[k]
+    // as run(eps_values[k], ...) would, but with the region queries done
+    // only once, for the widest eps, and each vector's neighbours at the
+    // other eps values picked out of those by their distance. Uses the
+    // thread pool, as the parallel engine does, and needs memory for every
+    // pair of neighbours at the widest eps.
+    void sweep(const std::vector<TNum>& eps_values, index_t min_pts,
+        std::vector<std::vector<index_t> >& results,
+        std::vector<std::vector<index_t> >& noise);
+
+    // OPTICS: visits every vector once, doing one region query each at
+    // max_eps, and records the order and reachability distances from which
+    // the clusters at any eps up to max_eps can be read off by
+    // extract_dbscan, without querying again.
+    void optics(TNum max_eps, index_t min_pts, optics_ordering<TNum>& ordering);
+
+    // Labels the vectors as DBSCAN would at eps, which must be no wider than
+    // the ordering's max_eps (otherwise std::invalid_argument is thrown),
+    // from an ordering made by optics(). The core vectors' clusters are
+    // exactly those run() finds, numbered the same way, and so are the
+    // vectors left as noise; as usual for OPTICS though, a border vector
+    // within eps of more than one cluster may be put in a different one of
+    // them than run() would.
+    void extract_dbscan(const optics_ordering<TNum>& ordering, TNum eps,
+        std::vector<index_t>& results);
+
+    // The neighbours at eps of each of vecs, as run() finds them, vecs[k]'s
+    // being neighbours[offsets[k]] to neighbours[offsets[k + 1] - 1]; the
+    // queries are split across the thread pool. For following up on some
+    // of the vectors after a run(), as dbscan_partitioned does with border
+    // vectors.
+    void neighbours_of(const std::vector<index_t>& vecs, TNum eps,
+        std::vector<index_t>& offsets, std::vector<index_t>& neighbours);
+
+    // The eps at which vectors whose neighbour_score is score become
+    // neighbours, for converting the distances in an optics_ordering back
+    // to eps, e.g. for plotting reachability
+    virtual TNum neighbour_eps(TNum score) const {
+        throw std::logic_error("optics isn't supported by this implementation");
+    }
     index_t get_num_rows() { return _rows; }
+
+    // Number of threads that implementations which scan the whole corpus in
+    // region_query may split that scan across. 1, the default, scans on the
+    // calling thread only. The results are the same either way.
+    void set_num_threads(index_t num_threads);
+    index_t get_num_threads() { return _pool ? _pool->num_threads() : 1; }
+
+    // Which algorithm run() uses; the parallel and sampled engines run
+    // region queries across the thread pool set up by set_num_threads. The
+    // sequential and parallel engines give the same results, including
+    // cluster numbering. The sampled engine only knows which of its sample
+    // are core, so the core flags run() fills in are 0 for the rest.
+    void set_engine(dbscan_engine engine) { _engine = engine; }
+    dbscan_engine get_engine() { return _engine; }
+
+    // The sampled engine queries count vectors if count > 0, otherwise
+    // fraction of them (at least one), picked by sampling with a random
+    // number generator seeded with seed, so runs are repeatable. k-center
+    // sampling compares every vector with each one picked, using
+    // neighbour_score, so suits smaller samples.
+    static constexpr double default_sample_fraction = 0.1;
+    void set_sampling(index_t count, double fraction,
+            dbscan_sampling sampling, unsigned long seed) {
+        _sample_count = count;
+        _sample_fraction = fraction;
+        _sampling = sampling;
+        _seed = seed;
+    }
+
+    // If stats isn't null, each run() or sweep() resets and fills it in,
+    // until this is called again with null. Without it, the only cost is a
+    // few checks of whether it's set.
+    void set_stats(dbscan_stats* stats) { _stats = stats; }
+
     virtual ~dbscan() {}
 
 protected:
+    dbscan() :
+        _engine(sequential_engine),
+        _sample_count(0),
+        _sample_fraction(default_sample_fraction),
+        _sampling(uniform_sampling),
+        _seed(0),
+        _stats(nullptr),
+        _distance_evaluations(0) {}
+
+    // Called by run() before any region queries with the given eps, so that
+    // implementations can build any eps-dependent state up front.
+    // region_query may be called from several threads at once by the
+    // parallel engine, so must not modify the object.
+    virtual void prepare_region_query(TNum eps) {}
+
     // Subclasses must implement this. Given the index of a vector in the
-    // corpus, fill result with a set of indexes of vectors that are within eps
-    // distance, according to the distance metric being used. Returns the size
-    // of the result.
-    virtual index_t region_query(index_t vec_i, TNum eps, index_set& result) = 0;
+    // corpus, fill result (which is passed in empty) with the indexes of the
+    // other vectors that are within eps distance, according to the distance
+    // metric being used, each exactly once. Returns the size of the result.
+    virtual index_t region_query(index_t vec_i, TNum eps, index_list& result) = 0;
+
+    // Region queries for each of the count vectors starting at index first,
+    // filling results[0] to results[count - 1] (each passed in empty) as per
+    // region_query. Used by the parallel engine, which queries every vector.
+    // The default just calls region_query for each; implementations that can
+    // share work between queries should override it.
+    virtual void region_query_batch(index_t first, index_t count, TNum eps,
+        index_list* results);
+
+    // Called by run() once prepare_region_query has been, to fill in the
+    // results, noise and core flags (if core isn't null) as described for
+    // run(). The default runs the engine set by set_engine; implementations
+    // that don't cluster from region queries override it.
+    virtual void cluster(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core);
+
+    // Runs task over [0, n) on the thread pool if there is one, or on the
+    // calling thread otherwise
+    void parallel_for(index_t n, const thread_pool::task_t& task);
+
+    // Helper for region_query implementations that scan the whole corpus:
+    // calls included(i) for every row i other than vec_i, adding those for
+    // which it returns true to result, and returns the size of the result.
+    //
+    // If set_num_threads has been called the scan is split across the
+    // thread pool, so included must be safe to call concurrently.
+    template <typename TIncluded>
+    index_t scan_corpus(index_t vec_i, index_list& result, TIncluded included);
+
+    // Implementations call this from their region queries with the number
+    // of pairs of vectors they compared, for the stats; scan_corpus counts
+    // its own. Safe to call concurrently.
+    void count_distances(index_t n) {
+        if (_stats) {
+            _distance_evaluations.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    // For sweep(): the distance (or other dissimilarity) between vectors i
+    // and j, and the largest distance that is within eps, such that
+    // region_query(i, eps, ...) finds exactly the vectors j with
+    // neighbour_score(i, j) <= neighbour_threshold(eps). So they must make
+    // the same floating point comparison as region_query, and a larger
+    // threshold must mean a wider neighbourhood. The defaults throw
+    // std::logic_error, as sweep() and optics() aren't possible without
+    // them.
+    virtual TNum neighbour_score(index_t i, index_t j) const {
+        throw std::logic_error("sweep isn't supported by this implementation");
+    }
+    virtual TNum neighbour_threshold(TNum eps) const {
+        throw std::logic_error("sweep isn't supported by this implementation");
+    }
+
     index_t _rows;
     index_t _cols;
 
 private:
-    void expand_cluster(TNum eps, 
+    // Below this many rows per thread, waking the pool costs more than it
+    // saves
+    static const index_t min_rows_per_thread = 2048;
+    // Vectors per region_query_batch call made by the parallel engine
+    static const index_t query_batch_size = 64;
+
+    std::unique_ptr<thread_pool> _pool;
+    // Per-thread results of scan_corpus, appended to its result in thread
+    // order once the scan is done
+    std::vector<std::vector<index_t> > _thread_results;
+    dbscan_engine _engine;
+    index_t _sample_count;
+    double _sample_fraction;
+    dbscan_sampling _sampling;
+    unsigned long _seed;
+    dbscan_stats* _stats;
+    std::atomic<index_t> _distance_evaluations;
+
+    typedef std::chrono::steady_clock clock;
+    static double seconds_since(clock::time_point start) {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    // region_query, counted and timed for the stats if they're wanted
+    index_t counted_region_query(index_t vec_i, TNum eps, index_list& result);
+
+    // core, if not null, is filled in as for run()
+    void run_engine(TNum eps, index_t min_pts, std::vector<index_t>& results,
+        std::vector<index_t>& noise, std::vector<index_t>* core);
+
+    void run_sequential(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core);
+
+    void run_parallel(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core);
+
+    // The sampled engine's vectors to query, ascending
+    void choose_sample(std::vector<index_t>& sample);
+
+    void run_sampled(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core);
+
+    // Phase 1 of the parallel engine: every vector's region query results,
+    // as a CSR-style adjacency list, vector i's neighbours being
+    // neighbours[offsets[i]] to neighbours[offsets[i + 1] - 1]
+    void find_all_neighbours(TNum eps, std::vector<index_t>& offsets,
+        std::vector<index_t>& neighbours);
+
+    // Phases 2 and 3 of the parallel engine: clusters and labels the
+    // vectors given all their neighbours, as found by find_all_neighbours
+    void label_from_neighbours(index_t min_pts,
+        const std::vector<index_t>& offsets,
+        const std::vector<index_t>& neighbours,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core);
+
+    // Lock-free union-find over the parallel engine's parent array, which
+    // always links the larger root under the smaller, so each cluster's
+    // root ends up being its lowest-indexed core vector
+    static index_t find_root(std::vector<std::atomic<index_t> >& parent,
+        index_t i);
+    static void union_roots(std::vector<std::atomic<index_t> >& parent,
+        index_t a, index_t b);
+
+    void expand_cluster(TNum eps,
         index_t min_pts,
-        index_t cluster_i, 
-        index_t vec_i, 
-        index_set& neighbour_pts,
-        index_set& visited,
-        std::vector<index_t>& results);
+        index_t cluster_i,
+        index_list& neighbours,
+        std::vector<bool>& visited,
+        std::vector<index_t>& results,
+        std::vector<index_t>* core,
+        index_list& frontier);
 
     void expand_cluster_inner(TNum eps,
         index_t min_pts,
-        index_t cluster_i, 
-        index_t vec_i, 
-        index_set& pts,
-        index_set& visited,
+        index_t cluster_i,
+        index_list& neighbours,
+        std::vector<bool>& visited,
         std::vector<index_t>& results,
-        index_set& additional_pts);
+        index_list& frontier);
 };
 
+// std::min takes its arguments by reference, so this needs a definition
+template <typename TNum>
+const index_t dbscan<TNum>::query_batch_size;
+
+template <typename TNum>
+void dbscan<TNum>::set_num_threads(index_t num_threads)
+{
+    _pool.reset();
+    _thread_results.clear();
+    if (num_threads > 1) {
+        _pool = std::make_unique<thread_pool>(num_threads);
+        _thread_results.resize(num_threads);
+    }
+}
+
+template <typename TNum>
+template <typename TIncluded>
+index_t dbscan<TNum>::scan_corpus(index_t vec_i, index_list& result,
+        TIncluded included)
+{
+    count_distances(_rows - 1);
+    if (!_pool || _rows < min_rows_per_thread * _pool->num_threads() ||
+            thread_pool::in_task()) {
+        for (index_t i=0; i < _rows; i++) {
+            if (i != vec_i && included(i)) {
+                result.push_back(i);
+            }
+        }
+        return result.size();
+    }
+
+    _pool->parallel_for(_rows, [&] (index_t thread_i, index_t begin, index_t end) {
+        std::vector<index_t>& thread_result = _thread_results[thread_i];
+        thread_result.clear();
+        for (index_t i=begin; i < end; i++) {
+            if (i != vec_i && included(i)) {
+                thread_result.push_back(i);
+            }
+        }
+    });
+
+    // chunks are contiguous and ascending, so appending in thread order
+    // gives the same order as the single-threaded loop
+    for (const auto& thread_result : _thread_results) {
+        result.insert(result.end(), thread_result.begin(), thread_result.end());
+    }
+    return result.size();
+}
+
+template <typename TNum>
+void dbscan<TNum>::region_query_batch(index_t first, index_t count, TNum eps,
+        index_list* results)
+{
+    for (index_t q=0; q < count; q++) {
+        region_query(first + q, eps, results[q]);
+    }
+}
+
+template <typename TNum>
+void dbscan<TNum>::parallel_for(index_t n, const thread_pool::task_t& task)
+{
+    if (_pool) {
+        _pool->parallel_for(n, task);
+    } else {
+        task(0, 0, n);
+    }
+}
+
 template <typename TNum>
 void dbscan<TNum>::run(TNum eps, index_t min_pts, std::vector<index_t>& results, 
         std::vector<index_t>& noise)
 {
-    // Fairly literal implementation of the outer function of DBSCAN
-    results.resize(_rows, -1);
-    noise.resize(_rows, 0);
-    index_set visited;
+    run_engine(eps, min_pts, results, noise, nullptr);
+}
+
+template <typename TNum>
+void dbscan<TNum>::run(TNum eps, index_t min_pts, std::vector<index_t>& results,
+        std::vector<index_t>& noise, std::vector<index_t>& core)
+{
+    run_engine(eps, min_pts, results, noise, &core);
+}
+
+template <typename TNum>
+void dbscan<TNum>::run_engine(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core)
+{
+    if (!_stats) {
+        prepare_region_query(eps);
+        cluster(eps, min_pts, results, noise, core);
+        return;
+    }
+
+    *_stats = dbscan_stats();
+    _distance_evaluations.store(0);
+    clock::time_point start = clock::now();
+    prepare_region_query(eps);
+    _stats->prepare_seconds = seconds_since(start);
+    clock::time_point cluster_start = clock::now();
+    cluster(eps, min_pts, results, noise, core);
+    if (_engine == sequential_engine) {
+        _stats->expand_seconds = seconds_since(cluster_start) -
+            _stats->query_seconds;
+    }
+    _stats->distance_evaluations = _distance_evaluations.load();
+    _stats->total_seconds = seconds_since(start);
+}
+
+template <typename TNum>
+void dbscan<TNum>::cluster(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core)
+{
+    if (_engine == parallel_engine) {
+        run_parallel(eps, min_pts, results, noise, core);
+    } else if (_engine == sampled_engine) {
+        run_sampled(eps, min_pts, results, noise, core);
+    } else {
+        run_sequential(eps, min_pts, results, noise, core);
+    }
+}
+
+template <typename TNum>
+index_t dbscan<TNum>::counted_region_query(index_t vec_i, TNum eps,
+        index_list& result)
+{
+    if (!_stats) {
+        return region_query(vec_i, eps, result);
+    }
+    clock::time_point start = clock::now();
+    index_t num_in_region = region_query(vec_i, eps, result);
+    _stats->query_seconds += seconds_since(start);
+    _stats->region_queries++;
+    return num_in_region;
+}
+
+template <typename TNum>
+index_t dbscan<TNum>::find_root(std::vector<std::atomic<index_t> >& parent,
+        index_t i)
+{
+    while (true) {
+        index_t p = parent[i].load();
+        if (p == i) {
+            return i;
+        }
+        // path halving; if another thread got there first that's fine
+        index_t grandparent = parent[p].load();
+        if (grandparent != p) {
+            parent[i].compare_exchange_weak(p, grandparent);
+        }
+        i = grandparent;
+    }
+}
+
+template <typename TNum>
+void dbscan<TNum>::union_roots(std::vector<std::atomic<index_t> >& parent,
+        index_t a, index_t b)
+{
+    while (true) {
+        a = find_root(parent, a);
+        b = find_root(parent, b);
+        if (a == b) {
+            return;
+        }
+        if (a < b) {
+            std::swap(a, b);
+        }
+        // Only succeeds if a is still a root; otherwise someone else linked
+        // it in the meantime, so go round again from the new roots
+        index_t expected = a;
+        if (parent[a].compare_exchange_strong(expected, b)) {
+            return;
+        }
+    }
+}
+
+template <typename TNum>
+void dbscan<TNum>::run_parallel(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core)
+{
+    // Two-phase parallel DBSCAN. The numbering and noise flags are derived
+    // to match run_sequential exactly: it starts a new cluster at each core
+    // vector not yet reached by an earlier cluster, so clusters are numbered
+    // in order of their lowest-indexed core vector (their "seed"), border
+    // vectors end up in the lowest-numbered cluster they neighbour, and a
+    // non-core vector i is flagged as noise iff no cluster with a seed
+    // before i reaches it.
+    std::vector<index_t> offsets;
+    std::vector<index_t> neighbours;
+    clock::time_point start = clock::now();
+    find_all_neighbours(eps, offsets, neighbours);
+    if (_stats) {
+        _stats->query_seconds = seconds_since(start);
+        _stats->region_queries = _rows;
+    }
+    label_from_neighbours(min_pts, offsets, neighbours, results, noise, core);
+}
+
+template <typename TNum>
+void dbscan<TNum>::find_all_neighbours(TNum eps, std::vector<index_t>& offsets,
+        std::vector<index_t>& neighbours)
+{
+    // Phase 1: every vector's neighbours, in parallel. Each thread handles
+    // a contiguous range of vectors, in batches, so the per-thread lists can
+    // be concatenated in thread order.
+    std::vector<std::vector<index_t> > thread_neighbours(get_num_threads());
+    offsets.assign(_rows + 1, 0);
+    parallel_for(_rows, [&] (index_t thread_i, index_t begin, index_t end) {
+        std::vector<index_t>& flat = thread_neighbours[thread_i];
+        std::vector<index_list> batch_results(query_batch_size);
+        for (index_t first=begin; first < end; first += query_batch_size) {
+            index_t count = std::min(query_batch_size, end - first);
+            for (index_t q=0; q < count; q++) {
+                batch_results[q].clear();
+            }
+            region_query_batch(first, count, eps, &batch_results[0]);
+            for (index_t q=0; q < count; q++) {
+                offsets[first + q + 1] = batch_results[q].size();
+                flat.insert(flat.end(), batch_results[q].begin(),
+                    batch_results[q].end());
+            }
+        }
+    });
+
+    for (index_t i=0; i < _rows; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    neighbours.resize(offsets[_rows]);
+    parallel_for(_rows, [&] (index_t thread_i, index_t begin, index_t end) {
+        const std::vector<index_t>& flat = thread_neighbours[thread_i];
+        std::copy(flat.begin(), flat.end(), neighbours.begin() + offsets[begin]);
+    });
+}
+
+template <typename TNum>
+void dbscan<TNum>::neighbours_of(const std::vector<index_t>& vecs, TNum eps,
+        std::vector<index_t>& offsets, std::vector<index_t>& neighbours)
+{
+    // As find_all_neighbours, one region query at a time as the vectors
+    // needn't be contiguous
+    prepare_region_query(eps);
+    const index_t n = vecs.size();
+    std::vector<std::vector<index_t> > thread_neighbours(get_num_threads());
+    offsets.assign(n + 1, 0);
+    parallel_for(n, [&] (index_t thread_i, index_t begin, index_t end) {
+        std::vector<index_t>& flat = thread_neighbours[thread_i];
+        index_list result;
+        for (index_t k=begin; k < end; k++) {
+            result.clear();
+            region_query(vecs[k], eps, result);
+            offsets[k + 1] = result.size();
+            flat.insert(flat.end(), result.begin(), result.end());
+        }
+    });
+
+    for (index_t k=0; k < n; k++) {
+        offsets[k + 1] += offsets[k];
+    }
+    neighbours.resize(offsets[n]);
+    parallel_for(n, [&] (index_t thread_i, index_t begin, index_t end) {
+        const std::vector<index_t>& flat = thread_neighbours[thread_i];
+        std::copy(flat.begin(), flat.end(), neighbours.begin() + offsets[begin]);
+    });
+}
+
+template <typename TNum>
+void dbscan<TNum>::label_from_neighbours(index_t min_pts,
+        const std::vector<index_t>& offsets,
+        const std::vector<index_t>& neighbours,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core)
+{
+    results.assign(_rows, -1);
+    noise.assign(_rows, 0);
+    if (_stats) {
+        _stats->points_visited = _rows;
+    }
+
+    auto is_core = [&] (index_t i) {
+        return offsets[i + 1] - offsets[i] >= min_pts;
+    };
+    if (core) {
+        core->resize(_rows);
+        for (index_t i=0; i < _rows; i++) {
+            (*core)[i] = is_core(i);
+        }
+    }
+
+    // Phase 2: merge neighbouring core vectors with a concurrent
+    // union-find. Each edge appears in both vectors' lists, so only the one
+    // from the higher index is used.
+    std::vector<std::atomic<index_t> > parent(_rows);
+    clock::time_point start = clock::now();
+    parallel_for(_rows, [&] (index_t thread_i, index_t begin, index_t end) {
+        for (index_t i=begin; i < end; i++) {
+            parent[i].store(i);
+        }
+    });
+    parallel_for(_rows, [&] (index_t thread_i, index_t begin, index_t end) {
+        for (index_t i=begin; i < end; i++) {
+            if (!is_core(i)) {
+                continue;
+            }
+            for (index_t k=offsets[i]; k < offsets[i + 1]; k++) {
+                index_t j = neighbours[k];
+                if (j < i && is_core(j)) {
+                    union_roots(parent, i, j);
+                }
+            }
+        }
+    });
+
+    // (sweep() labels once per eps, so these add up)
+    if (_stats) {
+        _stats->merge_seconds += seconds_since(start);
+        start = clock::now();
+    }
+
+    // Number the clusters in order of their roots, which are their seeds
+    std::vector<index_t> seeds;
+    for (index_t i=0; i < _rows; i++) {
+        if (is_core(i) && parent[i].load() == i) {
+            results[i] = seeds.size();
+            seeds.push_back(i);
+        }
+    }
+
+    // Phase 3: label the rest of the core vectors with their root's
+    // cluster, then attach border vectors. The union-find is no longer
+    // changing, and roots' labels are already set, so this can go in
+    // parallel too.
+    parallel_for(_rows, [&] (index_t thread_i, index_t begin, index_t end) {
+        for (index_t i=begin; i < end; i++) {
+            if (is_core(i)) {
+                index_t root = find_root(parent, i);
+                if (root != i) {
+                    results[i] = results[root];
+                }
+                continue;
+            }
+
+            index_t cluster_i = -1;
+            for (index_t k=offsets[i]; k < offsets[i + 1]; k++) {
+                index_t j = neighbours[k];
+                if (is_core(j)) {
+                    index_t neighbour_cluster = results[find_root(parent, j)];
+                    if (cluster_i == -1 || neighbour_cluster < cluster_i) {
+                        cluster_i = neighbour_cluster;
+                    }
+                }
+            }
+            results[i] = cluster_i;
+            noise[i] = cluster_i == -1 || seeds[cluster_i] > i;
+        }
+    });
+    if (_stats) {
+        _stats->label_seconds += seconds_since(start);
+    }
+}
+
+template <typename TNum>
+void dbscan<TNum>::choose_sample(std::vector<index_t>& sample)
+{
+    index_t m = _sample_count > 0 ? _sample_count :
+        static_cast<index_t>(std::ceil(_sample_fraction * _rows));
+    m = std::min(_rows, std::max<index_t>(m, 1));
+    sample.clear();
+    if (_rows == 0) {
+        return;
+    }
+    // mt19937_64's output is the same everywhere, unlike the standard
+    // distributions', so samples are repeatable across platforms too
+    std::mt19937_64 rng(_seed);
+
+    if (_sampling == uniform_sampling) {
+        // The first m of a partial Fisher-Yates shuffle
+        std::vector<index_t> order(_rows);
+        for (index_t i=0; i < _rows; i++) {
+            order[i] = i;
+        }
+        for (index_t k=0; k < m; k++) {
+            std::swap(order[k], order[k + rng() % (_rows - k)]);
+        }
+        sample.assign(order.begin(), order.begin() + m);
+        std::sort(sample.begin(), sample.end());
+        return;
+    }
+
+    // Greedy k-center: start anywhere, then repeatedly pick the vector
+    // with the largest score to its nearest pick so far (ties going to the
+    // lowest index, so the thread count doesn't matter)
+    std::vector<TNum> nearest(_rows, std::numeric_limits<TNum>::infinity());
+    std::vector<char> picked(_rows, 0);
+    std::vector<std::pair<TNum, index_t> > thread_best(get_num_threads());
+    index_t pick = rng() % _rows;
+    while (true) {
+        sample.push_back(pick);
+        picked[pick] = 1;
+        if (static_cast<index_t>(sample.size()) == m) {
+            break;
+        }
+        std::fill(thread_best.begin(), thread_best.end(),
+            std::make_pair(-std::numeric_limits<TNum>::infinity(), _rows));
+        parallel_for(_rows, [&] (index_t thread_i, index_t begin, index_t end) {
+            auto& best = thread_best[thread_i];
+            for (index_t i=begin; i < end; i++) {
+                nearest[i] = std::min(nearest[i], neighbour_score(i, pick));
+                if (!picked[i] &&
+                        (best.second == _rows || nearest[i] > best.first)) {
+                    best = std::make_pair(nearest[i], i);
+                }
+            }
+        });
+        count_distances(_rows);
+        for (const auto& best : thread_best) {
+            if (best.second != _rows && (thread_best[0].second == _rows ||
+                    best.first > thread_best[0].first)) {
+                thread_best[0] = best;
+            }
+        }
+        pick = thread_best[0].second;
+    }
+    std::sort(sample.begin(), sample.end());
+}
+
+template <typename TNum>
+void dbscan<TNum>::run_sampled(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core)
+{
+    // DBSCAN++ (Jang and Jiang, "DBSCAN++: Towards fast and scalable density
+    // clustering", ICML 2019). Clusters are numbered and noise flagged as
+    // the parallel engine does, but from the sampled core vectors only.
+    results.assign(_rows, -1);
+    noise.assign(_rows, 0);
+    clock::time_point start = clock::now();
+    std::vector<index_t> sample;
+    choose_sample(sample);
+    const index_t m = sample.size();
+
+    // Phase 1: the sample's region queries, in parallel. Only the core
+    // vectors' neighbours are kept, with their scores, to find each other
+    // vector's nearest core vector.
+    std::vector<index_list> sample_neighbours(m);
+    std::vector<std::vector<TNum> > sample_scores(m);
+    std::vector<char> is_core(_rows, 0);
+    parallel_for(m, [&] (index_t thread_i, index_t begin, index_t end) {
+        for (index_t k=begin; k < end; k++) {
+            index_list& found = sample_neighbours[k];
+            if (region_query(sample[k], eps, found) < min_pts) {
+                index_list().swap(found);
+                continue;
+            }
+            is_core[sample[k]] = 1;
+            sample_scores[k].resize(found.size());
+            for (size_t n=0; n < found.size(); n++) {
+                sample_scores[k][n] = neighbour_score(sample[k], found[n]);
+            }
+            count_distances(found.size());
+        }
+    });
+    if (_stats) {
+        _stats->query_seconds = seconds_since(start);
+        _stats->region_queries = m;
+        start = clock::now();
+    }
+    if (core) {
+        core->assign(is_core.begin(), is_core.end());
+    }
+
+    // Phase 2: merge neighbouring core vectors, as the parallel engine does
+    std::vector<std::atomic<index_t> > parent(_rows);
+    parallel_for(_rows, [&] (index_t thread_i, index_t begin, index_t end) {
+        for (index_t i=begin; i < end; i++) {
+            parent[i].store(i);
+        }
+    });
+    parallel_for(m, [&] (index_t thread_i, index_t begin, index_t end) {
+        for (index_t k=begin; k < end; k++) {
+            for (auto j : sample_neighbours[k]) {
+                if (j < sample[k] && is_core[j]) {
+                    union_roots(parent, sample[k], j);
+                }
+            }
+        }
+    });
+    if (_stats) {
+        _stats->merge_seconds = seconds_since(start);
+        start = clock::now();
+    }
+
+    // Phase 3: number the clusters in order of their roots, then put every
+    // other vector in its nearest core vector's cluster (the first such
+    // core vector, on a tie)
+    std::vector<index_t> seeds;
+    for (auto i : sample) {
+        if (is_core[i]) {
+            index_t root = find_root(parent, i);
+            if (root == i) {
+                results[i] = seeds.size();
+                seeds.push_back(i);
+            } else {
+                results[i] = results[root];
+            }
+        }
+    }
+    std::vector<TNum> nearest(_rows, std::numeric_limits<TNum>::infinity());
+    for (index_t k=0; k < m; k++) {
+        const index_list& found = sample_neighbours[k];
+        for (size_t n=0; n < found.size(); n++) {
+            index_t j = found[n];
+            if (!is_core[j] && sample_scores[k][n] < nearest[j]) {
+                nearest[j] = sample_scores[k][n];
+                results[j] = results[sample[k]];
+            }
+        }
+    }
+    for (index_t i=0; i < _rows; i++) {
+        noise[i] = !is_core[i] && (results[i] == -1 || seeds[results[i]] > i);
+    }
+    if (_stats) {
+        // the sample, and the other vectors its core vectors reached
+        _stats->points_visited = m;
+        for (index_t i=0; i < _rows; i++) {
+            if (nearest[i] < std::numeric_limits<TNum>::infinity() &&
+                    !std::binary_search(sample.begin(), sample.end(), i)) {
+                _stats->points_visited++;
+            }
+        }
+        _stats->label_seconds = seconds_since(start);
+    }
+}
+
+template <typename TNum>
+void dbscan<TNum>::sweep(const std::vector<TNum>& eps_values, index_t min_pts,
+        std::vector<std::vector<index_t> >& results,
+        std::vector<std::vector<index_t> >& noise)
+{
+    results.resize(eps_values.size());
+    noise.resize(eps_values.size());
+    if (eps_values.empty()) {
+        return;
+    }
+
+    // Find everything's neighbours once at the widest eps, scoring each
+    // pair so the narrower neighbourhoods can be picked out of them
+    size_t widest = 0;
+    for (size_t e=1; e < eps_values.size(); e++) {
+        if (neighbour_threshold(eps_values[e]) >
+                neighbour_threshold(eps_values[widest])) {
+            widest = e;
+        }
+    }
+    if (_stats) {
+        *_stats = dbscan_stats();
+        _distance_evaluations.store(0);
+    }
+    clock::time_point start = clock::now();
+    prepare_region_query(eps_values[widest]);
+    if (_stats) {
+        _stats->prepare_seconds = seconds_since(start);
+    }
+
+    std::vector<index_t> offsets;
+    std::vector<index_t> neighbours;
+    clock::time_point query_start = clock::now();
+    find_all_neighbours(eps_values[widest], offsets, neighbours);
+    if (_stats) {
+        _stats->query_seconds = seconds_since(query_start);
+        _stats->region_queries = _rows;
+    }
+    std::vector<TNum> scores(neighbours.size());
+    parallel_for(_rows, [&] (index_t thread_i, index_t begin, index_t end) {
+        for (index_t i=begin; i < end; i++) {
+            for (index_t k=offsets[i]; k < offsets[i + 1]; k++) {
+                scores[k] = neighbour_score(i, neighbours[k]);
+            }
+        }
+    });
+
+    // Then cluster at each eps from the neighbours within its threshold,
+    // which are exactly those its region queries would have found
+    std::vector<index_t> eps_offsets(_rows + 1);
+    std::vector<index_t> eps_neighbours;
+    eps_neighbours.reserve(neighbours.size());
+    for (size_t e=0; e < eps_values.size(); e++) {
+        const TNum threshold = neighbour_threshold(eps_values[e]);
+        eps_neighbours.clear();
+        for (index_t i=0; i < _rows; i++) {
+            eps_offsets[i] = eps_neighbours.size();
+            for (index_t k=offsets[i]; k < offsets[i + 1]; k++) {
+                if (scores[k] <= threshold) {
+                    eps_neighbours.push_back(neighbours[k]);
+                }
+            }
+        }
+        eps_offsets[_rows] = eps_neighbours.size();
+        label_from_neighbours(min_pts, eps_offsets, eps_neighbours,
+            results[e], noise[e], nullptr);
+    }
+    if (_stats) {
+        _stats->distance_evaluations = _distance_evaluations.load();
+        _stats->total_seconds = seconds_since(start);
+    }
+}
+
+template <typename TNum>
+void dbscan<TNum>::optics(TNum max_eps, index_t min_pts,
+        optics_ordering<TNum>& ordering)
+{
+    const TNum undefined = std::numeric_limits<TNum>::infinity();
+    ordering.max_eps = max_eps;
+    ordering.min_pts = min_pts;
+    ordering.order.clear();
+    ordering.order.reserve(_rows);
+    ordering.reachability.assign(_rows, undefined);
+    ordering.core_distance.assign(_rows, undefined);
+    ordering.attach_distance.assign(_rows, undefined);
+    ordering.attach_to.assign(_rows, -1);
+    prepare_region_query(max_eps);
+
+    std::vector<bool> processed(_rows, false);
+    index_list neighbours;
+    neighbours.reserve(_rows);
+    std::vector<TNum> scores;
+    scores.reserve(_rows);
+    std::vector<TNum> nearest;
+    nearest.reserve(_rows);
+
+    // Seeds still to visit, nearest first (lowest index on ties, so the
+    // order is deterministic). Entries aren't updated in place; when a
+    // vector's reachability drops it's pushed again, and stale entries are
+    // skipped when popped.
+    typedef std::pair<TNum, index_t> seed_t;
+    std::priority_queue<seed_t, std::vector<seed_t>, std::greater<seed_t> >
+        seeds;
+
+    // Visits vector p: finds its core distance and, if it's a core vector,
+    // offers its neighbours as seeds
+    auto visit = [&] (index_t p) {
+        processed[p] = true;
+        ordering.order.push_back(p);
+
+        neighbours.clear();
+        index_t num_in_region = region_query(p, max_eps, neighbours);
+        if (num_in_region < min_pts) {
+            return;
+        }
+
+        scores.resize(num_in_region);
+        for (index_t k=0; k < num_in_region; k++) {
+            scores[k] = neighbour_score(p, neighbours[k]);
+        }
+        TNum core_distance = -undefined;
+        if (min_pts > 0) {
+            nearest.assign(scores.begin(), scores.end());
+            std::nth_element(nearest.begin(), nearest.begin() + min_pts - 1,
+                nearest.end());
+            core_distance = nearest[min_pts - 1];
+        }
+        ordering.core_distance[p] = core_distance;
+
+        for (index_t k=0; k < num_in_region; k++) {
+            index_t o = neighbours[k];
+            TNum reachability = std::max(core_distance, scores[k]);
+            if (reachability < ordering.attach_distance[o]) {
+                ordering.attach_distance[o] = reachability;
+                ordering.attach_to[o] = p;
+            }
+            if (processed[o]) {
+                continue;
+            }
+            if (reachability < ordering.reachability[o]) {
+                ordering.reachability[o] = reachability;
+                seeds.push(seed_t(reachability, o));
+            }
+        }
+    };
+
+    for (index_t i=0; i < _rows; i++) {
+        if (processed[i]) {
+            continue;
+        }
+        visit(i);
+        while (!seeds.empty()) {
+            seed_t seed = seeds.top();
+            seeds.pop();
+            if (!processed[seed.second] &&
+                    seed.first == ordering.reachability[seed.second]) {
+                visit(seed.second);
+            }
+        }
+    }
+}
+
+template <typename TNum>
+void dbscan<TNum>::extract_dbscan(const optics_ordering<TNum>& ordering,
+        TNum eps, std::vector<index_t>& results)
+{
+    const TNum threshold = neighbour_threshold(eps);
+    if (threshold > neighbour_threshold(ordering.max_eps)) {
+        throw std::invalid_argument("eps is wider than the ordering's max_eps");
+    }
+
+    // Walking the ordering, a core vector that isn't reachable within eps
+    // from the ones before it starts a new cluster, and the rest join the
+    // current one
+    const index_t rows = ordering.order.size();
+    auto is_core = [&] (index_t i) {
+        return ordering.core_distance[i] <= threshold;
+    };
+    results.assign(rows, -1);
+    std::vector<index_t> seeds;
+    for (auto p : ordering.order) {
+        if (!is_core(p)) {
+            continue;
+        }
+        if (ordering.reachability[p] > threshold || seeds.empty()) {
+            seeds.push_back(p);
+        }
+        results[p] = seeds.size() - 1;
+    }
+
+    // run() numbers clusters in order of their lowest-indexed core vector,
+    // so renumber to match
+    for (index_t i=0; i < rows; i++) {
+        if (is_core(i) && seeds[results[i]] > i) {
+            seeds[results[i]] = i;
+        }
+    }
+    std::vector<index_t> by_seed(seeds.size());
+    for (size_t c=0; c < seeds.size(); c++) {
+        by_seed[c] = c;
+    }
+    std::sort(by_seed.begin(), by_seed.end(),
+        [&] (index_t a, index_t b) { return seeds[a] < seeds[b]; });
+    std::vector<index_t> renumber(seeds.size());
+    for (size_t c=0; c < by_seed.size(); c++) {
+        renumber[by_seed[c]] = c;
+    }
+    for (index_t i=0; i < rows; i++) {
+        if (is_core(i)) {
+            results[i] = renumber[results[i]];
+        }
+    }
+
+    // Then border vectors join the cluster of a core vector they're within
+    // eps of, if there is one
+    for (index_t i=0; i < rows; i++) {
+        if (!is_core(i) && ordering.attach_distance[i] <= threshold) {
+            results[i] = results[ordering.attach_to[i]];
+        }
+    }
+}
+
+template <typename TNum>
+void dbscan<TNum>::run_sequential(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core)
+{
+    // Fairly literal implementation of the outer function of DBSCAN.
+    //
+    // All the working state is allocated up front at its maximum size and
+    // reused, so the run doesn't allocate per query or per cluster: visited
+    // is a bit vector, region query results go into one reused buffer, and
+    // each vector enters the frontier at most once (when it's first
+    // visited), so the frontier never holds more than _rows entries.
+    results.assign(_rows, -1);
+    noise.assign(_rows, 0);
+    if (core) {
+        core->assign(_rows, 0);
+    }
+    std::vector<bool> visited(_rows, false);
+    index_list neighbours;
+    neighbours.reserve(_rows);
+    index_list frontier;
+    frontier.reserve(_rows);
 
     index_t cluster_i = -1;
 
     for (index_t i=0; i < _rows; i++) {
-        if (visited.find(i) != visited.end()) {
+        if (visited[i]) {
             continue;
         }
 
-        visited.insert(i);
+        visited[i] = true;
+        if (_stats) {
+            _stats->points_visited++;
+        }
 
-        index_set query_result;
-        int num_in_region = region_query(i, eps, query_result);
+        neighbours.clear();
+        index_t num_in_region = counted_region_query(i, eps, neighbours);
 
         if (num_in_region < min_pts) {
             noise[i] = true;
             continue;
         }
 
+        if (core) {
+            (*core)[i] = 1;
+        }
         cluster_i++;
-        expand_cluster(eps, min_pts, cluster_i, i, query_result, visited, results);
+        results[i] = cluster_i;
+        expand_cluster(eps, min_pts, cluster_i, neighbours, visited, results,
+            core, frontier);
     }
 }
 
 template <typename TNum>
-void dbscan<TNum>::expand_cluster(TNum eps, 
+void dbscan<TNum>::expand_cluster(TNum eps,
     index_t min_pts,
-    index_t cluster_i, 
-    index_t vec_i, 
-    index_set& neighbour_pts,
-    index_set& visited,
-    std::vector<index_t>& results)
+    index_t cluster_i,
+    index_list& neighbours,
+    std::vector<bool>& visited,
+    std::vector<index_t>& results,
+    std::vector<index_t>* core,
+    index_list& frontier)
 {
-    results[vec_i] = cluster_i;
+    // neighbours holds the seed's region query results on entry. The
+    // frontier is processed in waves: each call to expand_cluster_inner
+    // handles the vectors added by the previous wave, appending the next
+    // wave's to the end, until a wave adds nothing.
+    frontier.clear();
+    expand_cluster_inner(eps, min_pts, cluster_i, neighbours, visited,
+        results, frontier);
 
-    auto additional_pts = std::make_unique<index_set>();
-    expand_cluster_inner(eps, min_pts, cluster_i, vec_i, neighbour_pts, 
-            visited, results, *additional_pts);
-
-    while (additional_pts->size()) {
-        auto next_additional_pts = std::make_unique<index_set>();
-        expand_cluster_inner(eps, min_pts, cluster_i, vec_i, *additional_pts, 
-                visited, results, *next_additional_pts);
-        additional_pts.swap(next_additional_pts);
+    size_t wave_start = 0;
+    while (wave_start < frontier.size()) {
+        size_t wave_end = frontier.size();
+        if (_stats) {
+            _stats->expand_waves++;
+            _stats->peak_frontier = std::max(_stats->peak_frontier,
+                index_t(wave_end - wave_start));
+        }
+        for (size_t k=wave_start; k < wave_end; k++) {
+            neighbours.clear();
+            index_t num_close_neighbours = counted_region_query(frontier[k],
+                eps, neighbours);
+            if (num_close_neighbours >= min_pts) {
+                if (core) {
+                    (*core)[frontier[k]] = 1;
+                }
+                expand_cluster_inner(eps, min_pts, cluster_i, neighbours,
+                    visited, results, frontier);
+            }
+        }
+        wave_start = wave_end;
     }
 }
 
 template <typename TNum>
 void dbscan<TNum>::expand_cluster_inner(TNum eps,
     index_t min_pts,
-    index_t cluster_i, 
-    index_t vec_i, 
-    index_set& pts,
-    index_set& visited,
+    index_t cluster_i,
+    index_list& neighbours,
+    std::vector<bool>& visited,
     std::vector<index_t>& results,
-    index_set& additional_pts)
+    index_list& frontier)
 {
-    // Fairly literal implementation of the inner function of DBSCAN
-    for (const auto& pt_i : pts) {
-        if (visited.find(pt_i) == visited.end()) {
-            visited.insert(pt_i);
-
-            index_set region_query_results;
-            int num_close_neighbours = region_query(
-                pt_i, 
-                eps, 
-                region_query_results);
-
-            if (num_close_neighbours >= min_pts) {
-                for (const auto& rq_i : region_query_results) {
-                    // The algorithm calls for the pts to be merged with the
-                    // set we're currently iterating over, which isn't possible
-                    // with c++ containers - so we accumulate them in
-                    // additional pts, which if non-empty will cause the caller
-                    // to call this function again, passing it in.
-                    // 
-                    // You could also just recurse, but this way saves stack
-                    // space.
-                    if (pts.find(rq_i) == pts.end()) {
-                        additional_pts.insert(rq_i);
-                    }
-                }
+    // Fairly literal implementation of the inner function of DBSCAN, for the
+    // neighbours of one core vector: any that aren't yet in a cluster join
+    // this one (border vectors, including those previously flagged as noise,
+    // stay in the first cluster to reach them), and any not yet visited are
+    // marked visited and queued on the frontier to have their own
+    // neighbourhoods checked.
+    for (const auto& pt_i : neighbours) {
+        if (!visited[pt_i]) {
+            visited[pt_i] = true;
+            frontier.push_back(pt_i);
+            if (_stats) {
+                _stats->points_visited++;
             }
         }
 
@@ -162,7 +1262,7 @@ void dbscan<TNum>::expand_cluster_inner(TNum eps,
             results[pt_i] = cluster_i;
         }
     }
-};
+}
 
 }
 #endif
@@ -0,0 +1,571 @@
+#ifndef __DBSCAN_APPROX_H__
+#define __DBSCAN_APPROX_H__
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "dbscan_nonsparse.h"
+
+namespace libdbscan {
+
+template <typename TNum>
+class dbscan_rho_approx : public dbscan_nonsparse<TNum> {
+    // Approximate dbscan for huge, low-dimensional (2-4 columns) dense
+    // corpora with euclidean distance: rho-approximate DBSCAN, from Gan and
+    // Tao, "DBSCAN Revisited" (SIGMOD 2015), which runs in close to linear
+    // time however dense the clusters are, as it never lists anyone's
+    // neighbours.
+    //
+    // The corpus is bucketed into a grid of cells of side eps / sqrt(cols),
+    // so any two vectors in the same cell are within eps of each other. A
+    // cell of more than min_pts vectors is therefore all core without any
+    // distance checks; the vectors of other cells count their neighbours in
+    // the nearby cells, stopping at min_pts, so which vectors are core is
+    // exact.
+    //
+    // Clusters are made of whole cells: two cells with core vectors are
+    // joined if a core vector of one is within eps of a core vector of the
+    // other. That's decided approximately, with a small tree over each
+    // cell's core vectors that stops descending once a node is less than
+    // rho * eps across, so pairs within eps are always joined, pairs further
+    // apart than eps * (1 + rho) never are, and those in between may or may
+    // not be. The clusters found therefore lie between exact DBSCAN's at
+    // eps and at eps * (1 + rho). Border vectors go in the lowest-numbered
+    // cluster with a core vector (approximately, as above) within eps of
+    // them.
+    //
+    // With rho 0 the results are the same as dbscan_nonsparse's, up to
+    // rounding right at eps. Clusters are numbered and noise flagged as by
+    // the engines, but set_engine has no effect: each phase is split across
+    // the thread pool set up by set_num_threads. eps <= 0 has no cells to
+    // speak of, so falls back to the engine's exact clustering. sweep() and
+    // optics() are exact, using dbscan_nonsparse's region queries.
+    //
+    // The nearby cells of each cell grow exponentially with the columns
+    // (thousands with 4, over a hundred thousand with 6), so more than
+    // max_cols aren't accepted.
+public:
+    static constexpr double default_rho = 0.001;
+    static const index_t max_cols = 6;
+
+    // Throws std::invalid_argument if cols > max_cols
+    dbscan_rho_approx(const TNum* corpus, index_t rows, index_t cols,
+            double rho = default_rho);
+    virtual ~dbscan_rho_approx() {}
+
+protected:
+    virtual void cluster(TNum eps, index_t min_pts,
+            std::vector<index_t>& results, std::vector<index_t>& noise,
+            std::vector<index_t>* core) override;
+
+private:
+    typedef std::vector<long> cell_t;
+
+    struct cell_hash {
+        size_t operator () (const cell_t& cell) const {
+            size_t h = 0;
+            for (auto c : cell) {
+                h = h * 1000003 ^ std::hash<long>()(c);
+            }
+            return h;
+        }
+    };
+
+    struct grid_t {
+        // Row indexes ordered by cell, cell k's being order[starts[k]] to
+        // order[starts[k + 1] - 1]
+        std::vector<index_t> order;
+        std::vector<index_t> starts;
+        // The other cells that could hold vectors within eps of cell k's
+        // are near[near_starts[k]] to near[near_starts[k + 1] - 1]
+        std::vector<index_t> near_starts;
+        std::vector<index_t> near;
+    };
+
+    struct tree_t {
+        // A cell's core vectors, ordered so each node's are contiguous
+        std::vector<index_t> rows;
+        struct node_t {
+            // [begin, end) of rows; left and right are -1 for leaves
+            index_t begin, end, left, right;
+        };
+        std::vector<node_t> nodes;
+        // Each node's bounding box, cols lower bounds then cols upper bounds
+        std::vector<double> boxes;
+    };
+
+    // Vectors per tree leaf, below which it's quicker to check them all
+    static const index_t leaf_size = 8;
+
+    void build_grid(TNum eps, grid_t& grid);
+    void build_tree(TNum eps, tree_t& tree) const;
+    // Whether vec is within eps of any of the tree's vectors, give or take
+    // rho as described above
+    bool tree_reaches(const tree_t& tree, const TNum* vec, TNum eps);
+    // Largest squared distance between points of two trees' root boxes
+    double max_box_distance(const tree_t& a, const tree_t& b) const;
+
+    double _rho;
+};
+
+template <typename TNum>
+dbscan_rho_approx<TNum>::dbscan_rho_approx(const TNum* corpus, index_t rows,
+        index_t cols, double rho) :
+    dbscan_nonsparse<TNum>(corpus, rows, cols),
+    _rho(rho)
+{
+    if (cols > max_cols) {
+        throw std::invalid_argument(
+            "approx needs at most " + std::to_string(max_cols) + " columns");
+    }
+}
+
+template <typename TNum>
+void dbscan_rho_approx<TNum>::build_grid(TNum eps, grid_t& grid)
+{
+    const index_t rows = this->_rows;
+    const index_t cols = this->_cols;
+    // Shrink the cells slightly so that rounding can't put two vectors
+    // further than eps apart in the same cell
+    const double side = eps / std::sqrt(double(cols)) * (1 - 1e-6);
+
+    std::vector<long> row_cells(rows * cols);
+    this->parallel_for(rows, [&] (index_t thread_i, index_t begin, index_t end) {
+        for (index_t k=begin * cols; k < end * cols; k++) {
+            row_cells[k] = static_cast<long>(std::floor(this->_corpus[k] / side));
+        }
+    });
+    auto key = [&] (index_t i) { return &row_cells[i * cols]; };
+
+    grid.order.resize(rows);
+    std::iota(grid.order.begin(), grid.order.end(), 0);
+    std::sort(grid.order.begin(), grid.order.end(), [&] (index_t a, index_t b) {
+        return std::lexicographical_compare(key(a), key(a) + cols,
+            key(b), key(b) + cols);
+    });
+    grid.starts.clear();
+    for (index_t k=0; k < rows; k++) {
+        if (k == 0 || !std::equal(key(grid.order[k]), key(grid.order[k]) + cols,
+                key(grid.order[k - 1]))) {
+            grid.starts.push_back(k);
+        }
+    }
+    grid.starts.push_back(rows);
+    const index_t num_cells = grid.starts.size() - 1;
+
+    std::unordered_map<cell_t, index_t, cell_hash> cells;
+    cells.reserve(num_cells);
+    for (index_t c=0; c < num_cells; c++) {
+        const long* cell = key(grid.order[grid.starts[c]]);
+        cells.emplace(cell_t(cell, cell + cols), c);
+    }
+
+    // The offsets to every other cell whose closest point is within eps,
+    // walking [-reach, reach]^cols like an odometer
+    const long reach = static_cast<long>(std::floor(eps / side)) + 1;
+    std::vector<long> offsets;
+    std::vector<long> offset(cols, -reach);
+    while (true) {
+        double gap_squared = 0;
+        bool is_zero = true;
+        for (index_t j=0; j < cols; j++) {
+            double gap = std::max(0L, std::abs(offset[j]) - 1) * side;
+            gap_squared += gap * gap;
+            is_zero = is_zero && offset[j] == 0;
+        }
+        if (!is_zero && gap_squared <= double(eps) * eps * (1 + 1e-6)) {
+            offsets.insert(offsets.end(), offset.begin(), offset.end());
+        }
+
+        index_t j = 0;
+        for (; j < cols && offset[j] == reach; j++) {
+            offset[j] = -reach;
+        }
+        if (j == cols) {
+            break;
+        }
+        offset[j]++;
+    }
+    const index_t num_offsets = cols ? offsets.size() / cols : 0;
+
+    // Each cell's nearby cells, in parallel; chunks are contiguous and
+    // ascending, so the per-thread lists concatenate in cell order
+    std::vector<std::vector<index_t> > thread_near(this->get_num_threads());
+    grid.near_starts.assign(num_cells + 1, 0);
+    this->parallel_for(num_cells, [&] (index_t thread_i, index_t begin, index_t end) {
+        std::vector<index_t>& flat = thread_near[thread_i];
+        flat.clear();
+        cell_t neighbour(cols);
+        for (index_t c=begin; c < end; c++) {
+            const long* cell = key(grid.order[grid.starts[c]]);
+            const index_t before = flat.size();
+            for (index_t o=0; o < num_offsets; o++) {
+                for (index_t j=0; j < cols; j++) {
+                    neighbour[j] = cell[j] + offsets[o * cols + j];
+                }
+                auto iter = cells.find(neighbour);
+                if (iter != cells.end()) {
+                    flat.push_back(iter->second);
+                }
+            }
+            grid.near_starts[c + 1] = flat.size() - before;
+        }
+    });
+    for (index_t c=0; c < num_cells; c++) {
+        grid.near_starts[c + 1] += grid.near_starts[c];
+    }
+    grid.near.clear();
+    grid.near.reserve(grid.near_starts[num_cells]);
+    for (const auto& flat : thread_near) {
+        grid.near.insert(grid.near.end(), flat.begin(), flat.end());
+    }
+}
+
+template <typename TNum>
+void dbscan_rho_approx<TNum>::build_tree(TNum eps, tree_t& tree) const
+{
+    // Splits the widest side of each node's bounding box in half, until
+    // nodes are small enough to check every vector or narrower than
+    // rho * eps, when they count as a single point
+    const index_t cols = this->_cols;
+    const double node_width = _rho * eps;
+    tree.nodes.clear();
+    tree.boxes.clear();
+
+    auto add_node = [&] (index_t begin, index_t end) {
+        tree.nodes.push_back({begin, end, -1, -1});
+        const index_t box = tree.boxes.size();
+        tree.boxes.resize(box + 2 * cols);
+        for (index_t j=0; j < cols; j++) {
+            tree.boxes[box + j] = std::numeric_limits<double>::infinity();
+            tree.boxes[box + cols + j] = -std::numeric_limits<double>::infinity();
+        }
+        for (index_t k=begin; k < end; k++) {
+            const TNum* row = &this->_corpus[tree.rows[k] * cols];
+            for (index_t j=0; j < cols; j++) {
+                tree.boxes[box + j] = std::min<double>(tree.boxes[box + j], row[j]);
+                tree.boxes[box + cols + j] =
+                    std::max<double>(tree.boxes[box + cols + j], row[j]);
+            }
+        }
+        return index_t(tree.nodes.size() - 1);
+    };
+
+    std::vector<index_t> stack(1, add_node(0, tree.rows.size()));
+    while (!stack.empty()) {
+        const index_t node_i = stack.back();
+        stack.pop_back();
+        const index_t begin = tree.nodes[node_i].begin;
+        const index_t end = tree.nodes[node_i].end;
+        if (end - begin <= leaf_size) {
+            continue;
+        }
+
+        const double* lo = &tree.boxes[node_i * 2 * cols];
+        const double* hi = lo + cols;
+        index_t widest = 0;
+        double diameter_squared = 0;
+        for (index_t j=0; j < cols; j++) {
+            diameter_squared += (hi[j] - lo[j]) * (hi[j] - lo[j]);
+            if (hi[j] - lo[j] > hi[widest] - lo[widest]) {
+                widest = j;
+            }
+        }
+        // (a box of identical vectors has no width to split)
+        if (hi[widest] == lo[widest] ||
+                (_rho > 0 && diameter_squared <= node_width * node_width)) {
+            continue;
+        }
+
+        const double mid = (lo[widest] + hi[widest]) / 2;
+        auto split = std::partition(tree.rows.begin() + begin,
+            tree.rows.begin() + end, [&] (index_t i) {
+                return this->_corpus[i * cols + widest] < mid;
+            });
+        const index_t split_k = split - tree.rows.begin();
+        const index_t left = add_node(begin, split_k);
+        const index_t right = add_node(split_k, end);
+        tree.nodes[node_i].left = left;
+        tree.nodes[node_i].right = right;
+        stack.push_back(left);
+        stack.push_back(right);
+    }
+}
+
+template <typename TNum>
+bool dbscan_rho_approx<TNum>::tree_reaches(const tree_t& tree,
+        const TNum* vec, TNum eps)
+{
+    const index_t cols = this->_cols;
+    const TNum eps_squared = eps * eps;
+    // Box distances are summed in a different order from
+    // euclidean_distance, so allow a little slack when pruning, as
+    // dbscan_kdtree does
+    const double prune_distance = double(eps_squared) * (1 + 1e-4);
+    const double approx_distance = eps * (1 + _rho);
+
+    // Per thread since queries run concurrently, and kept around to save
+    // reallocating it
+    static thread_local std::vector<index_t> stack;
+    stack.assign(1, 0);
+    index_t compared = 0;
+    bool reached = false;
+    while (!stack.empty() && !reached) {
+        const auto& node = tree.nodes[stack.back()];
+        const double* lo = &tree.boxes[stack.back() * 2 * cols];
+        const double* hi = lo + cols;
+        stack.pop_back();
+
+        double min_distance = 0;
+        double max_distance = 0;
+        double diameter = 0;
+        for (index_t j=0; j < cols; j++) {
+            double below = lo[j] - vec[j];
+            double above = vec[j] - hi[j];
+            double gap = std::max(0.0, std::max(below, above));
+            double far = std::max(std::abs(below), std::abs(above));
+            min_distance += gap * gap;
+            max_distance += far * far;
+            diameter += (hi[j] - lo[j]) * (hi[j] - lo[j]);
+        }
+        if (min_distance > prune_distance) {
+            continue;
+        }
+        // Everything in the box is within eps, or within eps * (1 + rho)
+        // of the closest thing in it that's within eps
+        if (max_distance <= eps_squared || (_rho > 0 &&
+                std::sqrt(min_distance) + std::sqrt(diameter) <= approx_distance)) {
+            reached = true;
+            break;
+        }
+
+        if (node.left != -1) {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+            continue;
+        }
+        for (index_t k=node.begin; k < node.end && !reached; k++) {
+            const TNum* row = &this->_corpus[tree.rows[k] * cols];
+            compared++;
+            reached = euclidean_distance<TNum>(cols, row, vec) <= eps_squared;
+        }
+    }
+
+    this->count_distances(compared);
+    return reached;
+}
+
+template <typename TNum>
+double dbscan_rho_approx<TNum>::max_box_distance(const tree_t& a,
+        const tree_t& b) const
+{
+    const index_t cols = this->_cols;
+    const double* a_lo = &a.boxes[0];
+    const double* b_lo = &b.boxes[0];
+    double distance = 0;
+    for (index_t j=0; j < cols; j++) {
+        double far = std::max(std::abs(a_lo[cols + j] - b_lo[j]),
+            std::abs(b_lo[cols + j] - a_lo[j]));
+        distance += far * far;
+    }
+    return distance;
+}
+
+template <typename TNum>
+void dbscan_rho_approx<TNum>::cluster(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core)
+{
+    if (!(eps > 0)) {
+        dbscan<TNum>::cluster(eps, min_pts, results, noise, core);
+        return;
+    }
+
+    const index_t rows = this->_rows;
+    const index_t cols = this->_cols;
+    const TNum eps_squared = eps * eps;
+
+    grid_t grid;
+    build_grid(eps, grid);
+    const index_t num_cells = grid.starts.size() - 1;
+
+    // Which vectors are core, exactly
+    std::vector<char> is_core(rows, 0);
+    this->parallel_for(num_cells, [&] (index_t thread_i, index_t begin, index_t end) {
+        index_t compared = 0;
+        for (index_t c=begin; c < end; c++) {
+            const index_t cell_size = grid.starts[c + 1] - grid.starts[c];
+            for (index_t k=grid.starts[c]; k < grid.starts[c + 1]; k++) {
+                const index_t i = grid.order[k];
+                const TNum* vec = &this->_corpus[i * cols];
+                index_t count = cell_size - 1;
+                for (index_t n=grid.near_starts[c];
+                        n < grid.near_starts[c + 1] && count < min_pts; n++) {
+                    const index_t other = grid.near[n];
+                    for (index_t k2=grid.starts[other];
+                            k2 < grid.starts[other + 1] && count < min_pts; k2++) {
+                        const TNum* row = &this->_corpus[grid.order[k2] * cols];
+                        compared++;
+                        if (euclidean_distance<TNum>(cols, row, vec) <= eps_squared) {
+                            count++;
+                        }
+                    }
+                }
+                is_core[i] = count >= min_pts;
+            }
+        }
+        this->count_distances(compared);
+    });
+
+    // A tree over the core vectors of each cell that has any
+    std::vector<index_t> core_cells;
+    std::vector<index_t> tree_of(num_cells, -1);
+    for (index_t c=0; c < num_cells; c++) {
+        for (index_t k=grid.starts[c]; k < grid.starts[c + 1]; k++) {
+            if (is_core[grid.order[k]]) {
+                tree_of[c] = core_cells.size();
+                core_cells.push_back(c);
+                break;
+            }
+        }
+    }
+    const index_t num_trees = core_cells.size();
+    std::vector<tree_t> trees(num_trees);
+    this->parallel_for(num_trees, [&] (index_t thread_i, index_t begin, index_t end) {
+        for (index_t t=begin; t < end; t++) {
+            const index_t c = core_cells[t];
+            for (index_t k=grid.starts[c]; k < grid.starts[c + 1]; k++) {
+                if (is_core[grid.order[k]]) {
+                    trees[t].rows.push_back(grid.order[k]);
+                }
+            }
+            build_tree(eps, trees[t]);
+        }
+    });
+
+    // Join nearby core cells, querying the tree of the bigger one with each
+    // core vector of the smaller until one reaches it
+    std::vector<std::vector<std::pair<index_t, index_t> > > thread_edges(
+        this->get_num_threads());
+    this->parallel_for(num_trees, [&] (index_t thread_i, index_t begin, index_t end) {
+        auto& edges = thread_edges[thread_i];
+        edges.clear();
+        for (index_t t=begin; t < end; t++) {
+            const index_t c = core_cells[t];
+            for (index_t n=grid.near_starts[c]; n < grid.near_starts[c + 1]; n++) {
+                const index_t t2 = tree_of[grid.near[n]];
+                // each pair once
+                if (t2 <= t) {
+                    continue;
+                }
+                if (max_box_distance(trees[t], trees[t2]) <= eps_squared) {
+                    edges.emplace_back(t, t2);
+                    continue;
+                }
+                const bool smaller = trees[t].rows.size() <= trees[t2].rows.size();
+                const tree_t& from = smaller ? trees[t] : trees[t2];
+                const tree_t& to = smaller ? trees[t2] : trees[t];
+                for (auto i : from.rows) {
+                    if (tree_reaches(to, &this->_corpus[i * cols], eps)) {
+                        edges.emplace_back(t, t2);
+                        break;
+                    }
+                }
+            }
+        }
+    });
+
+    // Union-find over the core cells, then number the clusters in order of
+    // their lowest-indexed core vector (their seed), as the engines do
+    std::vector<index_t> parent(num_trees);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find_root = [&] (index_t t) {
+        while (parent[t] != t) {
+            parent[t] = parent[parent[t]];
+            t = parent[t];
+        }
+        return t;
+    };
+    for (const auto& edges : thread_edges) {
+        for (const auto& edge : edges) {
+            index_t a = find_root(edge.first);
+            index_t b = find_root(edge.second);
+            if (a != b) {
+                parent[std::max(a, b)] = std::min(a, b);
+            }
+        }
+    }
+
+    std::vector<index_t> root_seed(num_trees, rows);
+    for (index_t t=0; t < num_trees; t++) {
+        index_t root = find_root(t);
+        for (auto i : trees[t].rows) {
+            root_seed[root] = std::min(root_seed[root], i);
+        }
+    }
+    std::vector<index_t> roots;
+    for (index_t t=0; t < num_trees; t++) {
+        if (parent[t] == t) {
+            roots.push_back(t);
+        }
+    }
+    std::sort(roots.begin(), roots.end(), [&] (index_t a, index_t b) {
+        return root_seed[a] < root_seed[b];
+    });
+    std::vector<index_t> seeds(roots.size());
+    std::vector<index_t> cluster_of_root(num_trees, -1);
+    for (size_t k=0; k < roots.size(); k++) {
+        cluster_of_root[roots[k]] = k;
+        seeds[k] = root_seed[roots[k]];
+    }
+    std::vector<index_t> cluster_of_tree(num_trees);
+    for (index_t t=0; t < num_trees; t++) {
+        cluster_of_tree[t] = cluster_of_root[find_root(t)];
+    }
+
+    // Label everything: core vectors by their cell, border vectors by the
+    // lowest-numbered cluster that reaches them, which includes their own
+    // cell's if it has a core vector, as that's within eps
+    results.assign(rows, -1);
+    noise.assign(rows, 0);
+    if (core) {
+        core->assign(rows, 0);
+    }
+    this->parallel_for(num_cells, [&] (index_t thread_i, index_t begin, index_t end) {
+        for (index_t c=begin; c < end; c++) {
+            const index_t own = tree_of[c];
+            for (index_t k=grid.starts[c]; k < grid.starts[c + 1]; k++) {
+                const index_t i = grid.order[k];
+                index_t cluster_i = own == -1 ? -1 : cluster_of_tree[own];
+                if (!is_core[i]) {
+                    const TNum* vec = &this->_corpus[i * cols];
+                    for (index_t n=grid.near_starts[c]; n < grid.near_starts[c + 1]; n++) {
+                        const index_t t2 = tree_of[grid.near[n]];
+                        if (t2 == -1 || (cluster_i != -1 &&
+                                cluster_of_tree[t2] >= cluster_i)) {
+                            continue;
+                        }
+                        if (tree_reaches(trees[t2], vec, eps)) {
+                            cluster_i = cluster_of_tree[t2];
+                        }
+                    }
+                }
+                results[i] = cluster_i;
+                noise[i] = cluster_i == -1 || seeds[cluster_i] > i;
+                if (core) {
+                    (*core)[i] = is_core[i];
+                }
+            }
+        }
+    });
+}
+
+}
+
+#endif
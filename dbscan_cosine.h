@@ -0,0 +1,165 @@
+#ifndef __DBSCAN_COSINE_H__
+#define __DBSCAN_COSINE_H__
+
+#include <cmath>
+
+#include "dbscan_nonsparse.h"
+#include "dbscan_sparse.h"
+
+namespace libdbscan {
+
+template <typename TNum>
+inline TNum cosine_similarity(TNum dot, TNum norm_x, TNum norm_y)
+{
+    // Cosine similarity from a dot product and the two norms; vectors of
+    // all zeros are taken to have a similarity of 0 to everything, as in
+    // cosine_similarity_metric
+    TNum denom = norm_x * norm_y;
+    return denom == 0 ? 0 : dot / denom;
+}
+
+template <typename TNum>
+TNum sparse_dot_product(const sparse_vector_t<TNum>& x,
+        const sparse_vector_t<TNum>& y)
+{
+    // Only the columns where both rows are nonzero contribute
+    TNum sum = 0;
+    index_t x_i = 0;
+    index_t y_i = 0;
+    while (x_i < x.size && y_i < y.size) {
+        if (x.indexes[x_i] < y.indexes[y_i]) {
+            ++x_i;
+        } else if (y.indexes[y_i] < x.indexes[x_i]) {
+            ++y_i;
+        } else {
+            sum += x.values[x_i++] * y.values[y_i++];
+        }
+    }
+    return sum;
+}
+
+template <typename TNum>
+class dbscan_sparse_cosine :
+        public dbscan_sparse<TNum, cosine_similarity_metric<TNum> > {
+    // dbscan implementation using sparse arrays and cosine similarity, which
+    // works out each row's norm once, at construction, rather than on every
+    // comparison as cosine_similarity_metric does, so comparing two rows
+    // only needs the dot product of their shared nonzeros.
+    //
+    // The norms and dot products are summed in the same order as
+    // cosine_similarity_metric's, so the results are identical to using it.
+public:
+    dbscan_sparse_cosine(const TNum* corpus, index_t rows, index_t cols);
+    virtual ~dbscan_sparse_cosine() {}
+
+protected:
+    virtual index_t region_query(index_t vec_i, TNum eps, index_list& result) override;
+
+    TNum similarity(index_t i, index_t j) const {
+        return cosine_similarity(sparse_dot_product(this->row(i), this->row(j)),
+            _norms[i], _norms[j]);
+    }
+
+    virtual TNum neighbour_score(index_t i, index_t j) const override {
+        return -similarity(i, j);
+    }
+
+    // Norm of each row
+    std::vector<TNum> _norms;
+};
+
+template <typename TNum>
+dbscan_sparse_cosine<TNum>::dbscan_sparse_cosine(const TNum* corpus,
+        index_t rows, index_t cols) :
+    dbscan_sparse<TNum, cosine_similarity_metric<TNum> >(corpus, rows, cols),
+    _norms(rows)
+{
+    for (index_t i=0; i < rows; i++) {
+        sparse_vector_t<TNum> vec = this->row(i);
+        TNum norm = 0;
+        for (index_t k=0; k < vec.size; k++) {
+            norm += vec.values[k] * vec.values[k];
+        }
+        _norms[i] = std::sqrt(norm);
+    }
+}
+
+template <typename TNum>
+index_t dbscan_sparse_cosine<TNum>::region_query(index_t vec_i, TNum eps,
+        index_list& result)
+{
+    return this->scan_corpus(vec_i, result, [&] (index_t i) {
+        return similarity(i, vec_i) > eps;
+    });
+}
+
+template <typename TNum>
+class dbscan_nonsparse_cosine : public dbscan_nonsparse<TNum> {
+    // dbscan implementation for dense data with cosine similarity, which
+    // works out each row's norm once, at construction, so comparing two rows
+    // is a single (SIMD) dot product.
+    //
+    // As with cosine_similarity_metric, vectors are neighbours if their
+    // similarity is greater than eps.
+public:
+    dbscan_nonsparse_cosine(const TNum* corpus, index_t rows, index_t cols);
+    virtual ~dbscan_nonsparse_cosine() {}
+
+protected:
+    virtual index_t region_query(index_t vec_i, TNum eps, index_list& result) override;
+
+    // dbscan_nonsparse's blocked batch scan is for euclidean distance only
+    virtual void region_query_batch(index_t first, index_t count, TNum eps,
+            index_list* results) override {
+        dbscan<TNum>::region_query_batch(first, count, eps, results);
+    }
+
+    // The negated similarity, as for cosine_similarity_metric
+    virtual TNum neighbour_score(index_t i, index_t j) const override {
+        const index_t cols = this->_cols;
+        const TNum* row = &this->_corpus[i * cols];
+        const TNum* other = &this->_corpus[j * cols];
+        return -cosine_similarity(dot_product<TNum>(cols, row, other),
+            _norms[i], _norms[j]);
+    }
+    virtual TNum neighbour_threshold(TNum eps) const override {
+        return cosine_similarity_metric<TNum>::threshold(eps);
+    }
+    virtual TNum neighbour_eps(TNum score) const override {
+        return cosine_similarity_metric<TNum>::score_eps(score);
+    }
+
+private:
+    // Norm of each row
+    std::vector<TNum> _norms;
+};
+
+template <typename TNum>
+dbscan_nonsparse_cosine<TNum>::dbscan_nonsparse_cosine(const TNum* corpus,
+        index_t rows, index_t cols) :
+    dbscan_nonsparse<TNum>(corpus, rows, cols),
+    _norms(rows)
+{
+    for (index_t i=0; i < rows; i++) {
+        const TNum* row = &corpus[i * cols];
+        _norms[i] = std::sqrt(dot_product<TNum>(cols, row, row));
+    }
+}
+
+template <typename TNum>
+index_t dbscan_nonsparse_cosine<TNum>::region_query(index_t vec_i, TNum eps,
+        index_list& result)
+{
+    const index_t cols = this->_cols;
+    const TNum* comparison_vector = &this->_corpus[vec_i * cols];
+    const TNum comparison_norm = _norms[vec_i];
+    return this->scan_corpus(vec_i, result, [&] (index_t i) {
+        const TNum* row = &this->_corpus[i * cols];
+        TNum dot = dot_product<TNum>(cols, row, comparison_vector);
+        return cosine_similarity(dot, _norms[i], comparison_norm) > eps;
+    });
+}
+
+}
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef __DBSCAN_FACTORY_H__
+#define __DBSCAN_FACTORY_H__
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+
+#include "dbscan_approx.h"
+#include "dbscan_cosine.h"
+#include "dbscan_grid.h"
+#include "dbscan_inverted.h"
+#include "dbscan_kdtree.h"
+#include "dbscan_lsh.h"
+#include "dbscan_nonsparse.h"
+#include "dbscan_quantized.h"
+#include "dbscan_sparse.h"
+
+namespace libdbscan {
+
+typedef std::tuple<std::string, std::string> argtuple_t;
+
+struct dbscan_options {
+    // Tunables for the implementations that have any; each is ignored by
+    // the implementations it doesn't apply to.
+
+    // Maximum vectors per kd-tree leaf, for the kdtree array type
+    index_t leaf_size = dbscan_kdtree<float>::default_leaf_size;
+
+    // Threads to split each region query's corpus scan across, for the
+    // nonsparse and sparse array types, and to run the parallel engine on;
+    // 0 means one per hardware thread
+    index_t threads = 1;
+
+    // Whether the inverted array type prunes candidates that can't reach
+    // eps using per-column maximum weights
+    bool prune = true;
+
+    // How far past eps the approx array type may join clusters, as a
+    // fraction of eps; 0 makes it exact
+    double rho = dbscan_rho_approx<float>::default_rho;
+
+    // Hash tables, and hyperplanes (bits) per table, for the lsh array type
+    index_t lsh_tables = dbscan_lsh<float>::default_tables;
+    index_t lsh_bits = dbscan_lsh<float>::default_bits;
+
+    // How the quantized array type stores its copy of the corpus: "int8",
+    // "fp16" or "bf16"
+    std::string quantization = "int8";
+
+    // "sequential", "parallel" or "sampled", see dbscan_engine
+    std::string engine = "sequential";
+
+    // For the sampled engine, see dbscan::set_sampling: how many vectors to
+    // query (sample_count if it's > 0, otherwise sample_fraction of them),
+    // picked "uniform"ly or by "kcenter", with the given seed
+    index_t sample_count = 0;
+    double sample_fraction = dbscan<float>::default_sample_fraction;
+    std::string sampling = "uniform";
+    unsigned long seed = 0;
+};
+
+struct dbscan_choices {
+    // dbscan_options' named choices, parsed
+    quantization_type quantization;
+    dbscan_engine engine;
+    dbscan_sampling sampling;
+};
+
+inline dbscan_choices parse_dbscan_options(const std::string& array_type,
+        const dbscan_options& options) {
+    // Throws std::invalid_argument for names it doesn't know, or choices
+    // array_type can't make
+    dbscan_choices choices;
+    if (options.quantization == "int8") {
+        choices.quantization = int8_quantization;
+    } else if (options.quantization == "fp16") {
+        choices.quantization = fp16_quantization;
+    } else if (options.quantization == "bf16") {
+        choices.quantization = bf16_quantization;
+    } else {
+        throw std::invalid_argument("Unknown quantization " +
+            options.quantization);
+    }
+
+    if (options.engine == "sequential") {
+        choices.engine = sequential_engine;
+    } else if (options.engine == "parallel") {
+        choices.engine = parallel_engine;
+    } else if (options.engine == "sampled") {
+        choices.engine = sampled_engine;
+    } else {
+        throw std::invalid_argument("Unknown engine " + options.engine);
+    }
+    // approx clusters by grid cells rather than through the engines; the
+    // sequential and parallel engines' results are its own with rho 0, but
+    // the sampled engine's aren't
+    if (choices.engine == sampled_engine && array_type == "approx") {
+        throw std::invalid_argument("approx can't use the sampled engine");
+    }
+
+    if (options.sampling == "uniform") {
+        choices.sampling = uniform_sampling;
+    } else if (options.sampling == "kcenter") {
+        choices.sampling = kcenter_sampling;
+    } else {
+        throw std::invalid_argument("Unknown sampling " + options.sampling);
+    }
+    return choices;
+}
+
+template <typename TNum>
+std::map<argtuple_t, std::function<std::unique_ptr<dbscan<TNum>>()>>
+dbscan_constructors(const TNum* corpus, index_t rows, index_t cols,
+        const dbscan_options& options, quantization_type quantization) {
+    // The implementations there are, by array type and distance metric;
+    // nothing is constructed until one of them is called
+    return {
+        {
+            argtuple_t("nonsparse", "euclidean"),
+            [=] () {
+                return std::make_unique<dbscan_nonsparse<TNum>>(
+                        corpus, rows, cols);
+            }
+        },
+        {
+            argtuple_t("nonsparse", "cosine"),
+            [=] () {
+                return std::make_unique<dbscan_nonsparse_cosine<TNum>>(
+                        corpus, rows, cols);
+            }
+        },
+        {
+            argtuple_t("grid", "euclidean"),
+            [=] () {
+                return std::make_unique<dbscan_grid<TNum>>(
+                        corpus, rows, cols);
+            }
+        },
+        {
+            argtuple_t("quantized", "euclidean"),
+            [=] () {
+                return std::make_unique<dbscan_quantized<TNum>>(
+                        corpus, rows, cols, quantization);
+            }
+        },
+        {
+            argtuple_t("approx", "euclidean"),
+            [=] () {
+                return std::make_unique<dbscan_rho_approx<TNum>>(
+                        corpus, rows, cols, options.rho);
+            }
+        },
+        {
+            argtuple_t("kdtree", "euclidean"),
+            [=] () {
+                return std::make_unique<dbscan_kdtree<TNum>>(
+                        corpus, rows, cols, options.leaf_size);
+            }
+        },
+        {
+            argtuple_t("sparse", "euclidean"),
+            [=] () {
+                return std::make_unique<dbscan_sparse<TNum>>(
+                        corpus, rows, cols);
+            }
+        },
+        {
+            argtuple_t("sparse", "cosine"),
+            [=] () {
+                return std::make_unique<dbscan_sparse_cosine<TNum>>(
+                        corpus, rows, cols);
+            }
+        },
+        {
+            argtuple_t("lsh", "cosine"),
+            [=] () {
+                return std::make_unique<dbscan_lsh<TNum>>(
+                        corpus, rows, cols, options.lsh_tables,
+                        options.lsh_bits);
+            }
+        },
+        {
+            argtuple_t("inverted", "cosine"),
+            [=] () {
+                return std::make_unique<dbscan_inverted<TNum>>(
+                        corpus, rows, cols, options.prune);
+            }
+        }
+    };
+}
+
+template <typename TNum>
+void check_dbscan_arguments(const std::string& array_type,
+        const std::string& distance_metric,
+        const dbscan_options& options = dbscan_options()) {
+    // Throws std::invalid_argument if create_dbscan would refuse these
+    // arguments whatever the corpus, without creating anything
+    const dbscan_choices choices = parse_dbscan_options(array_type, options);
+    auto constructors = dbscan_constructors<TNum>(nullptr, 0, 0, options,
+        choices.quantization);
+    if (!constructors.count(argtuple_t(array_type, distance_metric))) {
+        std::ostringstream o;
+        o << "Unknown arguments " << array_type << ", "
+            << distance_metric;
+        throw std::invalid_argument(o.str());
+    }
+}
+
+template <typename TNum>
+std::unique_ptr<dbscan<TNum> > create_dbscan(const std::string& array_type,
+        const std::string& distance_metric, const TNum* corpus,
+        index_t rows, index_t cols,
+        const dbscan_options& options = dbscan_options()) {
+    // Creates the dbscan implementation for a given array type and distance
+    // metric, as named on the CLI and in the python bindings. Throws
+    // std::invalid_argument for combinations that aren't implemented.
+    //
+    // The corpus buffer is not copied, so must outlive the returned object.
+    check_dbscan_arguments<TNum>(array_type, distance_metric, options);
+    const dbscan_choices choices = parse_dbscan_options(array_type, options);
+    auto constructors = dbscan_constructors<TNum>(corpus, rows, cols,
+        options, choices.quantization);
+
+    auto result = constructors[argtuple_t(array_type, distance_metric)]();
+    result->set_engine(choices.engine);
+    result->set_sampling(options.sample_count, options.sample_fraction,
+        choices.sampling, options.seed);
+    index_t threads = options.threads;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    result->set_num_threads(threads);
+    return result;
+}
+
+}
+
+#endif
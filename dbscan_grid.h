@@ -0,0 +1,181 @@
+#ifndef __DBSCAN_GRID_H__
+#define __DBSCAN_GRID_H__
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+#include "dbscan_nonsparse.h"
+
+namespace libdbscan {
+
+template <typename TNum>
+class dbscan_grid : public dbscan_nonsparse<TNum> {
+    // dbscan implementation for low-dimensional dense data (2-4 columns is
+    // the sweet spot) which buckets the corpus into a uniform grid of
+    // eps-sized cells. Any vector within eps of the query must then lie in
+    // one of the 3^cols cells around the query's own cell, so a region query
+    // only has to look at those rather than scanning the whole corpus.
+    //
+    // eps isn't known until run() is called, so the grid is built when a run
+    // starts and rebuilt if a later run uses a different eps. eps must be
+    // > 0, or there are no cells; std::invalid_argument is thrown if not.
+public:
+    dbscan_grid(const TNum* corpus, index_t rows, index_t cols);
+    virtual ~dbscan_grid() {}
+
+protected:
+    virtual void prepare_region_query(TNum eps) override;
+    virtual index_t region_query(index_t vec_i, TNum eps, index_list& result) override;
+
+    // The index already avoids scanning the corpus, so don't use
+    // dbscan_nonsparse's blocked scan for batches
+    virtual void region_query_batch(index_t first, index_t count, TNum eps,
+            index_list* results) override {
+        dbscan<TNum>::region_query_batch(first, count, eps, results);
+    }
+
+private:
+    typedef std::vector<long> cell_t;
+
+    struct cell_hash {
+        size_t operator () (const cell_t& cell) const {
+            size_t h = 0;
+            for (auto c : cell) {
+                h = h * 1000003 ^ std::hash<long>()(c);
+            }
+            return h;
+        }
+    };
+
+    // [start, end) offsets into _cell_rows
+    typedef std::pair<index_t, index_t> cell_span_t;
+
+    void build_grid(TNum eps);
+    void cell_of(const TNum* vec, cell_t& cell) const;
+
+    TNum _grid_eps;
+    double _cell_size;
+    // Row indexes ordered by cell, so each cell's rows are contiguous
+    std::vector<index_t> _cell_rows;
+    std::unordered_map<cell_t, cell_span_t, cell_hash> _cells;
+};
+
+template <typename TNum>
+dbscan_grid<TNum>::dbscan_grid(const TNum* corpus, index_t rows, index_t cols) :
+    dbscan_nonsparse<TNum>(corpus, rows, cols),
+    _grid_eps(0),
+    _cell_size(0)
+{
+}
+
+template <typename TNum>
+void dbscan_grid<TNum>::cell_of(const TNum* vec, cell_t& cell) const
+{
+    for (index_t j=0; j < this->_cols; j++) {
+        cell[j] = static_cast<long>(std::floor(vec[j] / _cell_size));
+    }
+}
+
+template <typename TNum>
+void dbscan_grid<TNum>::build_grid(TNum eps)
+{
+    _grid_eps = eps;
+    // Pad the cell size slightly so that rounding in the division in
+    // cell_of can never put two vectors that are within eps of each other
+    // more than one cell apart.
+    _cell_size = static_cast<double>(eps) * (1 + 1e-6);
+
+    std::vector<cell_t> row_cells(this->_rows, cell_t(this->_cols));
+    _cell_rows.resize(this->_rows);
+    for (index_t i=0; i < this->_rows; i++) {
+        cell_of(&this->_corpus[i * this->_cols], row_cells[i]);
+        _cell_rows[i] = i;
+    }
+
+    std::sort(_cell_rows.begin(), _cell_rows.end(),
+        [&] (index_t a, index_t b) { return row_cells[a] < row_cells[b]; });
+
+    _cells.clear();
+    index_t start = 0;
+    for (index_t i=1; i <= this->_rows; i++) {
+        if (i == this->_rows ||
+                row_cells[_cell_rows[i]] != row_cells[_cell_rows[start]]) {
+            _cells[row_cells[_cell_rows[start]]] = cell_span_t(start, i);
+            start = i;
+        }
+    }
+}
+
+template <typename TNum>
+void dbscan_grid<TNum>::prepare_region_query(TNum eps)
+{
+    if (!(eps > 0)) {
+        throw std::invalid_argument("grid needs eps > 0");
+    }
+    if (_cells.empty() || eps != _grid_eps) {
+        build_grid(eps);
+    }
+}
+
+template <typename TNum>
+index_t dbscan_grid<TNum>::region_query(index_t vec_i, TNum eps, index_list& result)
+{
+    TNum eps_squared = eps * eps;
+    const index_t cols = this->_cols;
+    const TNum* comparison_vector = &this->_corpus[vec_i * cols];
+
+    // Scratch space, per thread since region_query may be called
+    // concurrently, and kept around to save reallocating it
+    static thread_local cell_t query_cell;
+    static thread_local cell_t neighbour_cell;
+    static thread_local std::vector<int> offsets;
+    query_cell.resize(cols);
+    neighbour_cell.resize(cols);
+    cell_of(comparison_vector, query_cell);
+
+    // Walk the 3^cols neighbouring cells like an odometer, each column's
+    // offset running over -1, 0, 1
+    offsets.assign(cols, -1);
+    index_t compared = 0;
+    while (true) {
+        for (index_t j=0; j < cols; j++) {
+            neighbour_cell[j] = query_cell[j] + offsets[j];
+        }
+
+        auto iter = _cells.find(neighbour_cell);
+        if (iter != _cells.end()) {
+            for (index_t k=iter->second.first; k < iter->second.second; k++) {
+                index_t i = _cell_rows[k];
+                if (i == vec_i) {
+                    continue;
+                }
+
+                const TNum* row = &this->_corpus[i * cols];
+                TNum distance = euclidean_distance<TNum>(cols, row, comparison_vector);
+                if (distance <= eps_squared) {
+                    result.push_back(i);
+                }
+            }
+            compared += iter->second.second - iter->second.first;
+        }
+
+        index_t j = 0;
+        for (; j < cols && offsets[j] == 1; j++) {
+            offsets[j] = -1;
+        }
+        if (j == cols) {
+            break;
+        }
+        offsets[j]++;
+    }
+
+    // (counting vec_i itself, which costs less than skipping it)
+    this->count_distances(compared);
+    return result.size();
+}
+
+}
+
+#endif
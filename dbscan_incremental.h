@@ -0,0 +1,358 @@
+#ifndef __DBSCAN_INCREMENTAL_H__
+#define __DBSCAN_INCREMENTAL_H__
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "dbscan.h"
+
+namespace libdbscan {
+
+template <typename TNum>
+class dbscan_incremental {
+    // Keeps a dbscan clustering of dense vectors, with euclidean distance
+    // and a fixed eps and min_pts, up to date as vectors are inserted and
+    // removed in batches, rather than clustering from scratch each time.
+    //
+    // Each vector's count of neighbours is kept, and the clusters of core
+    // vectors in a union-find. Inserting only queries the new vectors'
+    // neighbourhoods, and merges the clusters of any vectors that become
+    // core with those of their core neighbours. Removing a core vector (or
+    // leaving one with too few neighbours to stay core) may split its
+    // cluster, so the clusters it touched are walked again from its core
+    // neighbours; other clusters aren't touched.
+    //
+    // Region queries use a uniform grid of eps-sized cells, as dbscan_grid
+    // does, so this is best suited to low-dimensional data.
+    //
+    // Vectors are identified by ids, assigned in ascending order on insert
+    // and never reused; the storage for removed vectors isn't reclaimed.
+public:
+    // Throws std::invalid_argument unless eps > 0, as the grid needs cells
+    dbscan_incremental(index_t cols, TNum eps, index_t min_pts);
+
+    // Adds count vectors, a C-style (row-major) count x cols array which is
+    // copied, appending their ids to ids
+    void insert(const TNum* vectors, index_t count, std::vector<index_t>& ids);
+
+    // Removes the vectors with the given ids. Throws std::invalid_argument,
+    // without removing anything, if any of them isn't currently inserted or
+    // is given twice.
+    void remove(const std::vector<index_t>& ids);
+
+    // The current vectors' ids, ascending, and their labels, which are
+    // exactly what run() gives for a corpus of those vectors in that order
+    void labels(std::vector<index_t>& ids, std::vector<index_t>& results);
+
+    index_t get_num_rows() const { return _num_live; }
+    index_t get_num_cols() const { return _cols; }
+
+private:
+    typedef std::vector<long> cell_t;
+
+    struct cell_hash {
+        size_t operator () (const cell_t& cell) const {
+            size_t h = 0;
+            for (auto c : cell) {
+                h = h * 1000003 ^ std::hash<long>()(c);
+            }
+            return h;
+        }
+    };
+
+    const TNum* vector(index_t id) const { return &_vectors[id * _cols]; }
+    bool is_core(index_t id) const { return _counts[id] >= _min_pts; }
+
+    void cell_of(const TNum* vec, cell_t& cell) const;
+    // The live vectors, other than id itself, within eps of vector id
+    // (which needn't be live)
+    void region_query(index_t id, index_list& result);
+
+    index_t find_root(index_t id);
+    void union_roots(index_t a, index_t b);
+
+    index_t _cols;
+    TNum _eps_squared;
+    double _cell_size;
+    index_t _min_pts;
+    index_t _num_live;
+
+    // By id: the vectors, whether they're still inserted, how many other
+    // live vectors are within eps of them, and their union-find parent.
+    // Only core vectors are ever linked in the union-find; everything else
+    // is its own root.
+    std::vector<TNum> _vectors;
+    std::vector<bool> _live;
+    std::vector<index_t> _counts;
+    std::vector<index_t> _parent;
+
+    // Ids of the live vectors in each grid cell, in no particular order
+    std::unordered_map<cell_t, std::vector<index_t>, cell_hash> _cells;
+
+    // Scratch space: per id stamps marking vectors visited by the current
+    // walk, so walks don't have to clear a bitmap over every id
+    std::vector<unsigned long> _visited;
+    unsigned long _walk;
+    cell_t _query_cell;
+    cell_t _neighbour_cell;
+    std::vector<int> _offsets;
+    index_list _neighbours;
+};
+
+template <typename TNum>
+dbscan_incremental<TNum>::dbscan_incremental(index_t cols, TNum eps,
+        index_t min_pts) :
+    _cols(cols),
+    _eps_squared(eps * eps),
+    // Padded slightly, as in dbscan_grid, so rounding can't put vectors
+    // within eps of each other more than one cell apart
+    _cell_size(static_cast<double>(eps) * (1 + 1e-6)),
+    _min_pts(min_pts),
+    _num_live(0),
+    _walk(0),
+    _query_cell(cols),
+    _neighbour_cell(cols),
+    _offsets(cols)
+{
+    if (!(eps > 0)) {
+        throw std::invalid_argument("incremental needs eps > 0");
+    }
+}
+
+template <typename TNum>
+void dbscan_incremental<TNum>::cell_of(const TNum* vec, cell_t& cell) const
+{
+    for (index_t j=0; j < _cols; j++) {
+        cell[j] = static_cast<long>(std::floor(vec[j] / _cell_size));
+    }
+}
+
+template <typename TNum>
+void dbscan_incremental<TNum>::region_query(index_t id, index_list& result)
+{
+    const TNum* comparison_vector = vector(id);
+    cell_of(comparison_vector, _query_cell);
+
+    // the 3^cols neighbouring cells, as in dbscan_grid
+    std::fill(_offsets.begin(), _offsets.end(), -1);
+    while (true) {
+        for (index_t j=0; j < _cols; j++) {
+            _neighbour_cell[j] = _query_cell[j] + _offsets[j];
+        }
+
+        auto iter = _cells.find(_neighbour_cell);
+        if (iter != _cells.end()) {
+            for (auto i : iter->second) {
+                if (i != id && euclidean_distance<TNum>(_cols, vector(i),
+                        comparison_vector) <= _eps_squared) {
+                    result.push_back(i);
+                }
+            }
+        }
+
+        index_t j = 0;
+        for (; j < _cols && _offsets[j] == 1; j++) {
+            _offsets[j] = -1;
+        }
+        if (j == _cols) {
+            break;
+        }
+        _offsets[j]++;
+    }
+}
+
+template <typename TNum>
+index_t dbscan_incremental<TNum>::find_root(index_t id)
+{
+    while (_parent[id] != id) {
+        // path halving
+        _parent[id] = _parent[_parent[id]];
+        id = _parent[id];
+    }
+    return id;
+}
+
+template <typename TNum>
+void dbscan_incremental<TNum>::union_roots(index_t a, index_t b)
+{
+    a = find_root(a);
+    b = find_root(b);
+    if (a != b) {
+        _parent[std::max(a, b)] = std::min(a, b);
+    }
+}
+
+template <typename TNum>
+void dbscan_incremental<TNum>::insert(const TNum* vectors, index_t count,
+        std::vector<index_t>& ids)
+{
+    const index_t first = _live.size();
+    _vectors.insert(_vectors.end(), vectors, vectors + count * _cols);
+    _live.resize(first + count, true);
+    _counts.resize(first + count, 0);
+    _visited.resize(first + count, 0);
+    for (index_t id=first; id < first + count; id++) {
+        _parent.push_back(id);
+        cell_of(vector(id), _query_cell);
+        _cells[_query_cell].push_back(id);
+        ids.push_back(id);
+    }
+    _num_live += count;
+
+    // Count the new vectors' neighbours. Pairs of new vectors are counted by
+    // each of their own queries, so only existing neighbours need their
+    // counts bumping, and any that reach min_pts become core.
+    std::vector<index_t> new_cores;
+    for (index_t id=first; id < first + count; id++) {
+        _neighbours.clear();
+        region_query(id, _neighbours);
+        _counts[id] = _neighbours.size();
+        if (is_core(id)) {
+            new_cores.push_back(id);
+        }
+        for (auto i : _neighbours) {
+            if (i < first && ++_counts[i] == _min_pts) {
+                new_cores.push_back(i);
+            }
+        }
+    }
+
+    // New core vectors join the clusters of their core neighbours, which
+    // can only merge clusters, never split them
+    for (auto id : new_cores) {
+        _neighbours.clear();
+        region_query(id, _neighbours);
+        for (auto i : _neighbours) {
+            if (is_core(i)) {
+                union_roots(id, i);
+            }
+        }
+    }
+}
+
+template <typename TNum>
+void dbscan_incremental<TNum>::remove(const std::vector<index_t>& ids)
+{
+    _walk++;
+    for (auto id : ids) {
+        if (id < 0 || id >= index_t(_live.size()) || !_live[id] ||
+                _visited[id] == _walk) {
+            throw std::invalid_argument("id isn't inserted, or is repeated");
+        }
+        _visited[id] = _walk;
+    }
+
+    // Core vectors that are removed, or left with too few neighbours to be
+    // core, may have been holding their clusters together
+    std::vector<index_t> lost_cores;
+    for (auto id : ids) {
+        if (is_core(id)) {
+            lost_cores.push_back(id);
+        }
+    }
+    for (auto id : ids) {
+        cell_of(vector(id), _query_cell);
+        std::vector<index_t>& cell = _cells[_query_cell];
+        *std::find(cell.begin(), cell.end(), id) = cell.back();
+        cell.pop_back();
+        if (cell.empty()) {
+            _cells.erase(_query_cell);
+        }
+        _live[id] = false;
+        _num_live--;
+
+        _neighbours.clear();
+        region_query(id, _neighbours);
+        for (auto i : _neighbours) {
+            if (--_counts[i] == _min_pts - 1) {
+                lost_cores.push_back(i);
+            }
+        }
+    }
+
+    // Walk the remains of their clusters again, from their remaining core
+    // neighbours. Every piece of a cluster that's split touches one of the
+    // lost core vectors, so this relinks all of them.
+    std::vector<index_t> seeds;
+    for (auto id : lost_cores) {
+        _neighbours.clear();
+        region_query(id, _neighbours);
+        for (auto i : _neighbours) {
+            if (is_core(i)) {
+                seeds.push_back(i);
+            }
+        }
+    }
+    for (auto id : lost_cores) {
+        _parent[id] = id;
+    }
+
+    _walk++;
+    std::vector<index_t> frontier;
+    for (auto seed : seeds) {
+        if (_visited[seed] == _walk) {
+            continue;
+        }
+        _visited[seed] = _walk;
+        frontier.assign(1, seed);
+        while (!frontier.empty()) {
+            index_t id = frontier.back();
+            frontier.pop_back();
+            _parent[id] = seed;
+
+            _neighbours.clear();
+            region_query(id, _neighbours);
+            for (auto i : _neighbours) {
+                if (is_core(i) && _visited[i] != _walk) {
+                    _visited[i] = _walk;
+                    frontier.push_back(i);
+                }
+            }
+        }
+    }
+}
+
+template <typename TNum>
+void dbscan_incremental<TNum>::labels(std::vector<index_t>& ids,
+        std::vector<index_t>& results)
+{
+    // run() numbers clusters in order of their lowest-indexed core vector,
+    // and puts border vectors in the lowest-numbered cluster they neighbour
+    ids.clear();
+    results.clear();
+    std::unordered_map<index_t, index_t> cluster_of_root;
+    for (index_t id=0; id < index_t(_live.size()); id++) {
+        if (!_live[id]) {
+            continue;
+        }
+        ids.push_back(id);
+        index_t cluster_i = -1;
+        if (is_core(id)) {
+            auto inserted = cluster_of_root.insert(std::make_pair(
+                find_root(id), index_t(cluster_of_root.size())));
+            cluster_i = inserted.first->second;
+        }
+        results.push_back(cluster_i);
+    }
+
+    for (size_t k=0; k < ids.size(); k++) {
+        if (is_core(ids[k])) {
+            continue;
+        }
+        _neighbours.clear();
+        region_query(ids[k], _neighbours);
+        for (auto i : _neighbours) {
+            if (is_core(i)) {
+                index_t cluster_i = cluster_of_root[find_root(i)];
+                if (results[k] == -1 || cluster_i < results[k]) {
+                    results[k] = cluster_i;
+                }
+            }
+        }
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef __DBSCAN_INVERTED_H__
+#define __DBSCAN_INVERTED_H__
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "dbscan_cosine.h"
+
+namespace libdbscan {
+
+template <typename TNum>
+class dbscan_inverted : public dbscan_sparse_cosine<TNum> {
+    // dbscan implementation for very sparse data with the cosine similarity
+    // metric. Two rows that share no nonzero column have a similarity of 0,
+    // so for eps >= 0 they can never be neighbours; this keeps a posting
+    // list per column (the rows with a nonzero there) and only scores the
+    // rows that share at least one column with the query, accumulating
+    // their dot products column by column.
+    //
+    // With prune set, the query's columns are visited in decreasing order of
+    // the most they could add to any row's similarity (using each column's
+    // maximum normalized weight), and once the columns left couldn't lift a
+    // row that hasn't been seen yet above eps, new rows stop being added.
+    //
+    // Similarities that come out too close to eps to call given rounding are
+    // recomputed exactly, so the results are the same as
+    // dbscan_sparse_cosine's. Negative eps falls back to its full scan.
+public:
+    dbscan_inverted(const TNum* corpus, index_t rows, index_t cols,
+            bool prune = true);
+    virtual ~dbscan_inverted() {}
+
+protected:
+    typedef dbscan_sparse_cosine<TNum> base_t;
+
+    virtual index_t region_query(index_t vec_i, TNum eps, index_list& result) override;
+
+private:
+    bool _prune;
+    // Posting lists: column j's rows and values are in
+    // [_col_offsets[j], _col_offsets[j + 1]) of _posting_rows and
+    // _posting_values, in row order
+    std::vector<index_t> _col_offsets;
+    std::vector<index_t> _posting_rows;
+    std::vector<TNum> _posting_values;
+    // Largest |x_j| / ||x|| of any row x, for each column j
+    std::vector<TNum> _col_max;
+};
+
+template <typename TNum>
+dbscan_inverted<TNum>::dbscan_inverted(const TNum* corpus, index_t rows,
+        index_t cols, bool prune) :
+    base_t(corpus, rows, cols),
+    _prune(prune),
+    _col_offsets(cols + 1, 0),
+    _posting_rows(this->_values.size()),
+    _posting_values(this->_values.size()),
+    _col_max(cols, 0)
+{
+    // Transpose the CSR corpus into the posting lists, counting each
+    // column's nonzeros first so they can be filled in place
+    for (auto j : this->_col_indexes) {
+        _col_offsets[j + 1]++;
+    }
+    for (index_t j=0; j < cols; j++) {
+        _col_offsets[j + 1] += _col_offsets[j];
+    }
+
+    std::vector<index_t> fill(_col_offsets.begin(), _col_offsets.end() - 1);
+    for (index_t i=0; i < rows; i++) {
+        sparse_vector_t<TNum> vec = this->row(i);
+        for (index_t k=0; k < vec.size; k++) {
+            index_t j = vec.indexes[k];
+            _posting_rows[fill[j]] = i;
+            _posting_values[fill[j]] = vec.values[k];
+            fill[j]++;
+            _col_max[j] = std::max(_col_max[j],
+                std::abs(vec.values[k]) / this->_norms[i]);
+        }
+    }
+}
+
+template <typename TNum>
+index_t dbscan_inverted<TNum>::region_query(index_t vec_i, TNum eps,
+        index_list& result)
+{
+    if (eps < 0) {
+        return base_t::region_query(vec_i, eps, result);
+    }
+
+    const sparse_vector_t<TNum> query = this->row(vec_i);
+    const TNum query_norm = this->_norms[vec_i];
+    if (query_norm == 0) {
+        return 0;
+    }
+
+    // Per thread since region queries may run concurrently, and kept around
+    // to save reallocating them. acc and seen are only touched for the
+    // candidate rows, and reset afterwards.
+    static thread_local std::vector<TNum> acc;
+    static thread_local std::vector<bool> seen;
+    static thread_local std::vector<index_t> candidates;
+    static thread_local std::vector<index_t> order;
+    acc.resize(this->_rows);
+    seen.resize(this->_rows);
+    candidates.clear();
+
+    // The most each of the query's columns could add to a row's similarity
+    auto bound = [&] (index_t k) {
+        return std::abs(query.values[k]) / query_norm * _col_max[query.indexes[k]];
+    };
+
+    order.resize(query.size);
+    TNum remaining = 0;
+    for (index_t k=0; k < query.size; k++) {
+        order[k] = k;
+        remaining += bound(k);
+    }
+    if (_prune) {
+        std::sort(order.begin(), order.end(),
+            [&] (index_t a, index_t b) { return bound(a) > bound(b); });
+    }
+
+    bool admitting = true;
+    for (auto k : order) {
+        // Leave some slack for rounding in remaining
+        if (_prune && admitting && remaining * (1 + 1e-4) < eps) {
+            admitting = false;
+        }
+        remaining -= bound(k);
+
+        const TNum query_value = query.values[k];
+        const index_t j = query.indexes[k];
+        for (index_t p=_col_offsets[j]; p < _col_offsets[j + 1]; p++) {
+            index_t i = _posting_rows[p];
+            if (!seen[i]) {
+                if (!admitting) {
+                    continue;
+                }
+                seen[i] = true;
+                acc[i] = 0;
+                candidates.push_back(i);
+            }
+            acc[i] += query_value * _posting_values[p];
+        }
+    }
+
+    // Rounding in the accumulated dot product is bounded relative to the
+    // norms, by Cauchy-Schwarz
+    const TNum tolerance =
+        4 * (query.size + 4) * std::numeric_limits<TNum>::epsilon();
+    index_t rechecks = 0;
+    for (auto i : candidates) {
+        seen[i] = false;
+        if (i == vec_i) {
+            continue;
+        }
+
+        TNum estimate = acc[i] / (query_norm * this->_norms[i]);
+        if (estimate < eps - tolerance) {
+            continue;
+        }
+        if (estimate > eps + tolerance) {
+            result.push_back(i);
+            continue;
+        }
+        rechecks++;
+        if (this->similarity(i, vec_i) > eps) {
+            result.push_back(i);
+        }
+    }
+
+    // Each candidate's dot product is built up from the posting lists, which
+    // is counted as one comparison
+    this->count_distances(candidates.size() + rechecks);
+
+    return result.size();
+}
+
+}
+
+#endif
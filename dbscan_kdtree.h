@@ -0,0 +1,205 @@
+#ifndef __DBSCAN_KDTREE_H__
+#define __DBSCAN_KDTREE_H__
+
+#include <algorithm>
+
+#include "dbscan_nonsparse.h"
+
+namespace libdbscan {
+
+template <typename TNum>
+class dbscan_kdtree : public dbscan_nonsparse<TNum> {
+    // dbscan implementation for medium-dimensional dense data (roughly 5-30
+    // columns) which builds a kd-tree over the corpus once, at construction,
+    // and answers region queries by walking it, skipping any node whose
+    // bounding box is further than eps from the query vector.
+    //
+    // leaf_size is the maximum number of vectors in a leaf node, which are
+    // scanned linearly; smaller leaves prune more finely at the cost of a
+    // deeper tree.
+public:
+    dbscan_kdtree(const TNum* corpus, index_t rows, index_t cols,
+            index_t leaf_size = default_leaf_size);
+    virtual ~dbscan_kdtree() {}
+
+    static const index_t default_leaf_size = 32;
+
+protected:
+    virtual index_t region_query(index_t vec_i, TNum eps, index_list& result) override;
+
+    // The index already avoids scanning the corpus, so don't use
+    // dbscan_nonsparse's blocked scan for batches
+    virtual void region_query_batch(index_t first, index_t count, TNum eps,
+            index_list* results) override {
+        dbscan<TNum>::region_query_batch(first, count, eps, results);
+    }
+
+private:
+    struct node_t {
+        // [start, end) offsets into _order of the vectors under this node
+        index_t start;
+        index_t end;
+        // child node indexes, or -1 for leaves
+        index_t left;
+        index_t right;
+    };
+
+    index_t build(index_t start, index_t end);
+    TNum box_distance(index_t node_i, const TNum* vec) const;
+
+    index_t _leaf_size;
+    std::vector<node_t> _nodes;
+    // Bounding box of each node, _cols mins followed by _cols maxes
+    std::vector<TNum> _boxes;
+    // Row indexes, permuted so that each node's rows are contiguous
+    std::vector<index_t> _order;
+};
+
+template <typename TNum>
+dbscan_kdtree<TNum>::dbscan_kdtree(const TNum* corpus, index_t rows,
+        index_t cols, index_t leaf_size) :
+    dbscan_nonsparse<TNum>(corpus, rows, cols),
+    _leaf_size(std::max<index_t>(leaf_size, 1)),
+    _order(rows)
+{
+    for (index_t i=0; i < rows; i++) {
+        _order[i] = i;
+    }
+    if (rows > 0) {
+        build(0, rows);
+    }
+}
+
+template <typename TNum>
+index_t dbscan_kdtree<TNum>::build(index_t start, index_t end)
+{
+    const index_t cols = this->_cols;
+    const index_t node_i = _nodes.size();
+    _nodes.push_back(node_t { start, end, -1, -1 });
+    _boxes.resize(_boxes.size() + 2 * cols);
+
+    TNum* mins = &_boxes[node_i * 2 * cols];
+    TNum* maxes = mins + cols;
+    const TNum* first = &this->_corpus[_order[start] * cols];
+    std::copy(first, first + cols, mins);
+    std::copy(first, first + cols, maxes);
+    for (index_t k=start + 1; k < end; k++) {
+        const TNum* row = &this->_corpus[_order[k] * cols];
+        for (index_t j=0; j < cols; j++) {
+            mins[j] = std::min(mins[j], row[j]);
+            maxes[j] = std::max(maxes[j], row[j]);
+        }
+    }
+
+    if (end - start <= _leaf_size) {
+        return node_i;
+    }
+
+    // Split at the median of the column with the widest spread
+    index_t split_col = 0;
+    for (index_t j=1; j < cols; j++) {
+        if (maxes[j] - mins[j] > maxes[split_col] - mins[split_col]) {
+            split_col = j;
+        }
+    }
+    if (maxes[split_col] == mins[split_col]) {
+        // every vector under this node is identical, nothing to split on
+        return node_i;
+    }
+
+    index_t mid = start + (end - start) / 2;
+    const TNum* corpus = this->_corpus;
+    std::nth_element(_order.begin() + start, _order.begin() + mid,
+        _order.begin() + end,
+        [&] (index_t a, index_t b) {
+            return corpus[a * cols + split_col] < corpus[b * cols + split_col];
+        });
+
+    // _nodes may be reallocated by the recursive calls, so don't hold a
+    // reference into it across them
+    index_t left = build(start, mid);
+    index_t right = build(mid, end);
+    _nodes[node_i].left = left;
+    _nodes[node_i].right = right;
+    return node_i;
+}
+
+template <typename TNum>
+TNum dbscan_kdtree<TNum>::box_distance(index_t node_i, const TNum* vec) const
+{
+    // Squared distance from vec to the nearest point of the node's bounding
+    // box, zero if it's inside
+    const index_t cols = this->_cols;
+    const TNum* mins = &_boxes[node_i * 2 * cols];
+    const TNum* maxes = mins + cols;
+    TNum result = 0;
+    for (index_t j=0; j < cols; j++) {
+        TNum d = 0;
+        if (vec[j] < mins[j]) {
+            d = mins[j] - vec[j];
+        } else if (vec[j] > maxes[j]) {
+            d = vec[j] - maxes[j];
+        }
+        result += d * d;
+    }
+    return result;
+}
+
+template <typename TNum>
+index_t dbscan_kdtree<TNum>::region_query(index_t vec_i, TNum eps, index_list& result)
+{
+    if (_nodes.empty()) {
+        return 0;
+    }
+
+    const index_t cols = this->_cols;
+    TNum eps_squared = eps * eps;
+    // Box distances are summed in a different order from
+    // euclidean_distance, so allow a little slack when pruning to make sure
+    // rounding never prunes a vector that the linear scan would include
+    TNum prune_distance = eps_squared * (1 + 1e-4);
+    const TNum* comparison_vector = &this->_corpus[vec_i * cols];
+
+    // Per thread since region_query may be called concurrently, and kept
+    // around to save reallocating it
+    static thread_local std::vector<index_t> stack;
+    stack.clear();
+    stack.push_back(0);
+    index_t compared = 0;
+    while (!stack.empty()) {
+        index_t node_i = stack.back();
+        const node_t& node = _nodes[node_i];
+        stack.pop_back();
+
+        if (box_distance(node_i, comparison_vector) > prune_distance) {
+            continue;
+        }
+
+        if (node.left != -1) {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+            continue;
+        }
+
+        compared += node.end - node.start;
+        for (index_t k=node.start; k < node.end; k++) {
+            index_t i = _order[k];
+            if (i == vec_i) {
+                continue;
+            }
+
+            const TNum* row = &this->_corpus[i * cols];
+            TNum distance = euclidean_distance<TNum>(cols, row, comparison_vector);
+            if (distance <= eps_squared) {
+                result.push_back(i);
+            }
+        }
+    }
+
+    this->count_distances(compared);
+    return result.size();
+}
+
+}
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef __DBSCAN_LSH_H__
+#define __DBSCAN_LSH_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+#include "dbscan_cosine.h"
+
+namespace libdbscan {
+
+template <typename TNum>
+class dbscan_lsh : public dbscan_sparse_cosine<TNum> {
+    // Approximate dbscan for high-dimensional data (embeddings, TF-IDF)
+    // with the cosine similarity metric, where trees and grids don't help.
+    // Region queries use random-hyperplane (SimHash) locality sensitive
+    // hashing: each of tables hash tables keys every row by which side of
+    // each of bits random hyperplanes it lies on, and a query's candidates
+    // are the rows sharing its key in any table. Each candidate is then
+    // checked exactly with the cosine similarity, so nothing further than
+    // eps is ever a neighbour, but some neighbours may be missed.
+    //
+    // Two rows at an angle theta agree on each bit with probability
+    // 1 - theta / pi, so they share a key in a table with probability
+    // (1 - theta / pi)^bits. More bits means fewer candidates per table,
+    // so faster queries but lower recall; more tables win the recall back
+    // at the cost of more memory and candidates. Recall is high for eps
+    // close to 1 and falls off as eps drops; negative eps falls back to
+    // dbscan_sparse_cosine's full scan.
+    //
+    // The tables are built at construction with a fixed seed, so results
+    // are repeatable.
+public:
+    static const index_t default_tables = 16;
+    static const index_t default_bits = 10;
+
+    // Throws std::invalid_argument unless tables >= 1 and 1 <= bits <= 64
+    dbscan_lsh(const TNum* corpus, index_t rows, index_t cols,
+            index_t tables = default_tables, index_t bits = default_bits);
+    virtual ~dbscan_lsh() {}
+
+protected:
+    typedef dbscan_sparse_cosine<TNum> base_t;
+
+    virtual index_t region_query(index_t vec_i, TNum eps, index_list& result) override;
+
+private:
+    index_t _tables;
+    index_t _bits;
+    // Row i's key in table t is _row_keys[i * _tables + t]
+    std::vector<uint64_t> _row_keys;
+    // Table t's rows, ordered by key, are _table_rows[t * rows] to
+    // _table_rows[(t + 1) * rows - 1], with their keys at the same places
+    // in _table_keys
+    std::vector<index_t> _table_rows;
+    std::vector<uint64_t> _table_keys;
+};
+
+template <typename TNum>
+dbscan_lsh<TNum>::dbscan_lsh(const TNum* corpus, index_t rows, index_t cols,
+        index_t tables, index_t bits) :
+    base_t(corpus, rows, cols),
+    _tables(tables),
+    _bits(bits)
+{
+    if (tables < 1 || bits < 1 || bits > 64) {
+        throw std::invalid_argument(
+            "lsh needs at least 1 table and between 1 and 64 bits");
+    }
+    _row_keys.resize(rows * tables);
+    _table_rows.resize(rows * tables);
+    _table_keys.resize(rows * tables);
+
+    // Gaussian hyperplanes, laid out by column so a row's projections onto
+    // all of them can be accumulated from its nonzeros in one pass; drawn
+    // as doubles so both precisions hash alike
+    const index_t num_planes = tables * bits;
+    std::mt19937_64 rng(1);
+    std::normal_distribution<double> normal(0, 1);
+    std::vector<TNum> planes(cols * num_planes);
+    for (auto& x : planes) {
+        x = normal(rng);
+    }
+
+    std::vector<TNum> projections(num_planes);
+    for (index_t i=0; i < rows; i++) {
+        std::fill(projections.begin(), projections.end(), TNum(0));
+        sparse_vector_t<TNum> vec = this->row(i);
+        for (index_t k=0; k < vec.size; k++) {
+            const TNum value = vec.values[k];
+            const TNum* column = &planes[vec.indexes[k] * num_planes];
+            for (index_t p=0; p < num_planes; p++) {
+                projections[p] += value * column[p];
+            }
+        }
+        for (index_t t=0; t < tables; t++) {
+            uint64_t key = 0;
+            for (index_t b=0; b < bits; b++) {
+                key = key << 1 | (projections[t * bits + b] > 0);
+            }
+            _row_keys[i * tables + t] = key;
+        }
+    }
+
+    for (index_t t=0; t < tables; t++) {
+        index_t* table_rows = &_table_rows[t * rows];
+        std::iota(table_rows, table_rows + rows, 0);
+        std::sort(table_rows, table_rows + rows, [&] (index_t a, index_t b) {
+            return _row_keys[a * tables + t] < _row_keys[b * tables + t];
+        });
+        for (index_t k=0; k < rows; k++) {
+            _table_keys[t * rows + k] = _row_keys[table_rows[k] * tables + t];
+        }
+    }
+}
+
+template <typename TNum>
+index_t dbscan_lsh<TNum>::region_query(index_t vec_i, TNum eps,
+        index_list& result)
+{
+    // Rows with opposite signs share no keys, but can still be within a
+    // negative eps
+    if (eps < 0) {
+        return base_t::region_query(vec_i, eps, result);
+    }
+    // All zeros has a similarity of 0 to everything
+    if (this->_norms[vec_i] == 0) {
+        return 0;
+    }
+
+    // Per thread since region queries may run concurrently, and kept around
+    // to save reallocating them. seen is only touched for the candidates,
+    // and reset afterwards.
+    static thread_local std::vector<bool> seen;
+    static thread_local std::vector<index_t> candidates;
+    seen.resize(this->_rows);
+    candidates.clear();
+
+    const index_t rows = this->_rows;
+    for (index_t t=0; t < _tables; t++) {
+        const uint64_t* keys = &_table_keys[t * rows];
+        auto bucket = std::equal_range(keys, keys + rows,
+            _row_keys[vec_i * _tables + t]);
+        for (auto key=bucket.first; key != bucket.second; key++) {
+            index_t i = _table_rows[t * rows + (key - keys)];
+            if (!seen[i]) {
+                seen[i] = true;
+                candidates.push_back(i);
+            }
+        }
+    }
+
+    for (auto i : candidates) {
+        seen[i] = false;
+        if (i != vec_i && this->similarity(i, vec_i) > eps) {
+            result.push_back(i);
+        }
+    }
+    this->count_distances(candidates.size() - 1);
+
+    return result.size();
+}
+
+}
+
+#endif
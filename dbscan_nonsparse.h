@@ -1,6 +1,10 @@
 #ifndef __DBSCAN_NONSPARSE_H__
 #define __DBSCAN_NONSPARSE_H__
 
+#include <algorithm>
+#include <limits>
+#include <mutex>
+
 #include "dbscan.h"
 
 namespace libdbscan {
@@ -17,10 +21,48 @@ public:
     ~dbscan_nonsparse() {}
 protected:
     typedef const TNum* corpus_vector_t;
-    virtual index_t region_query(index_t vec_i, TNum ps, index_set& result) override;
+    virtual index_t region_query(index_t vec_i, TNum ps, index_list& result) override;
+
+    // Blocked version of the corpus scan for a batch of queries, which
+    // computes squared distances as ||x||^2 + ||y||^2 - 2x.y, so that the
+    // inner products for a tile of queries against a tile of rows can be
+    // done like a matrix multiply, with each tile of rows loaded once per
+    // batch rather than once per query. That expansion loses precision, so
+    // pairs whose distance comes out too close to eps to call are checked
+    // again with euclidean_distance, making the results exactly the same as
+    // region_query's.
+    virtual void region_query_batch(index_t first, index_t count, TNum eps,
+        index_list* results) override;
+
+    // Squared euclidean distance, compared against eps squared
+    virtual TNum neighbour_score(index_t i, index_t j) const override {
+        return euclidean_distance<TNum>(this->_cols,
+            &_corpus[i * this->_cols], &_corpus[j * this->_cols]);
+    }
+    virtual TNum neighbour_threshold(TNum eps) const override {
+        return eps * eps;
+    }
+    virtual TNum neighbour_eps(TNum score) const override {
+        return std::sqrt(score);
+    }
+
     corpus_vector_t _corpus;
+
+private:
+    // Rows per tile in region_query_batch
+    static const index_t row_tile_size = 128;
+
+    // Squared norm of each row, for region_query_batch; computed by the
+    // first batch, so runs that never batch their queries don't pay for it
+    const std::vector<TNum>& row_norms();
+    std::vector<TNum> _row_norms;
+    std::once_flag _row_norms_once;
 };
 
+// std::min takes its arguments by reference, so this needs a definition
+template <typename TNum>
+const index_t dbscan_nonsparse<TNum>::row_tile_size;
+
 template <typename TNum>
 dbscan_nonsparse<TNum>::dbscan_nonsparse(const TNum* corpus, index_t rows, index_t cols) : 
     _corpus(corpus)
@@ -31,26 +73,111 @@ dbscan_nonsparse<TNum>::dbscan_nonsparse(const TNum* corpus, index_t rows, index
 }
 
 template <typename TNum>
-index_t dbscan_nonsparse<TNum>::region_query(index_t vec_i, TNum eps, index_set& result) 
+const std::vector<TNum>& dbscan_nonsparse<TNum>::row_norms()
+{
+    // Batches run on several threads at once, so only the first computes
+    std::call_once(_row_norms_once, [&] {
+        _row_norms.resize(this->_rows);
+        for (index_t i=0; i < this->_rows; i++) {
+            const TNum* row = &_corpus[i * this->_cols];
+            TNum norm = 0;
+            for (index_t j=0; j < this->_cols; j++) {
+                norm += row[j] * row[j];
+            }
+            _row_norms[i] = norm;
+        }
+    });
+    return _row_norms;
+}
+
+template <typename TNum>
+index_t dbscan_nonsparse<TNum>::region_query(index_t vec_i, TNum eps, index_list& result) 
 {
     // return a list of indexes of corpus vectors that are < eps away from
     // vec_i, according to euclidian distance, sorted ascending
     eps = eps * eps;
     
     const TNum* comparison_vector = &_corpus[vec_i * this->_cols];
-    for (index_t i=0; i < this->_rows; i++) {
-        if (i == vec_i) {
-            continue;
-        }
-
+    return this->scan_corpus(vec_i, result, [&] (index_t i) {
         const TNum* row = &_corpus[i*this->_cols];
         TNum distance = euclidean_distance<TNum>(this->_cols, row, comparison_vector);
-        if (distance <= eps) {
-            result.insert(i);
+        return distance <= eps;
+    });
+}
+
+template <typename TNum>
+void dbscan_nonsparse<TNum>::region_query_batch(index_t first, index_t count,
+        TNum eps, index_list* results)
+{
+    const index_t rows = this->_rows;
+    const index_t cols = this->_cols;
+    const TNum eps_squared = eps * eps;
+    // Generous bound on the rounding error of both the expanded form and of
+    // euclidean_distance, relative to the norms involved
+    const TNum tolerance_factor =
+        4 * (cols + 4) * std::numeric_limits<TNum>::epsilon();
+    const std::vector<TNum>& norms_of = row_norms();
+
+    // Per thread since region queries may run concurrently, and kept around
+    // to save reallocating them
+    static thread_local std::vector<TNum> packed;
+    static thread_local std::vector<TNum> dots;
+    packed.resize(row_tile_size * cols);
+    dots.resize(row_tile_size);
+    index_t rechecks = 0;
+
+    for (index_t tile_start=0; tile_start < rows; tile_start += row_tile_size) {
+        const index_t tile_rows = std::min(row_tile_size, rows - tile_start);
+
+        // Pack the tile column-major, so the innermost loop below runs
+        // across rows, accumulating independent dot products that the
+        // compiler can vectorize
+        for (index_t r=0; r < tile_rows; r++) {
+            const TNum* row = &_corpus[(tile_start + r) * cols];
+            for (index_t j=0; j < cols; j++) {
+                packed[j * row_tile_size + r] = row[j];
+            }
         }
-    }    
 
-    return result.size();
+        for (index_t q=0; q < count; q++) {
+            const index_t query_i = first + q;
+            const TNum* query = &_corpus[query_i * cols];
+
+            std::fill(dots.begin(), dots.begin() + tile_rows, TNum(0));
+            for (index_t j=0; j < cols; j++) {
+                const TNum query_j = query[j];
+                const TNum* column = &packed[j * row_tile_size];
+                for (index_t r=0; r < tile_rows; r++) {
+                    dots[r] += query_j * column[r];
+                }
+            }
+
+            const TNum query_norm = norms_of[query_i];
+            for (index_t r=0; r < tile_rows; r++) {
+                const index_t i = tile_start + r;
+                if (i == query_i) {
+                    continue;
+                }
+
+                const TNum norms = query_norm + norms_of[i];
+                const TNum distance = norms - 2 * dots[r];
+                const TNum tolerance = tolerance_factor * norms;
+                if (distance > eps_squared + tolerance) {
+                    continue;
+                }
+                if (distance < eps_squared - tolerance) {
+                    results[q].push_back(i);
+                    continue;
+                }
+                rechecks++;
+                if (euclidean_distance<TNum>(cols, &_corpus[i * cols],
+                        query) <= eps_squared) {
+                    results[q].push_back(i);
+                }
+            }
+        }
+    }
+    this->count_distances(count * (rows - 1) + rechecks);
 }
 
 }
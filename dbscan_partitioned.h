@@ -0,0 +1,562 @@
+#ifndef __DBSCAN_PARTITIONED_H__
+#define __DBSCAN_PARTITIONED_H__
+
+#include <algorithm>
+#include <cerrno>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "corpus_io.h"
+#include "dbscan_factory.h"
+
+namespace libdbscan {
+
+template <typename TNum>
+class dbscan_partitioned {
+    // dbscan with euclidean distance split across worker processes, each of
+    // which only holds a slab of the corpus, for corpora too big for one
+    // process. The corpus is streamed from its file, and never held whole.
+    //
+    // The corpus is cut into partitions slabs along its widest column, each
+    // owning about the same number of vectors, and each slab is padded with
+    // the vectors up to 2 * eps beyond its edges (its halo). A worker
+    // process is forked for each slab and sent its vectors over a local
+    // socket, and runs the given array type's engine on them. Every
+    // neighbour of the vectors within eps of the slab's edges is in the
+    // slab, so their core flags are exact, which is what makes merging
+    // possible:
+    //
+    //  1. Workers report each vector they found to be core, and which of
+    //     their clusters it's in. No vector is core in a slab that isn't
+    //     core overall, and every pair of core neighbours is core in the
+    //     slab owning either of them, so merging the slabs' clusters that
+    //     share core vectors in a union-find gives exactly the clusters of
+    //     a single-process run, numbered the same way, in order of their
+    //     lowest-indexed core vector.
+    //  2. Told those numbers, workers put each border vector they own in
+    //     the lowest-numbered cluster it neighbours, querying the border
+    //     vectors' neighbours again (there are fewer than min_pts of each).
+    //
+    // So the results, noise and core flags are exactly those of run() on a
+    // single dbscan object. The parent reads the file three times, and
+    // holds one column of the corpus, then the labels and a union-find;
+    // each worker needs what a single-process run on its slab would.
+    // Workers are forked, so this is for POSIX systems, and best used from
+    // a single-threaded process.
+public:
+    // Throws std::invalid_argument unless distance_metric is euclidean (the
+    // slabs' halos rely on no column differing by more than the distance),
+    // partitions >= 1, and create_dbscan accepts array_type and options
+    // with an engine other than the sampled one, whose core flags aren't
+    // exact.
+    dbscan_partitioned(const std::string& array_type,
+            const std::string& distance_metric, const std::string& input_path,
+            index_t partitions,
+            const dbscan_options& options = dbscan_options());
+
+    // As dbscan::run, for the corpus in the input file, read with
+    // corpus_reader. Throws std::ios_base::failure if it can't be read, and
+    // std::runtime_error if a worker fails.
+    void run(TNum eps, index_t min_pts, std::vector<index_t>& results,
+        std::vector<index_t>& noise);
+    void run(TNum eps, index_t min_pts, std::vector<index_t>& results,
+        std::vector<index_t>& noise, std::vector<index_t>& core);
+
+private:
+    class worker {
+        // A forked worker process and the parent's end of its socket; the
+        // process is killed if it's still running when this is destroyed
+    public:
+        worker() : pid(-1), fd(-1) {}
+        ~worker();
+        worker(const worker&) = delete;
+        worker& operator = (const worker&) = delete;
+
+        template <typename T>
+        void send(const T* values, size_t count) {
+            send_all(fd, values, count * sizeof(T));
+        }
+        template <typename T>
+        void receive(T* values, size_t count) {
+            receive_all(fd, values, count * sizeof(T));
+        }
+        // Waits for the process to exit, throwing if it failed
+        void finish();
+
+        pid_t pid;
+        int fd;
+        // The slab owns vectors with lower <= the split column < upper, and
+        // holds those within 2 * eps of that too, size of them
+        TNum lower;
+        TNum upper;
+        index_t size;
+        // The first core vector of each of the worker's clusters
+        std::vector<index_t> seeds;
+    };
+
+    static void send_all(int fd, const void* data, size_t size);
+    static void receive_all(int fd, void* data, size_t size);
+
+    void run_partitions(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core);
+    // Picks the column to split on and the slabs, returning those that own
+    // any vectors, and the number of rows
+    index_t split(corpus_reader<TNum>& reader, TNum halo, index_t& column,
+        std::vector<std::unique_ptr<worker> >& workers) const;
+    void start(worker& w, TNum eps, index_t min_pts, index_t cols,
+        index_t column,
+        const std::vector<std::unique_ptr<worker> >& workers) const;
+    // The worker process's side of the rounds, on its socket
+    void serve(int fd) const;
+
+    std::string _array_type;
+    std::string _distance_metric;
+    std::string _input_path;
+    index_t _partitions;
+    dbscan_options _options;
+};
+
+template <typename TNum>
+dbscan_partitioned<TNum>::dbscan_partitioned(const std::string& array_type,
+        const std::string& distance_metric, const std::string& input_path,
+        index_t partitions, const dbscan_options& options) :
+    _array_type(array_type),
+    _distance_metric(distance_metric),
+    _input_path(input_path),
+    _partitions(partitions),
+    _options(options)
+{
+    if (distance_metric != "euclidean") {
+        throw std::invalid_argument(
+            "partitioning needs the euclidean distance metric");
+    }
+    if (partitions < 1) {
+        throw std::invalid_argument("partitions must be >= 1");
+    }
+    // The workers create their own, but any error is clearer from here
+    check_dbscan_arguments<TNum>(array_type, distance_metric, options);
+    if (options.engine == "sampled") {
+        throw std::invalid_argument(
+            "partitioning can't use the sampled engine");
+    }
+}
+
+template <typename TNum>
+dbscan_partitioned<TNum>::worker::~worker()
+{
+    if (fd != -1) {
+        ::close(fd);
+    }
+    if (pid != -1) {
+        ::kill(pid, SIGKILL);
+        ::waitpid(pid, nullptr, 0);
+    }
+}
+
+template <typename TNum>
+void dbscan_partitioned<TNum>::worker::finish()
+{
+    ::close(fd);
+    fd = -1;
+    int status;
+    pid_t waited = ::waitpid(pid, &status, 0);
+    pid = -1;
+    if (waited == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw std::runtime_error("partition worker failed");
+    }
+}
+
+template <typename TNum>
+void dbscan_partitioned<TNum>::send_all(int fd, const void* data, size_t size)
+{
+    // MSG_NOSIGNAL so a worker that's died is an error rather than SIGPIPE
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("couldn't send to partition worker");
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+template <typename TNum>
+void dbscan_partitioned<TNum>::receive_all(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = ::recv(fd, p, size, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("partition worker failed");
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+template <typename TNum>
+void dbscan_partitioned<TNum>::run(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise)
+{
+    run_partitions(eps, min_pts, results, noise, nullptr);
+}
+
+template <typename TNum>
+void dbscan_partitioned<TNum>::run(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>& core)
+{
+    run_partitions(eps, min_pts, results, noise, &core);
+}
+
+template <typename TNum>
+index_t dbscan_partitioned<TNum>::split(corpus_reader<TNum>& reader,
+        TNum halo, index_t& column,
+        std::vector<std::unique_ptr<worker> >& workers) const
+{
+    // Cut along the column with the widest range, found in one pass over
+    // the file, at quantiles of it found in another, so each partition owns
+    // about the same number of vectors
+    const index_t cols = reader.cols();
+    const index_t batch_rows = 4096;
+    std::vector<TNum> batch;
+    std::vector<TNum> lowest(cols, std::numeric_limits<TNum>::infinity());
+    std::vector<TNum> highest(cols, -std::numeric_limits<TNum>::infinity());
+    index_t rows = 0;
+    for (index_t count; (count = reader.read(batch_rows, batch)) > 0; ) {
+        for (index_t k=0; k < count * cols; k++) {
+            lowest[k % cols] = std::min(lowest[k % cols], batch[k]);
+            highest[k % cols] = std::max(highest[k % cols], batch[k]);
+        }
+        rows += count;
+    }
+    column = 0;
+    for (index_t j=1; j < cols; j++) {
+        if (highest[j] - lowest[j] > highest[column] - lowest[column]) {
+            column = j;
+        }
+    }
+
+    // with no columns there's nothing to split on, and every value is 0
+    std::vector<TNum> values;
+    values.reserve(rows);
+    reader.rewind();
+    for (index_t count; (count = reader.read(batch_rows, batch)) > 0; ) {
+        for (index_t k=0; k < count; k++) {
+            values.push_back(cols > 0 ? batch[k * cols + column] : 0);
+        }
+    }
+    std::sort(values.begin(), values.end());
+
+    // Partition p owns [bounds[p - 1], bounds[p]), the first and last being
+    // open-ended
+    std::vector<TNum> bounds;
+    if (rows > 0) {
+        for (index_t p=1; p < _partitions; p++) {
+            bounds.push_back(values[p * rows / _partitions]);
+        }
+    }
+    for (size_t p=0; p <= bounds.size(); p++) {
+        std::unique_ptr<worker> w(new worker());
+        w->lower = p == 0 ? -std::numeric_limits<TNum>::infinity() :
+            bounds[p - 1];
+        w->upper = p == bounds.size() ?
+            std::numeric_limits<TNum>::infinity() : bounds[p];
+        auto first_owned = std::lower_bound(values.begin(), values.end(),
+            w->lower);
+        auto last_owned = std::lower_bound(values.begin(), values.end(),
+            w->upper);
+        if (first_owned == last_owned) {
+            continue;
+        }
+        w->size = std::upper_bound(values.begin(), values.end(),
+                w->upper + 2 * halo) -
+            std::lower_bound(values.begin(), values.end(),
+                w->lower - 2 * halo);
+        workers.push_back(std::move(w));
+    }
+    return rows;
+}
+
+template <typename TNum>
+void dbscan_partitioned<TNum>::start(worker& w, TNum eps, index_t min_pts,
+        index_t cols, index_t column,
+        const std::vector<std::unique_ptr<worker> >& workers) const
+{
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        throw std::runtime_error("couldn't create partition worker socket");
+    }
+    pid_t pid = ::fork();
+    if (pid == -1) {
+        ::close(fds[0]);
+        ::close(fds[1]);
+        throw std::runtime_error("couldn't fork partition worker");
+    }
+    if (pid == 0) {
+        // The worker only talks to the parent, on its own socket
+        ::close(fds[0]);
+        for (const auto& other : workers) {
+            if (other->fd != -1) {
+                ::close(other->fd);
+            }
+        }
+        int status = 0;
+        try {
+            serve(fds[1]);
+        } catch (...) {
+            status = 1;
+        }
+        ::_exit(status);
+    }
+    ::close(fds[1]);
+    w.pid = pid;
+    w.fd = fds[0];
+
+    w.send(&eps, 1);
+    w.send(&min_pts, 1);
+    w.send(&cols, 1);
+    w.send(&column, 1);
+    w.send(&w.lower, 1);
+    w.send(&w.upper, 1);
+    w.send(&w.size, 1);
+}
+
+template <typename TNum>
+void dbscan_partitioned<TNum>::serve(int fd) const
+{
+    auto receive = [&] (auto* values, size_t count) {
+        receive_all(fd, values, count * sizeof(*values));
+    };
+    auto send = [&] (const auto* values, size_t count) {
+        send_all(fd, values, count * sizeof(*values));
+    };
+
+    TNum eps, lower, upper;
+    index_t min_pts, cols, column, n;
+    receive(&eps, 1);
+    receive(&min_pts, 1);
+    receive(&cols, 1);
+    receive(&column, 1);
+    receive(&lower, 1);
+    receive(&upper, 1);
+    receive(&n, 1);
+
+    // The slab arrives in batches, each its count, global indexes and rows
+    std::vector<index_t> ids(n);
+    std::vector<TNum> slab(n * cols);
+    for (index_t k=0; k < n; ) {
+        index_t count;
+        receive(&count, 1);
+        receive(&ids[k], count);
+        receive(&slab[k * cols], count * cols);
+        k += count;
+    }
+    std::vector<char> owned(n);
+    for (index_t k=0; k < n; k++) {
+        const TNum v = cols > 0 ? slab[k * cols + column] : 0;
+        owned[k] = v >= lower && v < upper;
+    }
+
+    auto dbscan = create_dbscan<TNum>(_array_type, _distance_metric,
+        slab.data(), n, cols, _options);
+    std::vector<index_t> labels, noise, core;
+    dbscan->run(eps, min_pts, labels, noise, core);
+
+    // 1. the core vectors and their clusters
+    index_t num_clusters = 0;
+    std::vector<index_t> core_ids, core_labels;
+    for (index_t k=0; k < n; k++) {
+        if (core[k]) {
+            core_ids.push_back(ids[k]);
+            core_labels.push_back(labels[k]);
+            num_clusters = std::max(num_clusters, labels[k] + 1);
+        }
+    }
+    index_t num_core = core_ids.size();
+    send(&num_clusters, 1);
+    send(&num_core, 1);
+    send(core_ids.data(), num_core);
+    send(core_labels.data(), num_core);
+
+    // 2. the overall numbers of the clusters, and the owned border vectors'
+    std::vector<index_t> numbers(num_clusters);
+    receive(numbers.data(), num_clusters);
+    std::vector<index_t> border;
+    for (index_t k=0; k < n; k++) {
+        if (owned[k] && !core[k] && labels[k] != -1) {
+            border.push_back(k);
+        }
+    }
+    std::vector<index_t> offsets, neighbours;
+    dbscan->neighbours_of(border, eps, offsets, neighbours);
+    std::vector<index_t> border_ids, border_labels;
+    for (size_t b=0; b < border.size(); b++) {
+        index_t cluster_i = -1;
+        for (index_t m=offsets[b]; m < offsets[b + 1]; m++) {
+            const index_t k = neighbours[m];
+            if (core[k] && (cluster_i == -1 ||
+                    numbers[labels[k]] < cluster_i)) {
+                cluster_i = numbers[labels[k]];
+            }
+        }
+        border_ids.push_back(ids[border[b]]);
+        border_labels.push_back(cluster_i);
+    }
+    index_t num_border = border.size();
+    send(&num_border, 1);
+    send(border_ids.data(), num_border);
+    send(border_labels.data(), num_border);
+}
+
+template <typename TNum>
+void dbscan_partitioned<TNum>::run_partitions(TNum eps, index_t min_pts,
+        std::vector<index_t>& results, std::vector<index_t>& noise,
+        std::vector<index_t>* core)
+{
+    // Padded a little, as dbscan_kdtree pads its pruning, so rounding can't
+    // leave a neighbour out of a halo
+    const TNum halo = eps * (1 + 1e-4);
+    corpus_reader<TNum> reader(_input_path);
+    const index_t cols = reader.cols();
+    index_t column;
+    std::vector<std::unique_ptr<worker> > workers;
+    const index_t rows = split(reader, halo, column, workers);
+    for (auto& w : workers) {
+        start(*w, eps, min_pts, cols, column, workers);
+    }
+
+    // Stream each worker its slab, in the file's order, so their indexes
+    // keep the same order as the corpus's
+    const index_t batch_rows = 4096;
+    std::vector<TNum> batch;
+    std::vector<index_t> slab_ids;
+    std::vector<TNum> slab_rows;
+    reader.rewind();
+    index_t first = 0;
+    for (index_t count; (count = reader.read(batch_rows, batch)) > 0; ) {
+        for (auto& w : workers) {
+            slab_ids.clear();
+            slab_rows.clear();
+            for (index_t k=0; k < count; k++) {
+                const TNum v = cols > 0 ? batch[k * cols + column] : 0;
+                if (v >= w->lower - 2 * halo && v <= w->upper + 2 * halo) {
+                    slab_ids.push_back(first + k);
+                    slab_rows.insert(slab_rows.end(), &batch[k * cols],
+                        &batch[(k + 1) * cols]);
+                }
+            }
+            if (!slab_ids.empty()) {
+                const index_t slab_count = slab_ids.size();
+                w->send(&slab_count, 1);
+                w->send(slab_ids.data(), slab_count);
+                w->send(slab_rows.data(), slab_rows.size());
+            }
+        }
+        first += count;
+    }
+
+    // 1. merge the slabs' clusters, linking larger indexes under smaller so
+    // each cluster's root is its lowest-indexed core vector
+    std::vector<char> is_core(rows, 0);
+    std::vector<index_t> parent(rows);
+    for (index_t i=0; i < rows; i++) {
+        parent[i] = i;
+    }
+    auto find_root = [&] (index_t i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+    std::vector<index_t> core_ids, core_labels;
+    for (auto& w : workers) {
+        index_t num_clusters, num_core;
+        w->receive(&num_clusters, 1);
+        w->receive(&num_core, 1);
+        core_ids.resize(num_core);
+        core_labels.resize(num_core);
+        w->receive(core_ids.data(), num_core);
+        w->receive(core_labels.data(), num_core);
+        w->seeds.assign(num_clusters, -1);
+        for (index_t k=0; k < num_core; k++) {
+            const index_t i = core_ids[k];
+            index_t& seed = w->seeds[core_labels[k]];
+            is_core[i] = 1;
+            if (seed == -1) {
+                seed = i;
+            } else {
+                index_t a = find_root(i);
+                index_t b = find_root(seed);
+                parent[std::max(a, b)] = std::min(a, b);
+            }
+        }
+    }
+
+    // 2. number the clusters in order of their roots, and tell the workers
+    // their clusters' numbers so they can label their border vectors
+    results.assign(rows, -1);
+    std::vector<index_t> seeds;
+    for (index_t i=0; i < rows; i++) {
+        if (is_core[i]) {
+            index_t root = find_root(i);
+            if (root == i) {
+                results[i] = seeds.size();
+                seeds.push_back(i);
+            } else {
+                results[i] = results[root];
+            }
+        }
+    }
+    std::vector<index_t> numbers;
+    for (auto& w : workers) {
+        numbers.clear();
+        for (auto seed : w->seeds) {
+            numbers.push_back(results[seed]);
+        }
+        w->send(numbers.data(), numbers.size());
+    }
+    std::vector<index_t> border_ids, border_labels;
+    for (auto& w : workers) {
+        index_t num_border;
+        w->receive(&num_border, 1);
+        border_ids.resize(num_border);
+        border_labels.resize(num_border);
+        w->receive(border_ids.data(), num_border);
+        w->receive(border_labels.data(), num_border);
+        for (index_t k=0; k < num_border; k++) {
+            results[border_ids[k]] = border_labels[k];
+        }
+        w->finish();
+    }
+
+    // as the parallel engine flags them
+    noise.resize(rows);
+    for (index_t i=0; i < rows; i++) {
+        noise[i] = results[i] == -1 || seeds[results[i]] > i;
+    }
+    if (core) {
+        core->assign(is_core.begin(), is_core.end());
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef __DBSCAN_QUANTIZED_H__
+#define __DBSCAN_QUANTIZED_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "dbscan_nonsparse.h"
+
+namespace libdbscan {
+
+template <typename TNum>
+class dbscan_quantized : public dbscan_nonsparse<TNum> {
+    // Non-sparse euclidean dbscan that scans a compressed copy of the
+    // corpus, in 8 bit integers or 16 bit floats (IEEE half, or bfloat16),
+    // so each region query reads a half to an eighth of the bytes
+    // dbscan_nonsparse does.
+    //
+    // Each column is centred on the middle of its range and scaled to fit
+    // the codes (-127 to 127 for int8, -1 to 1 for the floats), and the
+    // scan's kernels multiply the codes' differences back up by the scales.
+    // Quantizing moves every row by at most max_error (measured for the
+    // corpus at construction), so a quantized distance is within
+    // 2 * max_error of the true one; pairs whose quantized distance isn't
+    // clearly inside or outside eps, allowing for that and for rounding, are
+    // checked again against the corpus itself. So the results are exactly
+    // dbscan_nonsparse's, however coarse the codes, but only pairs near eps
+    // touch the full precision corpus; the coarser the codes, or the
+    // smaller eps compared with the columns' ranges, the more of those
+    // there are.
+public:
+    dbscan_quantized(const TNum* corpus, index_t rows, index_t cols,
+            quantization_type type = int8_quantization);
+    virtual ~dbscan_quantized() {}
+
+    // The largest distance between a row and its quantized copy
+    double max_error() const { return _max_error; }
+
+protected:
+    typedef dbscan_nonsparse<TNum> base_t;
+
+    virtual index_t region_query(index_t vec_i, TNum eps, index_list& result) override;
+
+    // One region query at a time, since dbscan_nonsparse's blocked batches
+    // would read the full precision corpus
+    virtual void region_query_batch(index_t first, index_t count, TNum eps,
+        index_list* results) override {
+        dbscan<TNum>::region_query_batch(first, count, eps, results);
+    }
+
+private:
+    // Rows' codes are padded with zeros to a multiple of this many, so the
+    // SIMD kernels never have any left over
+    static const index_t code_block = 8;
+
+    const void* codes(index_t i) const {
+        return &_codes[i * _padded_cols * _code_size];
+    }
+
+    quantization_type _type;
+    size_t _code_size;
+    index_t _padded_cols;
+    // Row i's codes start at codes(i)
+    std::vector<uint8_t> _codes;
+    // What each column's codes are multiplied by, 0 for the padding
+    std::vector<float> _scales;
+    double _max_error;
+};
+
+template <typename TNum>
+dbscan_quantized<TNum>::dbscan_quantized(const TNum* corpus, index_t rows,
+        index_t cols, quantization_type type) :
+    base_t(corpus, rows, cols),
+    _type(type),
+    _code_size(type == int8_quantization ? sizeof(int8_t) : sizeof(uint16_t)),
+    _padded_cols((cols + code_block - 1) / code_block * code_block),
+    _codes(rows * _padded_cols * _code_size),
+    _scales(_padded_cols, 0),
+    _max_error(0)
+{
+    // The middle and half the range of each column
+    std::vector<double> centres(cols);
+    std::vector<double> ranges(cols);
+    for (index_t j=0; j < cols; j++) {
+        double lowest = std::numeric_limits<double>::infinity();
+        double highest = -lowest;
+        for (index_t i=0; i < rows; i++) {
+            lowest = std::min<double>(lowest, corpus[i * cols + j]);
+            highest = std::max<double>(highest, corpus[i * cols + j]);
+        }
+        centres[j] = rows > 0 ? (lowest + highest) / 2 : 0;
+        ranges[j] = rows > 0 ? (highest - lowest) / 2 : 0;
+        const double code_range = type == int8_quantization ? 127 : 1;
+        _scales[j] = ranges[j] / code_range;
+    }
+
+    // Quantize, noting how far each row moves. The difference of two rows'
+    // reconstructions (centre + scale * code) is what the kernels compute,
+    // so the error bound is relative to that; the error is worked out in
+    // double, with a little extra for its own rounding.
+    const double rounding = 4 * std::numeric_limits<double>::epsilon();
+    for (index_t i=0; i < rows; i++) {
+        double error = 0;
+        for (index_t j=0; j < cols; j++) {
+            const double value = corpus[i * cols + j];
+            const double scale = _scales[j];
+            const double normalized = scale > 0 ?
+                (value - centres[j]) / scale : 0;
+            double decoded;
+            uint8_t* code = &_codes[(i * _padded_cols + j) * _code_size];
+            if (type == int8_quantization) {
+                const int8_t int8_code = static_cast<int8_t>(std::max(-127.0,
+                    std::min(127.0, std::round(normalized))));
+                std::memcpy(code, &int8_code, sizeof(int8_code));
+                decoded = int8_code;
+            } else {
+                const uint16_t float_code = type == fp16_quantization ?
+                    float_to_half(normalized) : float_to_bfloat(normalized);
+                std::memcpy(code, &float_code, sizeof(float_code));
+                decoded = type == fp16_quantization ?
+                    half_to_float(float_code) : bfloat_to_float(float_code);
+            }
+            const double reconstructed = centres[j] + scale * decoded;
+            const double difference = std::abs(value - reconstructed) +
+                rounding * (std::abs(value) + std::abs(reconstructed));
+            error += difference * difference;
+        }
+        _max_error = std::max(_max_error, std::sqrt(error));
+    }
+    _max_error *= 1 + 1e-6;
+}
+
+template <typename TNum>
+index_t dbscan_quantized<TNum>::region_query(index_t vec_i, TNum eps,
+        index_list& result)
+{
+    // Same comparison as dbscan_nonsparse::region_query on the pairs that
+    // are rechecked
+    const TNum eps_squared = eps * eps;
+    const index_t cols = this->_cols;
+
+    // The computed squared distances, quantized or not, are within a factor
+    // of 1 +- slack of the exact ones (all their terms are positive), and the
+    // exact quantized and true distances are within 2 * max_error. So a
+    // quantized distance below inside is certainly within eps as
+    // euclidean_distance would compute it, and one above outside certainly
+    // isn't; each bound being worked out in double from the eps_squared
+    // that would be compared against.
+    const double slack = 4 * (cols + 4) * std::numeric_limits<float>::epsilon();
+    const double reach = std::sqrt(static_cast<double>(eps_squared));
+    const double error = 2 * _max_error;
+    const double inside_distance = reach / std::sqrt(1 + slack) - error;
+    const double inside = inside_distance > 0 ?
+        (1 - slack) * inside_distance * inside_distance : -1;
+    const double outside_distance = reach / std::sqrt(1 - slack) + error;
+    const double outside = (1 + slack) * outside_distance * outside_distance;
+
+    const quantized_distance_fn distance = get_quantized_distance(_type);
+    const void* query = codes(vec_i);
+    const float* scales = _scales.data();
+    const TNum* comparison_vector = &this->_corpus[vec_i * cols];
+    return this->scan_corpus(vec_i, result, [&] (index_t i) {
+        const double quantized = distance(_padded_cols, codes(i), query,
+            scales);
+        if (quantized < inside) {
+            return true;
+        }
+        if (quantized > outside) {
+            return false;
+        }
+        this->count_distances(1);
+        return euclidean_distance<TNum>(cols, &this->_corpus[i * cols],
+            comparison_vector) <= eps_squared;
+    });
+}
+
+}
+
+#endif
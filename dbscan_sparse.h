@@ -1,16 +1,20 @@
 #ifndef __DBSCAN_SPARSE_H__
 #define __DBSCAN_SPARSE_H__
 
-// Use boost bindings for ublas sparse arrays - not sure this is maintained
-// all that well, isn't available in debian for example
-#include <boost/numeric/ublas/vector_sparse.hpp>
+#include <limits>
 
 #include "dbscan.h"
 
 namespace libdbscan {
 
-template <typename T>
-using corpus_vector_t = boost::numeric::ublas::compressed_vector<T>;
+template <typename TNum>
+struct sparse_vector_t {
+    // View of one row of a CSR corpus: the column indexes (ascending) and
+    // values of its nonzero elements
+    const index_t* indexes;
+    const TNum* values;
+    index_t size;
+};
 
 template <typename TNum>
 struct euclidean_distance_metric {
@@ -21,62 +25,57 @@ struct euclidean_distance_metric {
     TNum _eps;
 
     euclidean_distance_metric(TNum eps) {
-        _eps = eps * eps;
+        _eps = threshold(eps);
     }
 
-    bool operator () (const corpus_vector_t<TNum>& x, 
-        const corpus_vector_t<TNum>& y)
+    bool operator () (const sparse_vector_t<TNum>& x,
+        const sparse_vector_t<TNum>& y)
     {
-        TNum sum = 0;
-
-        auto x_iter = x.begin();
-        auto y_iter = y.begin();
-
-        if (x.begin() == x.end() || y.begin() == y.end()) {
-            // one or the other of the vectors is empty, so can't really
-            // compare..
-            return false;
-        }
+        return score(x, y) <= _eps;
+    }
 
-        while (true) {
-            if (x_iter==x.end()) {
-                while (y_iter != y.end()) {
-                    TNum n = *y_iter;
-                    sum += n*n;
-                    ++y_iter;
-                }
-                return sum <= _eps;
-            }
-            if (y_iter==y.end()) {
-                while (x_iter != x.end()) {
-                    TNum n = *x_iter;
-                    sum += n*n;
-                    ++x_iter;
-                }
-                return sum <= _eps;
-            }
+    // The squared distance, which x and y are within eps of each other if
+    // it's at most threshold(eps)
+    static TNum threshold(TNum eps) {
+        return eps * eps;
+    }
+    static TNum score_eps(TNum score) {
+        return std::sqrt(score);
+    }
 
-            if (x_iter.index() < y_iter.index()) {
-                TNum n = *y_iter;
+    static TNum score(const sparse_vector_t<TNum>& x,
+        const sparse_vector_t<TNum>& y)
+    {
+        // merge the two rows' nonzeros by column index; an empty row is
+        // the origin, so its distance is the other row's squared norm
+        TNum sum = 0;
+        index_t x_i = 0;
+        index_t y_i = 0;
+        while (x_i < x.size && y_i < y.size) {
+            if (x.indexes[x_i] < y.indexes[y_i]) {
+                TNum n = x.values[x_i++];
                 sum += n*n;
-                ++x_iter;
-            } else if (y_iter.index() < x_iter.index()) {
-                TNum n = *x_iter;
+            } else if (y.indexes[y_i] < x.indexes[x_i]) {
+                TNum n = y.values[y_i++];
                 sum += n*n;
-                ++y_iter;
-            } else { 
-                TNum d = *x_iter - *y_iter;
+            } else {
+                TNum d = x.values[x_i++] - y.values[y_i++];
                 sum += d*d;
-                ++x_iter;
-                ++y_iter;
             }
         }
+        for (; x_i < x.size; x_i++) {
+            sum += x.values[x_i] * x.values[x_i];
+        }
+        for (; y_i < y.size; y_i++) {
+            sum += y.values[y_i] * y.values[y_i];
+        }
+        return sum;
     }
 };
 
 template <typename TNum>
 struct cosine_similarity_metric {
-    // Cosine similarity is a measure of the angle between the two vectors; it 
+    // Cosine similarity is a measure of the angle between the two vectors; it
     // measures relative orientation and ignores magnitude.
     //
     // A similarity of 1 indicates the vectors have the same orientation;
@@ -89,39 +88,52 @@ struct cosine_similarity_metric {
         _eps = eps;
     }
 
-    bool operator () (const corpus_vector_t<TNum>& x, 
-            const corpus_vector_t<TNum>& y) {
+    bool operator () (const sparse_vector_t<TNum>& x,
+            const sparse_vector_t<TNum>& y) {
+        return -score(x, y) > _eps;
+    }
+
+    // The negated similarity, so that smaller is closer; it's greater than
+    // eps iff this is at most threshold(eps)
+    static TNum threshold(TNum eps) {
+        return std::nextafter(-eps, -std::numeric_limits<TNum>::infinity());
+    }
+    static TNum score_eps(TNum score) {
+        return -score;
+    }
+
+    static TNum score(const sparse_vector_t<TNum>& x,
+            const sparse_vector_t<TNum>& y) {
         TNum sum = 0;
         TNum sum_x = 0;
         TNum sum_y = 0;
 
-        auto x_iter = x.begin();
-        auto y_iter = y.begin();
-
-        while (true) {
-            if (x_iter==x.end()) {
-                TNum denom = sqrt(sum_x) * sqrt(sum_y);
-                return (denom == 0 ? 0 : sum / denom) > _eps;
-            }
-            if (y_iter==y.end()) {
-                TNum denom = sqrt(sum_x) * sqrt(sum_y);
-                return (denom == 0 ? 0 : sum / denom) > _eps;
-            }
-
-            if (x_iter.index() < y_iter.index()) {
-                sum_x += ((*x_iter) * (*x_iter));
-                ++x_iter;
-            } else if (y_iter.index() < x_iter.index()) {
-                sum_y += ((*y_iter) * (*y_iter));
-                ++y_iter;
-            } else { 
-                sum += ((*x_iter) * (*y_iter));
-                sum_x += ((*x_iter) * (*x_iter));
-                sum_y += ((*y_iter) * (*y_iter));
-                ++x_iter;
-                ++y_iter;
+        index_t x_i = 0;
+        index_t y_i = 0;
+        while (x_i < x.size && y_i < y.size) {
+            if (x.indexes[x_i] < y.indexes[y_i]) {
+                sum_x += x.values[x_i] * x.values[x_i];
+                ++x_i;
+            } else if (y.indexes[y_i] < x.indexes[x_i]) {
+                sum_y += y.values[y_i] * y.values[y_i];
+                ++y_i;
+            } else {
+                sum += x.values[x_i] * y.values[y_i];
+                sum_x += x.values[x_i] * x.values[x_i];
+                sum_y += y.values[y_i] * y.values[y_i];
+                ++x_i;
+                ++y_i;
             }
         }
+        for (; x_i < x.size; x_i++) {
+            sum_x += x.values[x_i] * x.values[x_i];
+        }
+        for (; y_i < y.size; y_i++) {
+            sum_y += y.values[y_i] * y.values[y_i];
+        }
+
+        TNum denom = sqrt(sum_x) * sqrt(sum_y);
+        return -(denom == 0 ? 0 : sum / denom);
     }
 };
 
@@ -129,52 +141,83 @@ template <typename TNum, typename TDistance = euclidean_distance_metric<TNum> >
 class dbscan_sparse : public dbscan<TNum> {
     // dbscan implementation using sparse arrays and supporting different
     // distance metrics via the TDistance template.
+    //
+    // The corpus is held as a single CSR (compressed sparse row) block: the
+    // nonzeros of all rows, in row order, with row i's in [_row_offsets[i],
+    // _row_offsets[i + 1]) of _col_indexes and _values. That keeps the whole
+    // corpus in three contiguous arrays for the distance metrics to stream
+    // through.
 public:
     dbscan_sparse(const TNum* corpus, index_t rows, index_t cols);
     virtual ~dbscan_sparse() {}
 
 protected:
-    virtual index_t region_query(index_t vec_i, TNum eps, index_set& result) override;
-    std::vector<corpus_vector_t<TNum> > _corpus;
+    virtual index_t region_query(index_t vec_i, TNum eps, index_list& result) override;
+
+    virtual TNum neighbour_score(index_t i, index_t j) const override {
+        return TDistance::score(row(i), row(j));
+    }
+    virtual TNum neighbour_threshold(TNum eps) const override {
+        return TDistance::threshold(eps);
+    }
+    virtual TNum neighbour_eps(TNum score) const override {
+        return TDistance::score_eps(score);
+    }
+
+    sparse_vector_t<TNum> row(index_t i) const {
+        index_t start = _row_offsets[i];
+        return sparse_vector_t<TNum> {
+            _col_indexes.data() + start, _values.data() + start,
+            _row_offsets[i + 1] - start
+        };
+    }
+
+    std::vector<index_t> _row_offsets;
+    std::vector<index_t> _col_indexes;
+    std::vector<TNum> _values;
 };
 
 template <typename TNum, typename TDistance>
-dbscan_sparse<TNum, TDistance>::dbscan_sparse(const TNum* corpus, index_t rows, 
-        index_t cols) {
+dbscan_sparse<TNum, TDistance>::dbscan_sparse(const TNum* corpus, index_t rows,
+        index_t cols) :
+    _row_offsets(rows + 1)
+{
     this->_rows = rows;
     this->_cols = cols;
 
+    // count first so the arrays are allocated exactly once
+    index_t nonzeros = 0;
+    for (index_t i=0; i < rows * cols; i++) {
+        if (corpus[i] != 0) {
+            nonzeros++;
+        }
+    }
+    _col_indexes.reserve(nonzeros);
+    _values.reserve(nonzeros);
+
     for (index_t i=0; i < rows; i++) {
-        corpus_vector_t<TNum> vec (cols);
+        _row_offsets[i] = _values.size();
         for (index_t j=0; j < cols; j++) {
             TNum val = corpus[i*cols+j];
             if (val != 0) {
-                vec.push_back(j, val);
+                _col_indexes.push_back(j);
+                _values.push_back(val);
             }
         }
-        this->_corpus.push_back(vec);
     }
+    _row_offsets[rows] = _values.size();
 }
 
 template <typename TNum, typename TDistance>
-index_t dbscan_sparse<TNum, TDistance>::region_query(index_t vec_i, TNum eps, 
-        index_set& result)
+index_t dbscan_sparse<TNum, TDistance>::region_query(index_t vec_i, TNum eps,
+        index_list& result)
 {
     TDistance _distance_metric(eps);
-    
-    const corpus_vector_t<TNum>& comparison_vector = _corpus[vec_i];
-    for (index_t i=0; i < this->_rows; i++) {
-        if (i == vec_i) {
-            continue;
-        }
-
-        bool included = _distance_metric(this->_corpus[i], comparison_vector);
-        if (included) {
-            result.insert(i);
-        }
-    }    
 
-    return result.size();
+    const sparse_vector_t<TNum> comparison_vector = row(vec_i);
+    return this->scan_corpus(vec_i, result, [&] (index_t i) {
+        return _distance_metric(row(i), comparison_vector);
+    });
 }
 
 }
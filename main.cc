@@ -1,9 +1,11 @@
-#include "dbscan_nonsparse.h"
-#include "dbscan_sparse.h"
+#include "corpus_io.h"
+#include "dbscan_factory.h"
+#include "dbscan_partitioned.h"
 #include <fstream>
-#include <tuple>
-#include <map>
+#include <iostream>
 #include <memory>
+#include <sstream>
+#include <thread>
 
 enum ExitValues {
     Success,
@@ -12,78 +14,77 @@ enum ExitValues {
     IOError
 };
 
-typedef std::tuple<std::string, std::string> argtuple_t;
+long csv_threads(libdbscan::index_t threads) {
+    // Threads to parse CSV files on, as for the --threads option
+    if (threads == 0) {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    return threads;
+}
 
 template <typename TNum>
-std::vector<TNum> read_corpus(const std::string& input_path, 
-        libdbscan::index_t& rows, libdbscan::index_t& cols) {
-    std::ifstream s;
-    s.exceptions(s.failbit);
-    s.open(input_path);
-    std::string line;
+struct corpus_t {
+    // The corpus to cluster: either a binary corpus file, mapped and used
+    // in place, or values read (or converted) into memory
+    std::unique_ptr<libdbscan::mapped_file> file;
     std::vector<TNum> values;
-    rows = 0;
-    cols = 0;
-    bool read_cols = false;
-
-    while (std::getline(s, line)) {
-        std::string val;
-        TNum v;
-        std::istringstream ss_line(line);
-        while (std::getline(ss_line, val, ',')) {
-            if (!read_cols) {
-                ++cols;
-            }
-            values.push_back(std::stof(val));
-        }
-        read_cols = true;
-        ++rows;
+    const TNum* data;
+    libdbscan::index_t rows;
+    libdbscan::index_t cols;
+};
+
+template <typename TNum, typename TFrom>
+void convert_corpus(const libdbscan::mapped_file& file, corpus_t<TNum>& corpus) {
+    const TFrom* data = libdbscan::binary_corpus_data<TFrom>(file,
+        corpus.rows, corpus.cols);
+    corpus.values.assign(data, data + corpus.rows * corpus.cols);
+}
+
+template <typename TNum>
+void load_corpus(const std::string& input_path, long threads,
+        corpus_t<TNum>& corpus) {
+    // Binary corpus files are recognised by their header; anything else is
+    // parsed as CSV, on threads threads
+    auto file = std::make_unique<libdbscan::mapped_file>(input_path);
+    if (!libdbscan::is_binary_corpus(*file)) {
+        corpus.values = libdbscan::parse_csv_corpus<TNum>(*file, threads,
+            corpus.rows, corpus.cols);
+        corpus.data = corpus.values.data();
+        return;
+    }
+
+    corpus.data = libdbscan::binary_corpus_data<TNum>(*file, corpus.rows,
+        corpus.cols);
+    if (corpus.data) {
+        corpus.file = std::move(file);
+        return;
+    }
+
+    // the file holds the other precision, so has to be copied
+    if (libdbscan::read_binary_corpus_header(*file).dtype ==
+            libdbscan::float32_dtype) {
+        convert_corpus<TNum, float>(*file, corpus);
+    } else {
+        convert_corpus<TNum, double>(*file, corpus);
     }
-    return values;
+    corpus.data = corpus.values.data();
 }
 
 template <typename TNum>
-std::unique_ptr<libdbscan::dbscan<TNum> > create_dbscan(const std::string& array_type, 
-        const std::string& distance_metric, const std::vector<TNum>& corpus,
-        libdbscan::index_t rows, libdbscan::index_t cols) {
-    // Steal the buffer from the corpus std::vector - this means it must
-    // outlive the dbscan object we are returning. Might have to make a copy of
-    // it if this becomes unwieldy, but for now, it neatly avoids a copy
-    const TNum* corpus_buf = &corpus[0];
-
-    std::map<argtuple_t,
-             std::function<std::unique_ptr<libdbscan::dbscan<TNum>>()>> map {
-        { 
-            argtuple_t("nonsparse", "euclidean"), 
-            [&] () {
-                return std::make_unique<libdbscan::dbscan_nonsparse<TNum>>(
-                        corpus_buf, rows, cols);
-            }
-        },
-        {
-            argtuple_t("sparse", "euclidean"),
-            [&] () {
-                return std::make_unique<libdbscan::dbscan_sparse<TNum>>(
-                        corpus_buf, rows, cols);
-            }
-        },
-        {
-            argtuple_t("sparse", "cosine"),
-            [&] () {
-                return std::make_unique<libdbscan::dbscan_sparse<TNum,
-                    libdbscan::cosine_similarity_metric<TNum>>>(corpus_buf, rows, cols);
-            }
-        }
-    };
-
-    auto iter = map.find(argtuple_t(array_type, distance_metric));
-    if (iter == map.end()) {
-        std::ostringstream o;
-        o << "Unknown arguments " << array_type << ", " 
-            << distance_metric << std::endl;
-        throw std::invalid_argument(o.str());
+int convert_to_binary(const std::string& input_path,
+        const std::string& output_path) {
+    try {
+        libdbscan::index_t rows, cols;
+        libdbscan::mapped_file file(input_path);
+        auto corpus = libdbscan::parse_csv_corpus<TNum>(file, csv_threads(0),
+            rows, cols);
+        libdbscan::write_binary_corpus(output_path, corpus.data(), rows, cols);
+        return ExitValues::Success;
+    } catch (const std::ios_base::failure& e) {
+        std::cerr << "Error converting " << input_path << " to "
+            << output_path << " " << e.what() << std::endl;
+        return ExitValues::IOError;
     }
-    return iter->second();
 }
 
 template <typename TNum>
@@ -91,25 +92,52 @@ int run_dbscan(double eps,
         libdbscan::index_t min_pts,
         const std::string& array_type, 
         const std::string& distance_metric, 
-        const std::string& input_path) {
+        const std::string& input_path,
+        const libdbscan::dbscan_options& options,
+        libdbscan::index_t partitions,
+        bool print_stats) {
 
     try {
-        libdbscan::index_t rows, cols;
-        auto corpus = read_corpus<TNum>(input_path, rows, cols);
-        auto dbscan = create_dbscan<TNum>(array_type, distance_metric, 
-            corpus, rows, cols);
         std::vector<libdbscan::index_t> results, noise;
+        if (partitions > 1) {
+            // the corpus is streamed to the workers from the file
+            libdbscan::dbscan_partitioned<TNum> dbscan(array_type,
+                distance_metric, input_path, partitions, options);
+            dbscan.run(eps, min_pts, results, noise);
+            for (auto& cluster_id : results) {
+                std::cout << cluster_id << std::endl;
+            }
+            return ExitValues::Success;
+        }
+        corpus_t<TNum> corpus;
+        load_corpus(input_path, csv_threads(options.threads), corpus);
+        // The dbscan object takes a view of the corpus buffer rather than
+        // copying it, so the corpus must outlive it
+        auto dbscan = libdbscan::create_dbscan<TNum>(array_type,
+            distance_metric, corpus.data, corpus.rows, corpus.cols, options);
+        libdbscan::dbscan_stats stats;
+        if (print_stats) {
+            dbscan->set_stats(&stats);
+        }
         dbscan->run(eps, min_pts, results, noise);
         for (auto& cluster_id : results) {
             std::cout << cluster_id << std::endl;
         }
+        if (print_stats) {
+            stats.visit([] (const char* name, auto value) {
+                std::cerr << name << " " << value << std::endl;
+            });
+        }
         return ExitValues::Success;
     } catch (const std::invalid_argument& e) {
         std::cerr << e.what() << std::endl;
         return ExitValues::BadArguments;
-    } catch (std::ifstream::failure e) {
+    } catch (const std::ios_base::failure& e) {
         std::cerr << "Error reading " << input_path << " " << e.what() << std::endl;
         return ExitValues::IOError;
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        return ExitValues::IOError;
     }
 }
 
@@ -125,16 +153,82 @@ int main(int argc, char** argv) {
     std::string distance_metric;
     std::string input_path;
     std::string precision;
+    libdbscan::dbscan_options options;
+    libdbscan::index_t partitions = 1;
+    bool print_stats = false;
 
     const char* usage = 
         "usage: dbscan eps min_pts array_type distance_metric "
-        "precision input_path\n"
+        "precision input_path [options]\n"
+        "       dbscan convert precision input_csv output_path\n"
         "  eps:        parameter to dbscan algorithm, e.g. 0.3\n"
         "  min_pts:    parameter to dbscan algorithm, e.g. 10\n"
-        "  array_type: can be sparse or nonsparse\n"
+        "  array_type: can be sparse, nonsparse, grid (low-dimensional\n"
+        "              nonsparse data), kdtree (medium-dimensional\n"
+        "              nonsparse data), quantized (nonsparse data,\n"
+        "              scanned in compressed form, see --quantization),\n"
+        "              approx (approximate clustering\n"
+        "              of huge nonsparse data with at most 6 columns,\n"
+        "              see --rho), inverted (very sparse data) or lsh\n"
+        "              (approximate search of high-dimensional data,\n"
+        "              see --lsh-tables); grid, kdtree, quantized and\n"
+        "              approx are euclidean only, inverted and lsh are\n"
+        "              cosine only\n"
         "  distance_metric: can be euclidean or cosine\n"
         "  precision:  can be double or single\n"
-        "  input_path: is the path of a CSV containing vectors";
+        "  input_path: is the path of a CSV containing vectors, or a binary\n"
+        "              corpus file made by convert, which is mapped into\n"
+        "              memory and used in place\n"
+        "options:\n"
+        "  --leaf-size=N: max vectors per kd-tree leaf for kdtree, default 32\n"
+        "  --threads=N:   threads to split sparse and nonsparse region\n"
+        "                 queries across, to parse CSVs on, and to run\n"
+        "                 the parallel engine on, 0 for all cores,\n"
+        "                 default 1\n"
+        "  --prune=0|1:   whether inverted skips candidates that can't reach\n"
+        "                 eps, default 1\n"
+        "  --quantization=Q: for quantized, int8 (the default), fp16 or\n"
+        "                 bf16; same results, but coarser codes mean more\n"
+        "                 pairs rechecked at full precision\n"
+        "  --rho=R:       for approx, clusters may be joined by core vectors\n"
+        "                 up to eps * (1 + R) apart, default 0.001; 0 is\n"
+        "                 exact\n"
+        "  --lsh-tables=N, --lsh-bits=N: hash tables, and random\n"
+        "                 hyperplanes per table, for lsh, default 16 and\n"
+        "                 10; more bits is faster, more tables finds more\n"
+        "                 neighbours\n"
+        "  --engine=E:    sequential (the default); parallel, which finds\n"
+        "                 all neighbours in parallel up front, then merges\n"
+        "                 clusters concurrently, with the same results as\n"
+        "                 sequential; or sampled (DBSCAN++), which only\n"
+        "                 queries a sample of the vectors, so is\n"
+        "                 approximate, and can't be used with approx\n"
+        "  --sample-fraction=F, --sample-count=N: for sampled, the fraction\n"
+        "                 of vectors to query, default 0.1, or how many,\n"
+        "                 which overrides it\n"
+        "  --sampling=S:  for sampled, uniform (the default) or kcenter\n"
+        "  --seed=N:      for sampled, the random seed, default 0\n"
+        "  --kernel=K:    force the distance kernel to scalar, sse, avx2 or\n"
+        "                 avx512, for benchmarking; by default the widest\n"
+        "                 the CPU supports is used\n"
+        "  --partitions=N: for euclidean, split the corpus into N slabs\n"
+        "                 along its widest column, each streamed from the\n"
+        "                 input file to a worker process, which holds just\n"
+        "                 its slab and the vectors within 2 * eps of it,\n"
+        "                 clustered, then merged; same results, default 1,\n"
+        "                 not with the sampled engine\n"
+        "  --stats:       print counts of region queries and distance\n"
+        "                 evaluations, and the time spent in each phase,\n"
+        "                 to stderr after clustering; not with\n"
+        "                 --partitions";
+
+    if (argc == 5 && std::string(argv[1]) == "convert") {
+        if (std::string(argv[2]) == "double") {
+            return convert_to_binary<double>(argv[3], argv[4]);
+        } else {
+            return convert_to_binary<float>(argv[3], argv[4]);
+        }
+    }
 
     if (argc < 7) {
         std::cerr << usage << std::endl;
@@ -158,11 +252,95 @@ int main(int argc, char** argv) {
     precision = argv[5];
     input_path = argv[6];
 
+    for (int i=7; i < argc; i++) {
+        std::string option = argv[i];
+        std::string value = option.substr(option.find('=') + 1);
+        if (option.compare(0, 12, "--leaf-size=") == 0) {
+            options.leaf_size = std::atol(value.c_str());
+            if (options.leaf_size <= 0) {
+                std::cerr << "leaf-size must be > 0" << std::endl;
+                return ExitValues::BadArguments;
+            }
+        } else if (option.compare(0, 10, "--threads=") == 0) {
+            options.threads = std::atol(value.c_str());
+            if (options.threads < 0) {
+                std::cerr << "threads must be >= 0" << std::endl;
+                return ExitValues::BadArguments;
+            }
+        } else if (option.compare(0, 8, "--prune=") == 0) {
+            options.prune = std::atoi(value.c_str()) != 0;
+        } else if (option.compare(0, 13, "--lsh-tables=") == 0) {
+            options.lsh_tables = std::atol(value.c_str());
+            if (options.lsh_tables <= 0) {
+                std::cerr << "lsh-tables must be > 0" << std::endl;
+                return ExitValues::BadArguments;
+            }
+        } else if (option.compare(0, 11, "--lsh-bits=") == 0) {
+            options.lsh_bits = std::atol(value.c_str());
+            if (options.lsh_bits <= 0 || options.lsh_bits > 64) {
+                std::cerr << "lsh-bits must be between 1 and 64" << std::endl;
+                return ExitValues::BadArguments;
+            }
+        } else if (option.compare(0, 15, "--quantization=") == 0) {
+            options.quantization = value;
+        } else if (option.compare(0, 6, "--rho=") == 0) {
+            options.rho = std::atof(value.c_str());
+            if (options.rho < 0) {
+                std::cerr << "rho must be >= 0" << std::endl;
+                return ExitValues::BadArguments;
+            }
+        } else if (option.compare(0, 9, "--engine=") == 0) {
+            options.engine = value;
+        } else if (option.compare(0, 18, "--sample-fraction=") == 0) {
+            options.sample_fraction = std::atof(value.c_str());
+            if (options.sample_fraction <= 0 ||
+                    options.sample_fraction > 1) {
+                std::cerr << "sample-fraction must be > 0 and <= 1"
+                    << std::endl;
+                return ExitValues::BadArguments;
+            }
+        } else if (option.compare(0, 15, "--sample-count=") == 0) {
+            options.sample_count = std::atol(value.c_str());
+            if (options.sample_count <= 0) {
+                std::cerr << "sample-count must be > 0" << std::endl;
+                return ExitValues::BadArguments;
+            }
+        } else if (option.compare(0, 11, "--sampling=") == 0) {
+            options.sampling = value;
+        } else if (option.compare(0, 7, "--seed=") == 0) {
+            options.seed = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (option.compare(0, 9, "--kernel=") == 0) {
+            if (!libdbscan::set_distance_kernel(value)) {
+                std::cerr << "kernel " << value << " is unknown or not "
+                    "supported by this CPU" << std::endl;
+                return ExitValues::BadArguments;
+            }
+        } else if (option.compare(0, 13, "--partitions=") == 0) {
+            partitions = std::atol(value.c_str());
+            if (partitions <= 0) {
+                std::cerr << "partitions must be > 0" << std::endl;
+                return ExitValues::BadArguments;
+            }
+        } else if (option == "--stats") {
+            print_stats = true;
+        } else {
+            std::cerr << "Unknown option " << option << std::endl;
+            std::cerr << usage << std::endl;
+            return ExitValues::BadArguments;
+        }
+    }
+
+    if (print_stats && partitions > 1) {
+        // stats are per dbscan object, which live in the workers
+        std::cerr << "--stats can't be used with --partitions" << std::endl;
+        return ExitValues::BadArguments;
+    }
+
     if (precision == "double") {
         return run_dbscan<double>(eps, min_pts, array_type, 
-                distance_metric, input_path);
+                distance_metric, input_path, options, partitions, print_stats);
     } else {
         return run_dbscan<float>(eps, min_pts, array_type, 
-                distance_metric, input_path);
+                distance_metric, input_path, options, partitions, print_stats);
     }
 }
@@ -20,9 +20,8 @@ X = X.astype(np.float32)
 ##############################################################################
 # Compute DBSCAN
 import dbscan
-labels = np.array(dbscan.dbscan(X, "sparse").run(0.3, 10))
-core_samples_mask = np.zeros_like(labels, dtype=bool)
-# core_samples_mask[db.core_sample_indices_] = True
+labels, noise, core_samples_mask = dbscan.dbscan(X, "sparse").run(0.3, 10,
+    masks=True)
 
 # Number of clusters in labels, ignoring noise if present.
 n_clusters_ = len(set(labels)) - (1 if -1 in labels else 0)
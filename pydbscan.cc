@@ -1,9 +1,135 @@
 #include <Python.h>
-#include "dbscan_nonsparse.h"
-#include "dbscan_sparse.h"
+#include "dbscan_factory.h"
+#include "dbscan_incremental.h"
+#include <atomic>
+#include <exception>
 #include <memory>
+#include <mutex>
 #include <numpy/arrayobject.h>
 
+class corpus_buffer {
+    // A 2D corpus of float32 or float64 from anything that supports the
+    // buffer protocol: numpy arrays, memoryviews and so on. A C-contiguous
+    // buffer is used in place, keeping its exporter alive; any other layout
+    // (a slice, Fortran order, ...) is copied into C order once, here,
+    // which is flagged in repacked and counted in num_repacks.
+public:
+    corpus_buffer() :
+        data(NULL), rows(0), cols(0), is_double(false), repacked(false),
+        _has_view(false)
+    {
+    }
+    ~corpus_buffer() { release(); }
+
+    corpus_buffer(const corpus_buffer&) = delete;
+    corpus_buffer& operator = (const corpus_buffer&) = delete;
+
+    // Returns false, with a python exception set, if obj isn't a 2D buffer
+    // of native float32 or float64
+    bool acquire(PyObject* obj);
+
+    const void* data;
+    npy_intp rows;
+    npy_intp cols;
+    bool is_double;
+    bool repacked;
+
+    // Repacks by every corpus_buffer so far
+    static unsigned long num_repacks;
+
+private:
+    void release() {
+        if (_has_view) {
+            PyBuffer_Release(&_view);
+            _has_view = false;
+        }
+    }
+
+    Py_buffer _view;
+    bool _has_view;
+    std::vector<char> _packed;
+};
+
+unsigned long corpus_buffer::num_repacks = 0;
+
+static bool
+parse_float_format(const char* format, bool* is_double)
+{
+    // Whether format is a struct-style format for one native float or
+    // double; no format means unsigned bytes
+    if (!format) {
+        return false;
+    }
+    const unsigned short one = 1;
+    const char native_order = *reinterpret_cast<const char*>(&one) ? '<' : '>';
+    if (*format == '@' || *format == '=' || *format == native_order) {
+        format++;
+    }
+    if (strcmp(format, "f") == 0 || strcmp(format, "d") == 0) {
+        *is_double = *format == 'd';
+        return true;
+    }
+    return false;
+}
+
+bool corpus_buffer::acquire(PyObject* obj)
+{
+    release();
+    if (PyObject_GetBuffer(obj, &_view, PyBUF_STRIDES | PyBUF_FORMAT) < 0) {
+        PyErr_SetString(PyExc_TypeError,
+                "corpus should be a numpy array or other buffer");
+        return false;
+    }
+    _has_view = true;
+
+    if (_view.ndim != 2) {
+        PyErr_SetString(PyExc_TypeError, "Must be 2D array");
+        release();
+        return false;
+    }
+    if (!parse_float_format(_view.format, &is_double) ||
+            _view.itemsize != static_cast<Py_ssize_t>(
+                is_double ? sizeof(double) : sizeof(float))) {
+        PyErr_SetString(PyExc_TypeError, "must be float32 or float64");
+        release();
+        return false;
+    }
+
+    rows = _view.shape[0];
+    cols = _view.shape[1];
+    const Py_ssize_t itemsize = _view.itemsize;
+    const Py_ssize_t row_stride = _view.strides ? _view.strides[0] : cols * itemsize;
+    const Py_ssize_t col_stride = _view.strides ? _view.strides[1] : itemsize;
+    if ((row_stride == cols * itemsize || rows <= 1) &&
+            (col_stride == itemsize || cols <= 1)) {
+        data = _view.buf;
+        repacked = false;
+        return true;
+    }
+
+    try {
+        _packed.resize(rows * cols * itemsize);
+    } catch (std::bad_alloc&) {
+        PyErr_SetString(PyExc_MemoryError, "Alloc failure repacking corpus");
+        release();
+        return false;
+    }
+    char* out = _packed.data();
+    for (npy_intp i=0; i < rows; i++) {
+        const char* row = static_cast<const char*>(_view.buf) + i * row_stride;
+        for (npy_intp j=0; j < cols; j++) {
+            std::memcpy(out, row + j * col_stride, itemsize);
+            out += itemsize;
+        }
+    }
+    data = _packed.data();
+    repacked = true;
+    num_repacks++;
+    // the copy is all that's needed from here on
+    release();
+    return true;
+}
+
 typedef struct {
     PyObject_HEAD
     bool is_double;
@@ -16,44 +142,49 @@ typedef struct {
         libdbscan::dbscan<float>* dbscanner_float;
         libdbscan::dbscan<double>* dbscanner_double;
     } dbscanner;
-    PyObject* array;
+    // The ordering from the last call to optics(), for extract(); NULL
+    // until then
+    union {
+        libdbscan::optics_ordering<float>* ordering_float;
+        libdbscan::optics_ordering<double>* ordering_double;
+    } ordering;
+    // The corpus the dbscanner holds a view of
+    corpus_buffer* corpus;
+    // Held while calling into the dbscanner, which happens with the GIL
+    // released, so calls from different python threads take turns
+    std::mutex* lock;
 } PyDbscan;
 
 static void 
 dbscan_dealloc(PyDbscan* self) {
     if (self->is_double) {
         delete self->dbscanner.dbscanner_double;
+        delete self->ordering.ordering_double;
     } else {
         delete self->dbscanner.dbscanner_float;
+        delete self->ordering.ordering_float;
     }
-    Py_XDECREF(self->array);
+    delete self->lock;
+    delete self->corpus;
 }
 
-void* get_c_corpus(PyObject* corpus, npy_intp* rows, npy_intp* cols, 
-        int* type_num) {
-    if (PyArray_Check(corpus)) {
-        int nd = PyArray_NDIM(corpus);
-        if (nd != 2) {
-            PyErr_SetString(PyExc_TypeError, "Must be 2D array");
-            return NULL;
-        }
-
-        PyArrayObject* array = ((PyArrayObject*)corpus);
-        if (array->descr->type_num != PyArray_FLOAT && 
-                array->descr->type_num != PyArray_DOUBLE) 
-        {
-            PyErr_SetString(PyExc_TypeError, 
-                    "must be PyArray_FLOAT or PyArray_DOUBLE");
-            return NULL;
-        }
-
-        *rows = array->dimensions[0];
-        *cols = array->dimensions[1];
-        *type_num = array->descr->type_num;
-        return array->data;
-    } else {
-        PyErr_SetString(PyExc_TypeError, "corpus should be numpy array");
-        return NULL;
+template <typename TFunc>
+static void
+without_gil(std::mutex& lock, TFunc func)
+{
+    // Calls func with the GIL released, holding lock, rethrowing anything
+    // it throws once the GIL is held again
+    std::exception_ptr error;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        std::lock_guard<std::mutex> guard(lock);
+        func();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    Py_END_ALLOW_THREADS
+    if (error) {
+        std::rethrow_exception(error);
     }
 }
 
@@ -66,6 +197,13 @@ dbscan_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
     }
 
     self->dbscanner.dbscanner_float = NULL;
+    self->ordering.ordering_float = NULL;
+    self->corpus = new (std::nothrow) corpus_buffer();
+    self->lock = new (std::nothrow) std::mutex();
+    if (!self->corpus || !self->lock) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
     return (PyObject*)self;
 }
 
@@ -74,128 +212,538 @@ dbscan_init(PyDbscan* self, PyObject* args, PyObject* kwds) {
     PyObject* corpus;
     const char* type = nullptr;
     const char* distance_metric = nullptr;
-    if (!PyArg_ParseTuple(args, "O|ss", &corpus, &type, &distance_metric)) {
+    const char* engine = nullptr;
+    const char* sampling = nullptr;
+    const char* quantization = nullptr;
+    int prune = 1;
+    libdbscan::dbscan_options options;
+    static char* kwlist[] = {
+        (char*)"corpus", (char*)"type", (char*)"distance_metric",
+        (char*)"leaf_size", (char*)"threads", (char*)"engine",
+        (char*)"prune", (char*)"rho", (char*)"lsh_tables", (char*)"lsh_bits",
+        (char*)"sample_count", (char*)"sample_fraction", (char*)"sampling",
+        (char*)"seed", (char*)"quantization", NULL
+    };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ssllsidllldsks", kwlist,
+                &corpus, &type, &distance_metric, &options.leaf_size,
+                &options.threads, &engine, &prune, &options.rho,
+                &options.lsh_tables, &options.lsh_bits, &options.sample_count,
+                &options.sample_fraction, &sampling, &options.seed,
+                &quantization)) {
         PyErr_SetString(PyExc_TypeError, "couldn't parse args");
         return -1;
     }
     
-    npy_intp rows, cols;
-    int type_num;
-    void* c_corpus = get_c_corpus(corpus, &rows, &cols, &type_num);
-    if (!c_corpus) {
+    if (options.leaf_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "leaf_size must be > 0");
         return -1;
     }
-    self->is_double = type_num == PyArray_DOUBLE;
-
-    // incref the array because we're going to muck about with its data
-    self->array = corpus;
-    Py_XINCREF(self->array);
-
-    // TODO - combinations are proliferating pretty badly here, maybe
-    // make some sort of factory available in the lib available like
-    // what we have in the CLI
-    if (!type || !strcmp(type, "nonsparse")) {
-        if (distance_metric && strcmp(distance_metric, "euclidean")) {
-            Py_XDECREF(self->array);
-            PyErr_SetString(PyExc_NotImplementedError,
-                "only euclidean distance is supported for non-sparse arrays");
-            return -1;
-        }
-        if (type_num == PyArray_FLOAT) {
-            self->dbscanner.dbscanner_float = new libdbscan::dbscan_nonsparse<float>(
-                    static_cast<float*>(c_corpus), rows, cols);
-        } else {
-            self->dbscanner.dbscanner_double = new libdbscan::dbscan_nonsparse<double>(
-                    static_cast<double*>(c_corpus), rows, cols);
-        }
-    } else {
-        if (!distance_metric || !strcmp(distance_metric, "euclidean")) {
-            if (type_num == PyArray_FLOAT) {
-                self->dbscanner.dbscanner_float = new libdbscan::dbscan_sparse<float>(
-                        static_cast<float*>(c_corpus), rows, cols);
-            } else {
-                self->dbscanner.dbscanner_double = new libdbscan::dbscan_sparse<double>(
-                        static_cast<double*>(c_corpus), rows, cols);
-            }
-        } else if (!strcmp(distance_metric, "cosine")) {
-            if (type_num == PyArray_FLOAT) {
-                self->dbscanner.dbscanner_float = new libdbscan::dbscan_sparse<float, 
-                    libdbscan::cosine_similarity_metric<float> >(
-                        static_cast<float*>(c_corpus), rows, cols);
-            } else {
-                self->dbscanner.dbscanner_double = new libdbscan::dbscan_sparse<double, 
-                    libdbscan::cosine_similarity_metric<double> >(
-                        static_cast<double*>(c_corpus), rows, cols);
-            }
+    if (options.threads < 0) {
+        PyErr_SetString(PyExc_ValueError, "threads must be >= 0");
+        return -1;
+    }
+    if (options.rho < 0) {
+        PyErr_SetString(PyExc_ValueError, "rho must be >= 0");
+        return -1;
+    }
+    if (options.lsh_tables <= 0) {
+        PyErr_SetString(PyExc_ValueError, "lsh_tables must be > 0");
+        return -1;
+    }
+    if (options.lsh_bits <= 0 || options.lsh_bits > 64) {
+        PyErr_SetString(PyExc_ValueError, "lsh_bits must be between 1 and 64");
+        return -1;
+    }
+    if (options.sample_count < 0) {
+        PyErr_SetString(PyExc_ValueError, "sample_count must be >= 0");
+        return -1;
+    }
+    if (options.sample_fraction <= 0 || options.sample_fraction > 1) {
+        PyErr_SetString(PyExc_ValueError,
+            "sample_fraction must be > 0 and <= 1");
+        return -1;
+    }
+    if (engine) {
+        options.engine = engine;
+    }
+    if (sampling) {
+        options.sampling = sampling;
+    }
+    if (quantization) {
+        options.quantization = quantization;
+    }
+    options.prune = prune != 0;
+
+    // held onto (as is the buffer's exporter, if it's used in place) since
+    // the dbscanner only takes a view of it
+    corpus_buffer& c_corpus = *self->corpus;
+    if (!c_corpus.acquire(corpus)) {
+        return -1;
+    }
+    self->is_double = c_corpus.is_double;
+
+    try {
+        if (!self->is_double) {
+            self->dbscanner.dbscanner_float = libdbscan::create_dbscan<float>(
+                    type ? type : "nonsparse",
+                    distance_metric ? distance_metric : "euclidean",
+                    static_cast<const float*>(c_corpus.data), c_corpus.rows,
+                    c_corpus.cols, options).release();
         } else {
-            Py_XDECREF(self->array);
-            PyErr_SetString(PyExc_NotImplementedError, "unknown distance metric");
-            return -1;
+            self->dbscanner.dbscanner_double = libdbscan::create_dbscan<double>(
+                    type ? type : "nonsparse",
+                    distance_metric ? distance_metric : "euclidean",
+                    static_cast<const double*>(c_corpus.data), c_corpus.rows,
+                    c_corpus.cols, options).release();
         }
+    } catch (const std::invalid_argument& e) {
+        PyErr_SetString(PyExc_NotImplementedError, e.what());
+        return -1;
+    } catch (std::bad_alloc&) {
+        PyErr_SetString(PyExc_MemoryError, "Alloc failure in dbscan()");
+        return -1;
     }
 
     return 0;
 }
 
 static PyObject*
-PyDbscan_run(PyDbscan* self, PyObject* args, PyObject* kwds) 
+labels_to_list(const std::vector<libdbscan::index_t>& labels)
 {
-    float eps; int min_pts;
-    if (!PyArg_ParseTuple(args, "fi", &eps, &min_pts)) {
+    PyObject* list_result = PyList_New(labels.size());
+    if (!list_result) {
+        PyErr_SetString(PyExc_RuntimeError, "couldn't create result");
         return NULL;
     }
 
-    // TODO: this could be done with a numpy array and it would 
-    // probably be a lot faster, but most of the time is spent
-    // in the algo itself
-    libdbscan::index_t num_rows;
+    for (size_t i=0; i < labels.size(); i++) {
+        PyObject* pylong = PyLong_FromLong(labels[i]);
+        if (!pylong) {
+            Py_DECREF(list_result);
+            return NULL;
+        }
+        PyList_SET_ITEM(list_result, i, pylong);
+    }
 
-    std::vector<libdbscan::index_t> results;
+    return list_result;
+}
+
+static void
+delete_labels(PyObject* capsule)
+{
+    delete static_cast<std::vector<libdbscan::index_t>*>(
+        PyCapsule_GetPointer(capsule, "dbscan.labels"));
+}
+
+static PyObject*
+labels_to_array(std::unique_ptr<std::vector<libdbscan::index_t> > labels)
+{
+    // A numpy array of index_t (long) that uses the vector's buffer in
+    // place, taking ownership of the vector; a capsule set as the array's
+    // base deletes it once the array is gone
+    npy_intp size = labels->size();
+    void* data = labels->data();
+    PyObject* capsule = PyCapsule_New(labels.get(), "dbscan.labels",
+        delete_labels);
+    if (!capsule) {
+        return NULL;
+    }
+    labels.release();
+
+    PyObject* array = PyArray_SimpleNewFromData(1, &size, NPY_LONG, data);
+    if (!array) {
+        Py_DECREF(capsule);
+        return NULL;
+    }
+    // steals the reference to capsule, even on failure
+    if (PyArray_SetBaseObject((PyArrayObject*)array, capsule) < 0) {
+        Py_DECREF(array);
+        return NULL;
+    }
+    return array;
+}
+
+static PyObject*
+flags_to_array(const std::vector<libdbscan::index_t>& flags)
+{
+    // A numpy bool array of the flags, so it can be used as a mask
+    npy_intp size = flags.size();
+    PyObject* array = PyArray_SimpleNew(1, &size, NPY_BOOL);
+    if (!array) {
+        return NULL;
+    }
+    npy_bool* data = static_cast<npy_bool*>(PyArray_DATA((PyArrayObject*)array));
+    for (size_t i=0; i < flags.size(); i++) {
+        data[i] = flags[i] != 0;
+    }
+    return array;
+}
+
+static PyObject*
+stat_to_object(libdbscan::index_t value)
+{
+    return PyLong_FromLong(value);
+}
+
+static PyObject*
+stat_to_object(double value)
+{
+    return PyFloat_FromDouble(value);
+}
+
+static PyObject*
+stats_to_dict(const libdbscan::dbscan_stats& stats)
+{
+    // A dict of the stats by name: ints for the counts, floats for the
+    // seconds
+    PyObject* dict = PyDict_New();
+    if (!dict) {
+        return NULL;
+    }
+    bool ok = true;
+    stats.visit([&] (const char* name, auto value) {
+        if (!ok) {
+            return;
+        }
+        PyObject* item = stat_to_object(value);
+        if (!item || PyDict_SetItemString(dict, name, item) < 0) {
+            ok = false;
+        }
+        Py_XDECREF(item);
+    });
+    if (!ok) {
+        Py_DECREF(dict);
+        return NULL;
+    }
+    return dict;
+}
+
+static PyObject*
+PyDbscan_run(PyDbscan* self, PyObject* args, PyObject* kwds) 
+{
+    float eps; int min_pts; int masks = 0; int want_stats = 0;
+    static char* kwlist[] = {
+        (char*)"eps", (char*)"min_pts", (char*)"masks", (char*)"stats", NULL
+    };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "fi|ii", kwlist, &eps,
+                &min_pts, &masks, &want_stats)) {
+        return NULL;
+    }
+
+    // The labels are handed over to the array that's returned, so they're
+    // not copied
+    std::unique_ptr<std::vector<libdbscan::index_t> > results(
+        new std::vector<libdbscan::index_t>());
     std::vector<libdbscan::index_t> noise;
+    std::vector<libdbscan::index_t> core;
+    libdbscan::dbscan_stats stats;
     try {
-        if (self->is_double) {
-            self->dbscanner.dbscanner_double->run(eps, min_pts, results, noise);
-            num_rows = self->dbscanner.dbscanner_double->get_num_rows();
-        } else {
-            self->dbscanner.dbscanner_float->run(eps, min_pts, results, noise);
-            num_rows = self->dbscanner.dbscanner_float->get_num_rows();
-        }
+        // stats are only set for this run, under the lock, so other calls
+        // don't write to them
+        without_gil(*self->lock, [&] {
+            libdbscan::dbscan_stats* stats_ptr = want_stats ? &stats : NULL;
+            if (self->is_double) {
+                self->dbscanner.dbscanner_double->set_stats(stats_ptr);
+                self->dbscanner.dbscanner_double->run(eps, min_pts, *results,
+                    noise, core);
+                self->dbscanner.dbscanner_double->set_stats(NULL);
+            } else {
+                self->dbscanner.dbscanner_float->set_stats(stats_ptr);
+                self->dbscanner.dbscanner_float->run(eps, min_pts, *results,
+                    noise, core);
+                self->dbscanner.dbscanner_float->set_stats(NULL);
+            }
+        });
+    } catch (const std::invalid_argument& e) {
+        // e.g. an eps the implementation can't use
+        PyErr_SetString(PyExc_ValueError, e.what());
+        return NULL;
     } catch (std::bad_alloc&) {
         PyErr_SetString(PyExc_MemoryError, "Alloc failure in run()");
         return NULL;
     } catch (...) {
-        // we don't explicitly throw any exceptions in run(), but lets catch
-        // anyway incase stdlib throws
+        // we don't explicitly throw any other exceptions in run(), but lets
+        // catch anyway incase stdlib throws
         PyErr_SetString(PyExc_RuntimeError, "unknown exception in run()");
         return NULL;
     }
 
-    PyObject* list_result = PyList_New(num_rows);
+    PyObject* labels = labels_to_array(std::move(results));
+    if (!labels || (!masks && !want_stats)) {
+        return labels;
+    }
+
+    // The labels, then the masks and the stats if they were asked for
+    PyObject* items[4] = {labels, NULL, NULL, NULL};
+    Py_ssize_t num_items = 1;
+    bool ok = true;
+    if (masks) {
+        items[num_items++] = flags_to_array(noise);
+        items[num_items++] = flags_to_array(core);
+    }
+    if (want_stats) {
+        items[num_items++] = stats_to_dict(stats);
+    }
+    PyObject* result = PyTuple_New(num_items);
+    for (Py_ssize_t i=0; i < num_items; i++) {
+        ok = ok && items[i];
+    }
+    if (!result || !ok) {
+        Py_XDECREF(result);
+        for (Py_ssize_t i=0; i < num_items; i++) {
+            Py_XDECREF(items[i]);
+        }
+        return NULL;
+    }
+    // PyTuple_SET_ITEM steals the references
+    for (Py_ssize_t i=0; i < num_items; i++) {
+        PyTuple_SET_ITEM(result, i, items[i]);
+    }
+    return result;
+}
+
+template <typename TNum>
+static void
+sweep_dbscan(libdbscan::dbscan<TNum>* dbscanner, const std::vector<double>& eps,
+        int min_pts, std::vector<std::vector<libdbscan::index_t> >& results,
+        std::vector<std::vector<libdbscan::index_t> >& noise)
+{
+    std::vector<TNum> eps_values(eps.begin(), eps.end());
+    dbscanner->sweep(eps_values, min_pts, results, noise);
+}
+
+static PyObject*
+PyDbscan_sweep(PyDbscan* self, PyObject* args, PyObject* kwds) 
+{
+    PyObject* eps_seq; int min_pts;
+    if (!PyArg_ParseTuple(args, "Oi", &eps_seq, &min_pts)) {
+        return NULL;
+    }
+
+    PyObject* eps_fast = PySequence_Fast(eps_seq, "eps_values must be a sequence");
+    if (!eps_fast) {
+        return NULL;
+    }
+    std::vector<double> eps(PySequence_Fast_GET_SIZE(eps_fast));
+    for (size_t e=0; e < eps.size(); e++) {
+        eps[e] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(eps_fast, e));
+    }
+    Py_DECREF(eps_fast);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    std::vector<std::vector<libdbscan::index_t> > results;
+    std::vector<std::vector<libdbscan::index_t> > noise;
+    try {
+        without_gil(*self->lock, [&] {
+            if (self->is_double) {
+                sweep_dbscan(self->dbscanner.dbscanner_double, eps, min_pts,
+                    results, noise);
+            } else {
+                sweep_dbscan(self->dbscanner.dbscanner_float, eps, min_pts,
+                    results, noise);
+            }
+        });
+    } catch (std::bad_alloc&) {
+        PyErr_SetString(PyExc_MemoryError, "Alloc failure in sweep()");
+        return NULL;
+    } catch (const std::invalid_argument& e) {
+        PyErr_SetString(PyExc_ValueError, e.what());
+        return NULL;
+    } catch (const std::logic_error& e) {
+        PyErr_SetString(PyExc_NotImplementedError, e.what());
+        return NULL;
+    } catch (...) {
+        PyErr_SetString(PyExc_RuntimeError, "unknown exception in sweep()");
+        return NULL;
+    }
+
+    PyObject* list_result = PyList_New(results.size());
     if (!list_result) {
         PyErr_SetString(PyExc_RuntimeError, "couldn't create result");
         return NULL;
     }
-
-    for (size_t i=0; i < num_rows; i++) {
-        PyObject* pylong = PyLong_FromLong(results[i]);
-        if (!pylong) {
+    for (size_t e=0; e < results.size(); e++) {
+        PyObject* labels = labels_to_list(results[e]);
+        if (!labels) {
             Py_DECREF(list_result);
             return NULL;
         }
-        PyList_SET_ITEM(list_result, i, pylong);
+        PyList_SET_ITEM(list_result, e, labels);
     }
 
     return list_result;
 }
 
+template <typename TNum>
+static void
+optics_dbscan(libdbscan::dbscan<TNum>* dbscanner,
+        libdbscan::optics_ordering<TNum>*& ordering, double max_eps,
+        int min_pts, std::vector<double>& reachability)
+{
+    if (!ordering) {
+        ordering = new libdbscan::optics_ordering<TNum>();
+    }
+    dbscanner->optics(max_eps, min_pts, *ordering);
+
+    // in the order visited, and as eps rather than neighbour scores
+    reachability.resize(ordering->order.size());
+    for (size_t k=0; k < reachability.size(); k++) {
+        reachability[k] = dbscanner->neighbour_eps(
+            ordering->reachability[ordering->order[k]]);
+    }
+}
+
+static PyObject*
+PyDbscan_optics(PyDbscan* self, PyObject* args, PyObject* kwds) 
+{
+    float max_eps; int min_pts;
+    if (!PyArg_ParseTuple(args, "fi", &max_eps, &min_pts)) {
+        return NULL;
+    }
+
+    // copied out while the lock's held, as another thread could run
+    // optics() again once it isn't
+    std::vector<double> reachability;
+    std::vector<libdbscan::index_t> order;
+    try {
+        without_gil(*self->lock, [&] {
+            if (self->is_double) {
+                optics_dbscan(self->dbscanner.dbscanner_double,
+                    self->ordering.ordering_double, max_eps, min_pts,
+                    reachability);
+                order = self->ordering.ordering_double->order;
+            } else {
+                optics_dbscan(self->dbscanner.dbscanner_float,
+                    self->ordering.ordering_float, max_eps, min_pts,
+                    reachability);
+                order = self->ordering.ordering_float->order;
+            }
+        });
+    } catch (std::bad_alloc&) {
+        PyErr_SetString(PyExc_MemoryError, "Alloc failure in optics()");
+        return NULL;
+    } catch (const std::invalid_argument& e) {
+        PyErr_SetString(PyExc_ValueError, e.what());
+        return NULL;
+    } catch (const std::logic_error& e) {
+        PyErr_SetString(PyExc_NotImplementedError, e.what());
+        return NULL;
+    } catch (...) {
+        PyErr_SetString(PyExc_RuntimeError, "unknown exception in optics()");
+        return NULL;
+    }
+
+    PyObject* order_list = labels_to_list(order);
+    if (!order_list) {
+        return NULL;
+    }
+    PyObject* reachability_list = PyList_New(reachability.size());
+    if (!reachability_list) {
+        Py_DECREF(order_list);
+        PyErr_SetString(PyExc_RuntimeError, "couldn't create result");
+        return NULL;
+    }
+    for (size_t k=0; k < reachability.size(); k++) {
+        PyObject* pyfloat = PyFloat_FromDouble(reachability[k]);
+        if (!pyfloat) {
+            Py_DECREF(order_list);
+            Py_DECREF(reachability_list);
+            return NULL;
+        }
+        PyList_SET_ITEM(reachability_list, k, pyfloat);
+    }
+
+    PyObject* result = PyTuple_Pack(2, order_list, reachability_list);
+    Py_DECREF(order_list);
+    Py_DECREF(reachability_list);
+    return result;
+}
+
+static PyObject*
+PyDbscan_extract(PyDbscan* self, PyObject* args, PyObject* kwds) 
+{
+    float eps;
+    if (!PyArg_ParseTuple(args, "f", &eps)) {
+        return NULL;
+    }
+
+    std::vector<libdbscan::index_t> results;
+    try {
+        without_gil(*self->lock, [&] {
+            // the ordering is made by optics(), under the lock
+            if (!self->ordering.ordering_float) {
+                throw std::runtime_error("optics() hasn't been run");
+            }
+            if (self->is_double) {
+                self->dbscanner.dbscanner_double->extract_dbscan(
+                    *self->ordering.ordering_double, eps, results);
+            } else {
+                self->dbscanner.dbscanner_float->extract_dbscan(
+                    *self->ordering.ordering_float, eps, results);
+            }
+        });
+    } catch (const std::invalid_argument& e) {
+        PyErr_SetString(PyExc_ValueError, e.what());
+        return NULL;
+    } catch (const std::runtime_error& e) {
+        PyErr_SetString(PyExc_RuntimeError, e.what());
+        return NULL;
+    } catch (std::bad_alloc&) {
+        PyErr_SetString(PyExc_MemoryError, "Alloc failure in extract()");
+        return NULL;
+    } catch (...) {
+        PyErr_SetString(PyExc_RuntimeError, "unknown exception in extract()");
+        return NULL;
+    }
+
+    return labels_to_list(results);
+}
+
 static PyMethodDef dbscan_methods[] = {
-    {"run", (PyCFunction)PyDbscan_run, METH_VARARGS, 
-     "run(eps, min_pts, type) where eps is a float, min_pts is an integer, and"
-     " type is 'nonsparse' (the default) or 'sparse'"
+    {"run", (PyCFunction)PyDbscan_run, METH_VARARGS | METH_KEYWORDS, 
+     "run(eps, min_pts, masks=False, stats=False) where eps is a float and"
+     " min_pts is an integer; returns the labels as a numpy array, -1 for"
+     " noise, or with masks, a tuple of the labels and numpy bool arrays of"
+     " the noise flags run() sets (vectors no cluster had reached when they"
+     " were visited) and which vectors are core; with stats, a dict of"
+     " region query and distance evaluation counts and of phase timings is"
+     " added to the end of the tuple"
+    },   
+    {"sweep", (PyCFunction)PyDbscan_sweep, METH_VARARGS, 
+     "sweep(eps_values, min_pts) where eps_values is a sequence of floats;"
+     " returns a list of labels for each, as run() would, but only does the"
+     " region queries once, for the widest eps"
+    },   
+    {"optics", (PyCFunction)PyDbscan_optics, METH_VARARGS, 
+     "optics(max_eps, min_pts) runs OPTICS up to max_eps, returning the"
+     " vectors' indexes in the order visited and their reachability distances"
+     " in that order; the ordering is kept for extract()"
+    },   
+    {"extract", (PyCFunction)PyDbscan_extract, METH_VARARGS, 
+     "extract(eps) returns the labels for eps, which must be no wider than"
+     " the max_eps of the last optics() call, as run() would give (up to which"
+     " cluster border vectors near several clusters go in), without any more"
+     " region queries"
     },   
     {NULL}  /* Sentinel */
 };
 
+static PyObject*
+PyDbscan_get_repacked(PyDbscan* self, void* closure)
+{
+    return PyBool_FromLong(self->corpus->repacked);
+}
+
+static PyGetSetDef dbscan_getset[] = {
+    {(char*)"repacked", (getter)PyDbscan_get_repacked, NULL,
+     (char*)"whether the corpus had to be copied, as it wasn't C-contiguous",
+     NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
 static PyTypeObject dbscanType = {
     PyObject_HEAD_INIT(NULL)
     0,                         /*ob_size*/
@@ -227,7 +775,7 @@ static PyTypeObject dbscanType = {
     0,		               /* tp_iternext */
     dbscan_methods,             /* tp_methods */
     0,
-    0,                         /* tp_getset */
+    dbscan_getset,             /* tp_getset */
     0,                         /* tp_base */
     0,                         /* tp_dict */
     0,                         /* tp_descr_get */
@@ -238,19 +786,426 @@ static PyTypeObject dbscanType = {
     dbscan_new,                 /* tp_new */
 };
 
+typedef struct {
+    PyObject_HEAD
+    bool is_double;
+    union {
+        libdbscan::dbscan_incremental<float>* incremental_float;
+        libdbscan::dbscan_incremental<double>* incremental_double;
+    } incremental;
+} PyIncremental;
+
+static void 
+incremental_dealloc(PyIncremental* self) {
+    if (self->is_double) {
+        delete self->incremental.incremental_double;
+    } else {
+        delete self->incremental.incremental_float;
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject*
+incremental_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    PyIncremental* self;
+    self = (PyIncremental*)type->tp_alloc(type, 0);
+    if (!self) {
+        return NULL;
+    }
+
+    self->incremental.incremental_float = NULL;
+    return (PyObject*)self;
+}
+
+static int 
+incremental_init(PyIncremental* self, PyObject* args, PyObject* kwds) {
+    long cols;
+    double eps;
+    long min_pts;
+    const char* precision = "double";
+    static char* kwlist[] = {
+        (char*)"cols", (char*)"eps", (char*)"min_pts", (char*)"precision",
+        NULL
+    };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ldl|s", kwlist, &cols,
+                &eps, &min_pts, &precision)) {
+        return -1;
+    }
+
+    if (cols <= 0) {
+        PyErr_SetString(PyExc_ValueError, "cols must be > 0");
+        return -1;
+    }
+    if (!(eps > 0)) {
+        PyErr_SetString(PyExc_ValueError, "eps must be > 0");
+        return -1;
+    }
+    if (min_pts <= 0) {
+        PyErr_SetString(PyExc_ValueError, "min_pts must be > 0");
+        return -1;
+    }
+    if (strcmp(precision, "double") != 0 && strcmp(precision, "single") != 0) {
+        PyErr_SetString(PyExc_ValueError,
+                "precision must be 'single' or 'double'");
+        return -1;
+    }
+
+    try {
+        self->is_double = strcmp(precision, "double") == 0;
+        if (self->is_double) {
+            self->incremental.incremental_double =
+                new libdbscan::dbscan_incremental<double>(cols, eps, min_pts);
+        } else {
+            self->incremental.incremental_float =
+                new libdbscan::dbscan_incremental<float>(cols, eps, min_pts);
+        }
+    } catch (std::bad_alloc&) {
+        PyErr_SetString(PyExc_MemoryError, "Alloc failure in incremental()");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject*
+PyIncremental_insert(PyIncremental* self, PyObject* args, PyObject* kwds)
+{
+    PyObject* vectors;
+    if (!PyArg_ParseTuple(args, "O", &vectors)) {
+        return NULL;
+    }
+
+    // copied by insert(), so only needed for the call
+    corpus_buffer c_vectors;
+    if (!c_vectors.acquire(vectors)) {
+        return NULL;
+    }
+    const npy_intp rows = c_vectors.rows;
+    const npy_intp cols = c_vectors.cols;
+    if (c_vectors.is_double != self->is_double) {
+        PyErr_SetString(PyExc_TypeError,
+                "vectors must match the precision given to incremental()");
+        return NULL;
+    }
+
+    std::vector<libdbscan::index_t> ids;
+    try {
+        if (self->is_double) {
+            if (cols != self->incremental.incremental_double->get_num_cols()) {
+                PyErr_SetString(PyExc_ValueError, "wrong number of columns");
+                return NULL;
+            }
+            self->incremental.incremental_double->insert(
+                static_cast<const double*>(c_vectors.data), rows, ids);
+        } else {
+            if (cols != self->incremental.incremental_float->get_num_cols()) {
+                PyErr_SetString(PyExc_ValueError, "wrong number of columns");
+                return NULL;
+            }
+            self->incremental.incremental_float->insert(
+                static_cast<const float*>(c_vectors.data), rows, ids);
+        }
+    } catch (std::bad_alloc&) {
+        PyErr_SetString(PyExc_MemoryError, "Alloc failure in insert()");
+        return NULL;
+    }
+
+    return labels_to_list(ids);
+}
+
+static PyObject*
+PyIncremental_remove(PyIncremental* self, PyObject* args, PyObject* kwds)
+{
+    PyObject* id_seq;
+    if (!PyArg_ParseTuple(args, "O", &id_seq)) {
+        return NULL;
+    }
+
+    PyObject* id_fast = PySequence_Fast(id_seq, "ids must be a sequence");
+    if (!id_fast) {
+        return NULL;
+    }
+    std::vector<libdbscan::index_t> ids(PySequence_Fast_GET_SIZE(id_fast));
+    for (size_t k=0; k < ids.size(); k++) {
+        ids[k] = PyInt_AsLong(PySequence_Fast_GET_ITEM(id_fast, k));
+    }
+    Py_DECREF(id_fast);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    try {
+        if (self->is_double) {
+            self->incremental.incremental_double->remove(ids);
+        } else {
+            self->incremental.incremental_float->remove(ids);
+        }
+    } catch (const std::invalid_argument& e) {
+        PyErr_SetString(PyExc_KeyError, e.what());
+        return NULL;
+    } catch (std::bad_alloc&) {
+        PyErr_SetString(PyExc_MemoryError, "Alloc failure in remove()");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+PyIncremental_labels(PyIncremental* self, PyObject* args, PyObject* kwds)
+{
+    std::vector<libdbscan::index_t> ids;
+    std::vector<libdbscan::index_t> results;
+    try {
+        if (self->is_double) {
+            self->incremental.incremental_double->labels(ids, results);
+        } else {
+            self->incremental.incremental_float->labels(ids, results);
+        }
+    } catch (std::bad_alloc&) {
+        PyErr_SetString(PyExc_MemoryError, "Alloc failure in labels()");
+        return NULL;
+    }
+
+    PyObject* id_list = labels_to_list(ids);
+    if (!id_list) {
+        return NULL;
+    }
+    PyObject* label_list = labels_to_list(results);
+    if (!label_list) {
+        Py_DECREF(id_list);
+        return NULL;
+    }
+    PyObject* result = PyTuple_Pack(2, id_list, label_list);
+    Py_DECREF(id_list);
+    Py_DECREF(label_list);
+    return result;
+}
+
+static PyMethodDef incremental_methods[] = {
+    {"insert", (PyCFunction)PyIncremental_insert, METH_VARARGS, 
+     "insert(vectors) adds the rows of a 2D array, returning their ids"
+    },   
+    {"remove", (PyCFunction)PyIncremental_remove, METH_VARARGS, 
+     "remove(ids) removes the vectors with the given ids"
+    },   
+    {"labels", (PyCFunction)PyIncremental_labels, METH_NOARGS, 
+     "labels() returns the current vectors' ids, ascending, and their labels,"
+     " as run() would give for an array of those vectors in that order"
+    },   
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject incrementalType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "dbscan.incremental",      /*tp_name*/
+    sizeof(PyIncremental),     /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)incremental_dealloc,/*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    "incremental(cols, eps, min_pts, precision='double'): euclidean dbscan"
+    " kept up to date as vectors are inserted and removed", /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    0,		               /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    incremental_methods,       /* tp_methods */
+    0,
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)incremental_init, /* tp_init */
+    0,                         /* tp_alloc */
+    incremental_new,           /* tp_new */
+};
+
+struct run_many_job {
+    // One of run_many's corpora, and its labels, or what went wrong
+    // clustering it
+    corpus_buffer corpus;
+    std::unique_ptr<std::vector<libdbscan::index_t> > labels;
+    std::exception_ptr error;
+};
+
+template <typename TNum>
+static void
+run_job(run_many_job& job, const char* type, const char* distance_metric,
+        float eps, int min_pts)
+{
+    auto dbscanner = libdbscan::create_dbscan<TNum>(type, distance_metric,
+        static_cast<const TNum*>(job.corpus.data), job.corpus.rows,
+        job.corpus.cols);
+    job.labels.reset(new std::vector<libdbscan::index_t>());
+    std::vector<libdbscan::index_t> noise;
+    dbscanner->run(eps, min_pts, *job.labels, noise);
+}
+
+static PyObject*
+dbscan_run_many(PyObject* module, PyObject* args, PyObject* kwds)
+{
+    PyObject* corpora;
+    float eps; int min_pts;
+    long threads = 0;
+    const char* type = "nonsparse";
+    const char* distance_metric = "euclidean";
+    static char* kwlist[] = {
+        (char*)"corpora", (char*)"eps", (char*)"min_pts", (char*)"threads",
+        (char*)"type", (char*)"distance_metric", NULL
+    };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Ofi|lss", kwlist, &corpora,
+                &eps, &min_pts, &threads, &type, &distance_metric)) {
+        return NULL;
+    }
+    if (threads < 0) {
+        PyErr_SetString(PyExc_ValueError, "threads must be >= 0");
+        return NULL;
+    }
+    // Checked up front, so that errors from the runs are about the corpora
+    // and eps
+    try {
+        libdbscan::check_dbscan_arguments<float>(type, distance_metric);
+    } catch (const std::invalid_argument& e) {
+        PyErr_SetString(PyExc_NotImplementedError, e.what());
+        return NULL;
+    }
+
+    PyObject* corpora_fast = PySequence_Fast(corpora,
+        "corpora must be a sequence");
+    if (!corpora_fast) {
+        return NULL;
+    }
+    // the buffers are released (under the GIL) as jobs goes out of scope
+    std::vector<run_many_job> jobs(PySequence_Fast_GET_SIZE(corpora_fast));
+    for (size_t k=0; k < jobs.size(); k++) {
+        if (!jobs[k].corpus.acquire(PySequence_Fast_GET_ITEM(corpora_fast, k))) {
+            Py_DECREF(corpora_fast);
+            return NULL;
+        }
+    }
+    Py_DECREF(corpora_fast);
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::max(1L, std::min<long>(threads, jobs.size()));
+
+    // The corpora are clustered one per thread at a time, each on its own
+    // dbscanner; they vary in size, so each thread takes the next one when
+    // it's done rather than being handed a fixed share
+    std::exception_ptr pool_error;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        libdbscan::thread_pool pool(threads);
+        std::atomic<size_t> next(0);
+        pool.parallel_for(threads, [&] (long thread_i, long begin, long end) {
+            for (size_t k=next++; k < jobs.size(); k=next++) {
+                try {
+                    if (jobs[k].corpus.is_double) {
+                        run_job<double>(jobs[k], type, distance_metric, eps,
+                            min_pts);
+                    } else {
+                        run_job<float>(jobs[k], type, distance_metric, eps,
+                            min_pts);
+                    }
+                } catch (...) {
+                    jobs[k].error = std::current_exception();
+                }
+            }
+        });
+    } catch (...) {
+        pool_error = std::current_exception();
+    }
+    Py_END_ALLOW_THREADS
+
+    for (size_t k=0; k <= jobs.size(); k++) {
+        std::exception_ptr error = k < jobs.size() ? jobs[k].error : pool_error;
+        if (!error) {
+            continue;
+        }
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::invalid_argument& e) {
+            PyErr_SetString(PyExc_ValueError, e.what());
+        } catch (std::bad_alloc&) {
+            PyErr_SetString(PyExc_MemoryError, "Alloc failure in run_many()");
+        } catch (...) {
+            PyErr_SetString(PyExc_RuntimeError,
+                "unknown exception in run_many()");
+        }
+        return NULL;
+    }
+
+    PyObject* list_result = PyList_New(jobs.size());
+    if (!list_result) {
+        return NULL;
+    }
+    for (size_t k=0; k < jobs.size(); k++) {
+        PyObject* labels = labels_to_array(std::move(jobs[k].labels));
+        if (!labels) {
+            Py_DECREF(list_result);
+            return NULL;
+        }
+        PyList_SET_ITEM(list_result, k, labels);
+    }
+    return list_result;
+}
+
+static PyObject*
+dbscan_repack_count(PyObject* module, PyObject* args)
+{
+    return PyLong_FromUnsignedLong(corpus_buffer::num_repacks);
+}
+
+static PyMethodDef module_methods[] = {
+    {"run_many", (PyCFunction)dbscan_run_many, METH_VARARGS | METH_KEYWORDS,
+     "run_many(corpora, eps, min_pts, threads=0, type='nonsparse',"
+     " distance_metric='euclidean') clusters each of a sequence of 2D arrays"
+     " independently, as dbscan(corpus, type, distance_metric).run(eps,"
+     " min_pts) would, on threads native threads (0 for one per core),"
+     " returning a list of their labels"
+    },
+    {"repack_count", (PyCFunction)dbscan_repack_count, METH_NOARGS,
+     "repack_count() returns how many corpora, of any call, had to be copied"
+     " into C order because they were strided or Fortran-order"
+    },
+    {NULL}  /* Sentinel */
+};
 
 PyMODINIT_FUNC
 initdbscan(void)
 {
-    if (PyType_Ready(&dbscanType) < 0) {
+    if (PyType_Ready(&dbscanType) < 0 ||
+            PyType_Ready(&incrementalType) < 0) {
         return;
     }
 
-    PyObject* module = Py_InitModule3("dbscan", dbscan_methods, 
+    PyObject* module = Py_InitModule3("dbscan", module_methods, 
             "DBSCAN algorithm");
 
     Py_INCREF(&dbscanType);
     PyModule_AddObject(module, "dbscan", (PyObject*)&dbscanType);
+    Py_INCREF(&incrementalType);
+    PyModule_AddObject(module, "incremental", (PyObject*)&incrementalType);
 
     import_array();
 }
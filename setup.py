@@ -5,8 +5,8 @@ import sys
 extra_compile_args = [
     # Optimize yet more on gcc compatible compilers
     "-O3", 
-    # Hopefully will enable sse if possible
-    "-march=native"
+    # No -march=native: the SIMD distance kernels are picked at load time
+    # based on the CPU, so the extension is portable between hosts
 ]
 
 if sys.platform == "darwin":
@@ -19,10 +19,10 @@ if sys.platform == "darwin":
         "-mmacosx-version-min=10.7"
     ])
 else:
-    # Assume gcc, sorry no windows
+    # Assume gcc, sorry no windows; c++14 for std::make_unique and generic
+    # lambdas, and gcc has no -stdlib
     extra_compile_args.extend([
-        "-std=c++0x",
-        "-stdlib=libc++"
+        "-std=c++14"
     ])
 
 ext_modules = [Extension("dbscan", 
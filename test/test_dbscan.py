@@ -8,7 +8,7 @@ This could be improved greatly.
 from __future__ import print_function
 from sklearn.datasets.samples_generator import make_blobs
 from sklearn.preprocessing import StandardScaler
-from nose.tools import assert_equal
+from nose.tools import assert_equal, assert_raises
 import numpy as np
 import dbscan
 import abc
@@ -33,7 +33,7 @@ class DbScanBase(object):
     MIN_PTS = 10
 
     @abc.abstractmethod
-    def _create_dbscan(self, sample_data, *args):
+    def _create_dbscan(self, sample_data, *args, **kwargs):
         pass
 
     def setup(self):
@@ -113,12 +113,398 @@ class DbScanBase(object):
         assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
 
 
+    def test_nonsparse_single_cosine(self):
+        """
+        Non-sparse array with single precision floats, cosine similarity
+        metric
+        """
+        labels = self._create_dbscan(self.sample_data_single, 
+                "nonsparse", "cosine").run(self.COSINE_EPS, self.MIN_PTS)
+        assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
+
+    def test_nonsparse_double_cosine(self):
+        """
+        Non-sparse array with double precision floats, cosine similarity
+        metric
+        """
+        labels = self._create_dbscan(self.sample_data_double, 
+                "nonsparse", "cosine").run(self.COSINE_EPS, self.MIN_PTS)
+        assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
+
+    def test_grid_single(self):
+        """ 
+        Grid-indexed non-sparse array with single precision floats, Euclidean
+        distance
+        """
+        labels = self._create_dbscan(self.sample_data_single, "grid",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
+
+    def test_grid_double(self):
+        """ 
+        Grid-indexed non-sparse array with double precision floats, Euclidean
+        distance
+        """
+        labels = self._create_dbscan(self.sample_data_double, "grid",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
+
+
+    def test_kdtree_single(self):
+        """ 
+        kd-tree indexed non-sparse array with single precision floats,
+        Euclidean distance
+        """
+        labels = self._create_dbscan(self.sample_data_single, "kdtree",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
+
+    def test_kdtree_double(self):
+        """ 
+        kd-tree indexed non-sparse array with double precision floats,
+        Euclidean distance
+        """
+        labels = self._create_dbscan(self.sample_data_double, "kdtree",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
+
+    def test_approx_single(self):
+        """
+        rho-approximate clustering of a non-sparse array with single
+        precision floats, Euclidean distance
+        """
+        labels = self._create_dbscan(self.sample_data_single, "approx",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
+
+    def test_approx_exact(self):
+        """
+        rho-approximate clustering with rho 0 should give exactly the same
+        labels as exact clustering, threaded or not
+        """
+        expected = self._create_dbscan(self.sample_data_double, "nonsparse",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        for threads in (1, 4):
+            labels = self._create_dbscan(self.sample_data_double, "approx",
+                "euclidean", rho=0, threads=threads).run(self.EUCLIDEAN_EPS,
+                    self.MIN_PTS)
+            assert_equal(list(labels), list(expected))
+
+
+    def test_quantized_exact(self):
+        """
+        Scanning quantized copies of the corpus, with the pairs near eps
+        rechecked, should give exactly the same labels as a full precision
+        scan
+        """
+        for data in (self.sample_data_single, self.sample_data_double):
+            expected = self._create_dbscan(data, "nonsparse",
+                "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+            for quantization in ("int8", "fp16", "bf16"):
+                labels = self._create_dbscan(data, "quantized", "euclidean",
+                    quantization=quantization).run(self.EUCLIDEAN_EPS,
+                        self.MIN_PTS)
+                assert_equal(list(labels), list(expected))
+
+    def test_inverted_single_cosine(self):
+        """
+        Inverted index over a sparse array with single precision floats,
+        cosine similarity metric
+        """
+        labels = self._create_dbscan(self.sample_data_single, 
+                "inverted", "cosine").run(self.COSINE_EPS, self.MIN_PTS)
+        assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
+
+    def test_inverted_double_cosine(self):
+        """
+        Inverted index over a sparse array with double precision floats,
+        cosine similarity metric
+        """
+        labels = self._create_dbscan(self.sample_data_double, 
+                "inverted", "cosine").run(self.COSINE_EPS, self.MIN_PTS)
+        assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
+
+    def test_lsh_single_cosine(self):
+        """
+        SimHash LSH over a non-sparse array with single precision floats,
+        cosine similarity metric
+        """
+        labels = self._create_dbscan(self.sample_data_single,
+                "lsh", "cosine").run(self.COSINE_EPS, self.MIN_PTS)
+        assert_equal(self._num_clusters(labels), self.EXPECTED_NUM_CLUSTERS)
+
+    def test_lsh_double_cosine(self):
+        """
+        With eps this close to 1 neighbours are near certain to share a key
+        in one of the tables, so the labels should match the full scan's
+        """
+        expected = self._create_dbscan(self.sample_data_double,
+                "sparse", "cosine").run(self.COSINE_EPS, self.MIN_PTS)
+        labels = self._create_dbscan(self.sample_data_double,
+                "lsh", "cosine", lsh_tables=8, lsh_bits=6).run(
+                    self.COSINE_EPS, self.MIN_PTS)
+        assert_equal(list(labels), list(expected))
+
+    def test_nonsparse_threads(self):
+        """ 
+        Non-sparse array with the corpus scan split across threads should
+        give exactly the same labels as the single-threaded scan
+        """
+        expected = self._create_dbscan(self.sample_data_double, "nonsparse",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        labels = self._create_dbscan(self.sample_data_double, "nonsparse",
+            "euclidean", threads=4).run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        assert_equal(list(labels), list(expected))
+
+    def test_sparse_threads(self):
+        """ 
+        Sparse array with the corpus scan split across threads should give
+        exactly the same labels as the single-threaded scan
+        """
+        expected = self._create_dbscan(self.sample_data_double, "sparse",
+            "cosine").run(self.COSINE_EPS, self.MIN_PTS)
+        labels = self._create_dbscan(self.sample_data_double, "sparse",
+            "cosine", threads=4).run(self.COSINE_EPS, self.MIN_PTS)
+        assert_equal(list(labels), list(expected))
+
+
+    def test_parallel_engine(self):
+        """ 
+        The parallel engine should give exactly the same labels, including
+        cluster numbering, as the sequential one
+        """
+        expected = self._create_dbscan(self.sample_data_double, "nonsparse",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        labels = self._create_dbscan(self.sample_data_double, "nonsparse",
+            "euclidean", engine="parallel", threads=4).run(
+                self.EUCLIDEAN_EPS, self.MIN_PTS)
+        assert_equal(list(labels), list(expected))
+
+    def test_sampled_engine_full_sample(self):
+        """
+        The sampled engine, sampling every vector, finds the same core
+        vectors as the exact engines, so should find the same clusters and
+        noise; border vectors may go to a different cluster
+        """
+        expected = self._create_dbscan(self.sample_data_double, "nonsparse",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        for sampling in ("uniform", "kcenter"):
+            labels = self._create_dbscan(self.sample_data_double, "nonsparse",
+                "euclidean", engine="sampled", sample_fraction=1,
+                sampling=sampling).run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+            assert_equal(self._num_clusters(labels),
+                self._num_clusters(expected))
+            assert_equal([l == -1 for l in labels],
+                [l == -1 for l in expected])
+
+    def test_sampled_engine_repeatable(self):
+        """
+        The sampled engine should give the same labels for the same seed,
+        however many threads it runs on
+        """
+        expected = self._create_dbscan(self.sample_data_double, "grid",
+            "euclidean", engine="sampled", sample_count=300, seed=3).run(
+                self.EUCLIDEAN_EPS, self.MIN_PTS)
+        labels = self._create_dbscan(self.sample_data_double, "grid",
+            "euclidean", engine="sampled", sample_count=300, seed=3,
+            threads=4).run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        assert_equal(list(labels), list(expected))
+
+
+    def test_sparse_euclidean_with_zeros(self):
+        """
+        Sparse array with actual zeros in it, including rows which are all
+        zeros, Euclidean distance metric, should give the same labels as the
+        non-sparse array
+        """
+        data = self.sample_data_double.copy()
+        data[::3, 0] = 0
+        data[1::5, 1] = 0
+        data[7::50] = 0
+        expected = self._create_dbscan(data, "nonsparse",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        labels = self._create_dbscan(data, "sparse",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        assert_equal(list(labels), list(expected))
+
+
 class TestPyDbScan(DbScanBase):
     """ 
     Integration tests for the python bindings
     """
-    def _create_dbscan(self, sample_data, *args):
-        return dbscan.dbscan(sample_data, *args)
+    def _create_dbscan(self, sample_data, *args, **kwargs):
+        return dbscan.dbscan(sample_data, *args, **kwargs)
+
+    def test_run_masks(self):
+        """
+        run() with masks should give the same labels as without, a noise
+        flag on every unclustered vector, and core flags on vectors with
+        at least min_pts neighbours
+        """
+        data = self.sample_data_double
+        scanner = self._create_dbscan(data, "nonsparse", "euclidean")
+        expected = scanner.run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        labels, noise, core = scanner.run(self.EUCLIDEAN_EPS, self.MIN_PTS,
+            masks=True)
+        assert isinstance(labels, np.ndarray)
+        assert_equal(list(labels), list(expected))
+        assert_equal(noise.dtype, np.bool_)
+        assert noise[labels == -1].all()
+
+        distances = ((data[:, np.newaxis, :] - data[np.newaxis, :, :]) ** 2).sum(2)
+        # run() takes eps as a single precision float
+        eps = float(np.float32(self.EUCLIDEAN_EPS))
+        num_neighbours = (distances <= eps ** 2).sum(1) - 1
+        assert_equal(list(core), list(num_neighbours >= self.MIN_PTS))
+        assert (labels[core] != -1).all()
+
+    def test_run_stats(self):
+        """
+        run() with stats should add a dict of counts and timings: a full scan
+        compares every pair, an index compares fewer, and both engines query
+        and visit every vector once
+        """
+        data = self.sample_data_double
+        rows = len(data)
+        scanner = self._create_dbscan(data, "nonsparse", "euclidean")
+        expected = scanner.run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        labels, stats = scanner.run(self.EUCLIDEAN_EPS, self.MIN_PTS,
+            stats=True)
+        assert_equal(list(labels), list(expected))
+        assert_equal(stats["region_queries"], rows)
+        assert_equal(stats["points_visited"], rows)
+        assert_equal(stats["distance_evaluations"], rows * (rows - 1))
+        assert stats["expand_waves"] > 0
+        assert stats["total_seconds"] >= stats["query_seconds"] >= 0
+
+        labels, noise, core, stats = self._create_dbscan(data, "kdtree",
+            "euclidean", engine="parallel").run(self.EUCLIDEAN_EPS,
+            self.MIN_PTS, masks=True, stats=True)
+        assert_equal(list(labels), list(expected))
+        assert_equal(stats["region_queries"], rows)
+        assert 0 < stats["distance_evaluations"] < rows * (rows - 1)
+        assert_equal(stats["points_visited"], rows)
+        assert_equal(stats["expand_waves"], 0)
+
+        # the sampled engine queries only its sample, but visits the
+        # vectors the sample's core vectors reach too
+        labels, stats = self._create_dbscan(data, "nonsparse", "euclidean",
+            engine="sampled", sample_count=300).run(self.EUCLIDEAN_EPS,
+                self.MIN_PTS, stats=True)
+        assert_equal(stats["region_queries"], 300)
+        assert 300 < stats["points_visited"] <= rows
+
+    def test_strided_corpus(self):
+        """
+        Fortran-order and sliced arrays should be repacked, once, and give
+        the same labels as C-order copies; C-order arrays and memoryviews
+        of them should be used in place
+        """
+        data = self.sample_data_double
+        expected = list(self._create_dbscan(data, "nonsparse",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS))
+        wide = np.hstack([data, data])
+
+        repacks = dbscan.repack_count()
+        for corpus in [np.asfortranarray(data), wide[:, ::2], wide[:, 2:]]:
+            scanner = self._create_dbscan(corpus, "nonsparse", "euclidean")
+            assert scanner.repacked
+            assert_equal(list(scanner.run(self.EUCLIDEAN_EPS, self.MIN_PTS)),
+                expected)
+        assert_equal(dbscan.repack_count(), repacks + 3)
+
+        for corpus in [data, memoryview(data)]:
+            scanner = self._create_dbscan(corpus, "nonsparse", "euclidean")
+            assert not scanner.repacked
+            assert_equal(list(scanner.run(self.EUCLIDEAN_EPS, self.MIN_PTS)),
+                expected)
+        assert_equal(dbscan.repack_count(), repacks + 3)
+
+    def test_run_many(self):
+        """
+        run_many should give each corpus the labels running it on its own
+        does, whatever the number of threads
+        """
+        data = self.sample_data_double
+        corpora = [np.ascontiguousarray(data[k::5]) for k in range(5)]
+        corpora.append(self.sample_data_single)
+        expected = [list(self._create_dbscan(corpus, "nonsparse",
+            "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS))
+            for corpus in corpora]
+        for threads in [1, 3, 0]:
+            results = dbscan.run_many(corpora, self.EUCLIDEAN_EPS,
+                self.MIN_PTS, threads=threads)
+            assert_equal([list(labels) for labels in results], expected)
+
+    def test_grid_bad_eps(self):
+        """
+        grid can't make cells for eps <= 0, which should be a ValueError
+        from run and run_many rather than a crash
+        """
+        scanner = self._create_dbscan(self.sample_data_double, "grid",
+            "euclidean")
+        assert_raises(ValueError, scanner.run, 0, self.MIN_PTS)
+        assert_raises(ValueError, dbscan.run_many, [self.sample_data_double],
+            0, self.MIN_PTS, type="grid")
+
+    def test_sweep(self):
+        """
+        A sweep over several eps values should give exactly the labels that
+        running with each of them does
+        """
+        eps_values = [0.1, 0.3, 0.2, 0.5]
+        scanner = self._create_dbscan(self.sample_data_double, "nonsparse",
+            "euclidean")
+        sweep = scanner.sweep(eps_values, self.MIN_PTS)
+        assert_equal(len(sweep), len(eps_values))
+        for eps, labels in zip(eps_values, sweep):
+            assert_equal(list(labels), list(scanner.run(eps, self.MIN_PTS)))
+
+    def test_optics_extract(self):
+        """
+        Labels extracted from an OPTICS ordering should have the same
+        clusters and noise as running with the same eps
+        """
+        scanner = self._create_dbscan(self.sample_data_double, "nonsparse",
+            "euclidean")
+        order, reachability = scanner.optics(0.5, self.MIN_PTS)
+        assert_equal(sorted(order), list(range(len(self.sample_data_double))))
+        assert_equal(len(reachability), len(order))
+        for eps in [0.2, 0.3]:
+            expected = scanner.run(eps, self.MIN_PTS)
+            labels = scanner.extract(eps)
+            assert_equal(self._num_clusters(labels),
+                self._num_clusters(expected))
+            assert_equal([l == -1 for l in labels],
+                [l == -1 for l in expected])
+
+    def test_incremental(self):
+        """
+        Inserting and removing vectors incrementally should give the same
+        labels as running from scratch on the vectors that are left
+        """
+        data = self.sample_data_double
+        incremental = dbscan.incremental(data.shape[1], self.EUCLIDEAN_EPS,
+            self.MIN_PTS)
+        ids = incremental.insert(data[:400])
+        ids += incremental.insert(data[400:])
+        removed = set(ids[::7])
+        incremental.remove(sorted(removed))
+
+        live_ids, labels = incremental.labels()
+        assert_equal(live_ids, [i for i in ids if i not in removed])
+        expected = self._create_dbscan(np.ascontiguousarray(data[live_ids]),
+            "nonsparse", "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        assert_equal(list(labels), list(expected))
+
+    def test_incremental_bad_arguments(self):
+        """
+        eps and min_pts must be positive
+        """
+        assert_raises(ValueError, dbscan.incremental, 2, 0, self.MIN_PTS)
+        assert_raises(ValueError, dbscan.incremental, 2, -1, self.MIN_PTS)
+        assert_raises(ValueError, dbscan.incremental, 2, self.EUCLIDEAN_EPS,
+            0)
 
 
 class TestCLIDbScan(DbScanBase):
@@ -128,13 +514,15 @@ class TestCLIDbScan(DbScanBase):
     """
 
     class CLIDbScan(object):
-        def __init__(self, data, *args):
+        def __init__(self, data, *args, **kwargs):
             inp = tempfile.NamedTemporaryFile(delete=False)
             for row in data:
                 print(",".join(str(s) for s in row), file=inp)
             inp.close()
             self.inp_name = inp.name
             self.args = list(args)
+            self.options = ["--%s=%s" % (k.replace("_", "-"), v)
+                for k, v in kwargs.items()]
             if data.dtype == np.float32:
                 self.precision = "single"
             else:
@@ -142,7 +530,8 @@ class TestCLIDbScan(DbScanBase):
 
         def run(self, eps, min_pts):
             args = [self.dbscan_path(), str(eps), 
-                str(min_pts)] + self.args + [self.precision, self.inp_name]
+                str(min_pts)] + self.args + [self.precision, self.inp_name] + \
+                self.options
             output = subprocess.check_output(args)
             print(args)
             result = []
@@ -154,5 +543,78 @@ class TestCLIDbScan(DbScanBase):
         def dbscan_path(self):
             return os.path.join(os.path.dirname(__file__), "..", "dbscan")
                         
-    def _create_dbscan(self, data, *args):
-        return self.CLIDbScan(data, *args)
+    def _create_dbscan(self, data, *args, **kwargs):
+        return self.CLIDbScan(data, *args, **kwargs)
+
+    def test_binary_corpus(self):
+        """
+        Converting the CSV to a binary corpus file should give the same
+        labels as reading the CSV
+        """
+        scanner = self._create_dbscan(self.sample_data_double, "nonsparse",
+            "euclidean")
+        expected = scanner.run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+
+        binary_name = scanner.inp_name + ".bin"
+        subprocess.check_call([scanner.dbscan_path(), "convert", "double",
+            scanner.inp_name, binary_name])
+        scanner.inp_name = binary_name
+        labels = scanner.run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+        os.remove(binary_name)
+        assert_equal(labels, expected)
+
+    def test_partitions(self):
+        """
+        Splitting the corpus across worker processes should give the same
+        labels as clustering it in one, streaming it from a CSV or a binary
+        corpus file
+        """
+        for array_type in ("nonsparse", "grid"):
+            expected = self._create_dbscan(self.sample_data_double,
+                array_type, "euclidean").run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+            scanner = self._create_dbscan(self.sample_data_double, array_type,
+                "euclidean", partitions=3)
+            labels = scanner.run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+            assert_equal(labels, expected)
+
+            binary_name = scanner.inp_name + ".bin"
+            subprocess.check_call([scanner.dbscan_path(), "convert", "double",
+                scanner.inp_name, binary_name])
+            scanner.inp_name = binary_name
+            labels = scanner.run(self.EUCLIDEAN_EPS, self.MIN_PTS)
+            os.remove(binary_name)
+            assert_equal(labels, expected)
+
+    def test_kernels_agree(self):
+        """
+        Forcing the scalar distance kernel should give the same labels as
+        the SIMD kernel picked for this CPU
+        """
+        for data in (self.sample_data_single, self.sample_data_double):
+            for metric, eps in (("euclidean", self.EUCLIDEAN_EPS),
+                    ("cosine", self.COSINE_EPS)):
+                expected = self._create_dbscan(data, "nonsparse",
+                    metric).run(eps, self.MIN_PTS)
+                labels = self._create_dbscan(data, "nonsparse", metric,
+                    kernel="scalar").run(eps, self.MIN_PTS)
+                assert_equal(labels, expected)
+
+    def test_ragged_csv(self):
+        """
+        A CSV line with the wrong number of values should be reported by
+        line number, with a nonzero exit status
+        """
+        scanner = self._create_dbscan(self.sample_data_double, "nonsparse",
+            "euclidean")
+        with open(scanner.inp_name, "a") as inp:
+            print("1.0,2.0,3.0,4.0,5.0,6.0,7.0", file=inp)
+        args = [scanner.dbscan_path(), str(self.EUCLIDEAN_EPS),
+            str(self.MIN_PTS), "nonsparse", "euclidean", "double",
+            scanner.inp_name]
+        process = subprocess.Popen(args, stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE)
+        _, error = process.communicate()
+        os.remove(scanner.inp_name)
+        assert_equal(process.returncode, 3)
+        line = len(self.sample_data_double) + 1
+        assert "line %d has 7 values" % line in error
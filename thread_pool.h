@@ -0,0 +1,162 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace libdbscan {
+
+class thread_pool {
+    // A persistent pool of worker threads for splitting loops over the
+    // corpus. The threads are created once and then sleep between calls to
+    // parallel_for, so it's cheap enough to use for every region query on a
+    // big corpus (but not a tiny one - waking the workers costs a few
+    // microseconds).
+public:
+    // Called with the thread's number (0 to num_threads() - 1) and the
+    // [begin, end) range of the loop it should handle
+    typedef std::function<void (long thread_i, long begin, long end)> task_t;
+
+    explicit thread_pool(long num_threads);
+    ~thread_pool();
+
+    long num_threads() const { return _workers.size() + 1; }
+
+    // Splits [0, n) into num_threads() contiguous, ascending chunks and runs
+    // task on each, in parallel, returning once they've all finished. The
+    // calling thread handles chunk 0. If any of the tasks throw, one of the
+    // exceptions is rethrown here.
+    //
+    // Calls made from inside another parallel_for task, which would
+    // otherwise deadlock waiting on busy workers, just run task(0, 0, n) on
+    // the calling thread.
+    void parallel_for(long n, const task_t& task);
+
+    // Whether the calling thread is currently running a parallel_for task,
+    // of any pool
+    static bool in_task() { return in_task_flag(); }
+
+private:
+    static bool& in_task_flag() {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    void worker(long thread_i);
+    void run_chunk(long thread_i);
+
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _start;
+    std::condition_variable _done;
+
+    // State of the current parallel_for call, guarded by _mutex
+    const task_t* _task;
+    long _n;
+    unsigned long _generation;
+    long _pending;
+    bool _stopping;
+    std::exception_ptr _error;
+};
+
+inline thread_pool::thread_pool(long num_threads) :
+    _task(nullptr),
+    _n(0),
+    _generation(0),
+    _pending(0),
+    _stopping(false)
+{
+    for (long i=1; i < num_threads; i++) {
+        _workers.emplace_back(&thread_pool::worker, this, i);
+    }
+}
+
+inline thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _start.notify_all();
+    for (auto& t : _workers) {
+        t.join();
+    }
+}
+
+inline void thread_pool::run_chunk(long thread_i)
+{
+    long threads = num_threads();
+    long begin = _n * thread_i / threads;
+    long end = _n * (thread_i + 1) / threads;
+    in_task_flag() = true;
+    try {
+        (*_task)(thread_i, begin, end);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _error = std::current_exception();
+    }
+    in_task_flag() = false;
+}
+
+inline void thread_pool::parallel_for(long n, const task_t& task)
+{
+    if (_workers.empty() || in_task()) {
+        task(0, 0, n);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _task = &task;
+        _n = n;
+        _pending = _workers.size();
+        _error = nullptr;
+        _generation++;
+    }
+    _start.notify_all();
+
+    run_chunk(0);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [this] { return _pending == 0; });
+    _task = nullptr;
+    if (_error) {
+        std::rethrow_exception(_error);
+    }
+}
+
+inline void thread_pool::worker(long thread_i)
+{
+    unsigned long seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _start.wait(lock, [&] {
+                return _stopping || _generation != seen_generation;
+            });
+            if (_stopping) {
+                return;
+            }
+            seen_generation = _generation;
+        }
+
+        run_chunk(thread_i);
+
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            last = --_pending == 0;
+        }
+        if (last) {
+            _done.notify_one();
+        }
+    }
+}
+
+}
+
+#endif
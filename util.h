@@ -9,6 +9,21 @@
 #include <emmintrin.h>
 #endif
 
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// The AVX2 and AVX-512 kernels are compiled with per-function target
+// attributes and picked at load time by checking the CPU, so that a build
+// without -march=native (e.g. a wheel) still uses the widest vectors the host
+// has, and never executes ones it doesn't.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define LIBDBSCAN_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
 namespace libdbscan {
 
 template <typename TNum>
@@ -22,17 +37,19 @@ TNum euclidean_distance_nosse(size_t n, const TNum* x, const TNum* y){
 }
 
 template <typename TNum>
-TNum euclidean_distance(size_t dim, const TNum* const x, const TNum* const y)
-{
-    return euclidean_distance_nosse<TNum>(dim, x, y);
+TNum dot_product_nosse(size_t n, const TNum* x, const TNum* y){
+    TNum result = 0.f;
+    for (size_t i = 0; i < n; ++i) {
+        result += x[i] * y[i];
+    }
+    return result;
 }
 
 #ifdef __SSE__
 
-template <>
-float euclidean_distance<float>(size_t n, const float* x, const float* y)
+inline float euclidean_distance_sse(size_t n, const float* x, const float* y)
 {
-    // Specialization to do euclidean distance using single precision SSE1 SIMD
+    // Squared euclidean distance using single precision SSE1 SIMD
     // instructions.
     //
     // Note that the vectors must be of length > 3 for this to actually execute
@@ -77,14 +94,37 @@ float euclidean_distance<float>(size_t n, const float* x, const float* y)
     return distance;
 }
 
+inline float dot_product_sse(size_t n, const float* x, const float* y)
+{
+    // Dot product using single precision SSE1 SIMD instructions, as for
+    // euclidean_distance_sse
+    __m128 sum = _mm_setzero_ps();
+    for (; n > 3; n -= 4) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(x), _mm_loadu_ps(y)));
+        x += 4;
+        y += 4;
+    }
+
+    const __m128 sum1 = _mm_add_ps(sum,
+        _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1,0,3,2)));
+    const __m128 sum2 = _mm_add_ps(sum1,
+        _mm_shuffle_ps(sum1, sum1, _MM_SHUFFLE(2,3,0,1)));
+    float dot;
+    _mm_store_ss(&dot, sum2);
+
+    if (n > 0) {
+        dot += dot_product_nosse(n, x, y);
+    }
+    return dot;
+}
+
 #endif
 
 #ifdef __SSE2__
 
-template <>
-double euclidean_distance<double>(size_t n, const double* x, const double* y) 
+inline double euclidean_distance_sse(size_t n, const double* x, const double* y) 
 {
-    // Specialization to do euclidean distance using double precision SSE2 SIMD
+    // Squared euclidean distance using double precision SSE2 SIMD
     // instructions.
     //
     // Note that the vectors must be of length > 1 for this to actually execute
@@ -116,8 +156,620 @@ double euclidean_distance<double>(size_t n, const double* x, const double* y)
     return distance;
 }
 
+inline double dot_product_sse(size_t n, const double* x, const double* y)
+{
+    // Dot product using double precision SSE2 SIMD instructions
+    __m128d sum = _mm_setzero_pd();
+    for (; n > 1; n -= 2) {
+        sum = _mm_add_pd(sum, _mm_mul_pd(_mm_loadu_pd(x), _mm_loadu_pd(y)));
+        x += 2;
+        y += 2;
+    }
+
+    const __m128d sum1 = _mm_add_pd(sum,
+        _mm_shuffle_pd(sum, sum, _MM_SHUFFLE2(0, 1)));
+    double dot;
+    _mm_store_sd(&dot, sum1);
+
+    if (n > 0) {
+        dot += dot_product_nosse(n, x, y);
+    }
+    return dot;
+}
+
+#endif
+
+#ifdef LIBDBSCAN_X86_DISPATCH
+
+__attribute__((target("avx")))
+inline float horizontal_sum_avx(__m256 sum)
+{
+    // fold the two 128 bit halves together, then as for SSE
+    __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(sum),
+        _mm256_extractf128_ps(sum, 1));
+    sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+    sum4 = _mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, _MM_SHUFFLE(1,1,1,1)));
+    return _mm_cvtss_f32(sum4);
+}
+
+__attribute__((target("avx")))
+inline double horizontal_sum_avx(__m256d sum)
+{
+    __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum),
+        _mm256_extractf128_pd(sum, 1));
+    sum2 = _mm_add_sd(sum2, _mm_unpackhi_pd(sum2, sum2));
+    return _mm_cvtsd_f64(sum2);
+}
+
+// The AVX-512 sums fold their 256 bit halves together and go on as for
+// AVX. gcc's _mm512_reduce_add_*, and its plain extracts and casts down to
+// 256 bits, start from undefined registers and so aren't -Wall clean, so
+// the halves are taken with masked extracts of all four doubles (floats'
+// as pairs of them) over zeros.
+__attribute__((target("avx512f")))
+inline __m256d half_avx512(__m512d sum, int upper)
+{
+    return upper ?
+        _mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xF, sum, 1) :
+        _mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xF, sum, 0);
+}
+
+__attribute__((target("avx512f")))
+inline float horizontal_sum_avx512(__m512 sum)
+{
+    const __m512d halves = _mm512_castps_pd(sum);
+    return horizontal_sum_avx(_mm256_add_ps(
+        _mm256_castpd_ps(half_avx512(halves, 0)),
+        _mm256_castpd_ps(half_avx512(halves, 1))));
+}
+
+__attribute__((target("avx512f")))
+inline double horizontal_sum_avx512(__m512d sum)
+{
+    return horizontal_sum_avx(_mm256_add_pd(half_avx512(sum, 0),
+        half_avx512(sum, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+inline float euclidean_distance_avx2(size_t n, const float* x, const float* y)
+{
+    // As euclidean_distance_sse, but eight single precision elements at a
+    // time, with the multiply and add fused
+    __m256 sum = _mm256_setzero_ps();
+    for (; n > 7; n -= 8) {
+        const __m256 delta = _mm256_sub_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y));
+        sum = _mm256_fmadd_ps(delta, delta, sum);
+        x += 8;
+        y += 8;
+    }
+
+    float distance = horizontal_sum_avx(sum);
+
+    if (n > 0) {
+        distance += euclidean_distance_nosse(n, x, y);
+    }
+    return distance;
+}
+
+__attribute__((target("avx2,fma")))
+inline double euclidean_distance_avx2(size_t n, const double* x, const double* y)
+{
+    // four double precision elements at a time
+    __m256d sum = _mm256_setzero_pd();
+    for (; n > 3; n -= 4) {
+        const __m256d delta = _mm256_sub_pd(_mm256_loadu_pd(x), _mm256_loadu_pd(y));
+        sum = _mm256_fmadd_pd(delta, delta, sum);
+        x += 4;
+        y += 4;
+    }
+
+    double distance = horizontal_sum_avx(sum);
+
+    if (n > 0) {
+        distance += euclidean_distance_nosse(n, x, y);
+    }
+    return distance;
+}
+
+__attribute__((target("avx512f")))
+inline float euclidean_distance_avx512(size_t n, const float* x, const float* y)
+{
+    // sixteen single precision elements at a time; the leftovers are done
+    // with a masked load rather than falling back to scalar code
+    __m512 sum = _mm512_setzero_ps();
+    for (; n > 15; n -= 16) {
+        const __m512 delta = _mm512_sub_ps(_mm512_loadu_ps(x), _mm512_loadu_ps(y));
+        sum = _mm512_fmadd_ps(delta, delta, sum);
+        x += 16;
+        y += 16;
+    }
+    if (n > 0) {
+        const __mmask16 mask = (__mmask16)((1u << n) - 1);
+        const __m512 delta = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x),
+            _mm512_maskz_loadu_ps(mask, y));
+        sum = _mm512_fmadd_ps(delta, delta, sum);
+    }
+    return horizontal_sum_avx512(sum);
+}
+
+__attribute__((target("avx512f")))
+inline double euclidean_distance_avx512(size_t n, const double* x, const double* y)
+{
+    // eight double precision elements at a time
+    __m512d sum = _mm512_setzero_pd();
+    for (; n > 7; n -= 8) {
+        const __m512d delta = _mm512_sub_pd(_mm512_loadu_pd(x), _mm512_loadu_pd(y));
+        sum = _mm512_fmadd_pd(delta, delta, sum);
+        x += 8;
+        y += 8;
+    }
+    if (n > 0) {
+        const __mmask8 mask = (__mmask8)((1u << n) - 1);
+        const __m512d delta = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, x),
+            _mm512_maskz_loadu_pd(mask, y));
+        sum = _mm512_fmadd_pd(delta, delta, sum);
+    }
+    return horizontal_sum_avx512(sum);
+}
+
+__attribute__((target("avx2,fma")))
+inline float dot_product_avx2(size_t n, const float* x, const float* y)
+{
+    // As euclidean_distance_avx2, but multiplying rather than subtracting
+    __m256 sum = _mm256_setzero_ps();
+    for (; n > 7; n -= 8) {
+        sum = _mm256_fmadd_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y), sum);
+        x += 8;
+        y += 8;
+    }
+
+    float dot = horizontal_sum_avx(sum);
+
+    if (n > 0) {
+        dot += dot_product_nosse(n, x, y);
+    }
+    return dot;
+}
+
+__attribute__((target("avx2,fma")))
+inline double dot_product_avx2(size_t n, const double* x, const double* y)
+{
+    __m256d sum = _mm256_setzero_pd();
+    for (; n > 3; n -= 4) {
+        sum = _mm256_fmadd_pd(_mm256_loadu_pd(x), _mm256_loadu_pd(y), sum);
+        x += 4;
+        y += 4;
+    }
+
+    double dot = horizontal_sum_avx(sum);
+
+    if (n > 0) {
+        dot += dot_product_nosse(n, x, y);
+    }
+    return dot;
+}
+
+__attribute__((target("avx512f")))
+inline float dot_product_avx512(size_t n, const float* x, const float* y)
+{
+    __m512 sum = _mm512_setzero_ps();
+    for (; n > 15; n -= 16) {
+        sum = _mm512_fmadd_ps(_mm512_loadu_ps(x), _mm512_loadu_ps(y), sum);
+        x += 16;
+        y += 16;
+    }
+    if (n > 0) {
+        const __mmask16 mask = (__mmask16)((1u << n) - 1);
+        sum = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x),
+            _mm512_maskz_loadu_ps(mask, y), sum);
+    }
+    return horizontal_sum_avx512(sum);
+}
+
+__attribute__((target("avx512f")))
+inline double dot_product_avx512(size_t n, const double* x, const double* y)
+{
+    __m512d sum = _mm512_setzero_pd();
+    for (; n > 7; n -= 8) {
+        sum = _mm512_fmadd_pd(_mm512_loadu_pd(x), _mm512_loadu_pd(y), sum);
+        x += 8;
+        y += 8;
+    }
+    if (n > 0) {
+        const __mmask8 mask = (__mmask8)((1u << n) - 1);
+        sum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, x),
+            _mm512_maskz_loadu_pd(mask, y), sum);
+    }
+    return horizontal_sum_avx512(sum);
+}
+
+#endif
+
+// The distance kernels, narrowest first
+enum distance_kernel {
+    scalar_kernel,
+    sse_kernel,
+    avx2_kernel,
+    avx512_kernel
+};
+
+inline const char* distance_kernel_name(distance_kernel kernel)
+{
+    switch (kernel) {
+    case sse_kernel: return "sse";
+    case avx2_kernel: return "avx2";
+    case avx512_kernel: return "avx512";
+    default: return "scalar";
+    }
+}
+
+inline bool distance_kernel_supported(distance_kernel kernel)
+{
+    switch (kernel) {
+    case scalar_kernel:
+        return true;
+    case sse_kernel:
+#if defined(__SSE__) && defined(__SSE2__)
+        return true;
+#else
+        return false;
+#endif
+#ifdef LIBDBSCAN_X86_DISPATCH
+    case avx2_kernel:
+        // (f16c for the fp16 quantized kernel; every AVX2 CPU has it)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+    case avx512_kernel:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+        return false;
+    }
+}
+
+inline distance_kernel detect_distance_kernel()
+{
+    // The widest kernel the CPU supports, unless the DBSCAN_KERNEL
+    // environment variable names a (supported) one to use instead
+    const char* forced = std::getenv("DBSCAN_KERNEL");
+    for (int k=avx512_kernel; k >= scalar_kernel; k--) {
+        distance_kernel kernel = static_cast<distance_kernel>(k);
+        if (forced && strcmp(forced, distance_kernel_name(kernel)) == 0 &&
+                distance_kernel_supported(kernel)) {
+            return kernel;
+        }
+    }
+    for (int k=avx512_kernel; k > scalar_kernel; k--) {
+        distance_kernel kernel = static_cast<distance_kernel>(k);
+        if (distance_kernel_supported(kernel)) {
+            return kernel;
+        }
+    }
+    return scalar_kernel;
+}
+
+template <typename T = void>
+struct distance_kernel_state {
+    // Holder for the active kernel; a static member of a class template so
+    // it can be defined in this header, and initialized (by checking the
+    // CPU) when the program or extension is loaded.
+    static distance_kernel active;
+};
+
+template <typename T>
+distance_kernel distance_kernel_state<T>::active = detect_distance_kernel();
+
+inline distance_kernel get_distance_kernel()
+{
+    return distance_kernel_state<>::active;
+}
+
+inline bool set_distance_kernel(const std::string& name)
+{
+    // Forces a particular kernel by name ("scalar", "sse", "avx2" or
+    // "avx512"), for benchmarking them against each other. Returns false,
+    // leaving the kernel as it was, if the name is unknown or the CPU
+    // doesn't support it. Not safe to call while a run is in progress.
+    for (int k=scalar_kernel; k <= avx512_kernel; k++) {
+        distance_kernel kernel = static_cast<distance_kernel>(k);
+        if (name == distance_kernel_name(kernel)) {
+            if (!distance_kernel_supported(kernel)) {
+                return false;
+            }
+            distance_kernel_state<>::active = kernel;
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename TNum>
+TNum euclidean_distance(size_t dim, const TNum* const x, const TNum* const y)
+{
+    // Squared euclidean distance between x and y, using the active kernel
+    // for float and double
+    return euclidean_distance_nosse<TNum>(dim, x, y);
+}
+
+template <>
+inline float euclidean_distance<float>(size_t n, const float* x, const float* y)
+{
+    switch (distance_kernel_state<>::active) {
+#ifdef LIBDBSCAN_X86_DISPATCH
+    case avx512_kernel: return euclidean_distance_avx512(n, x, y);
+    case avx2_kernel: return euclidean_distance_avx2(n, x, y);
+#endif
+#ifdef __SSE__
+    case sse_kernel: return euclidean_distance_sse(n, x, y);
+#endif
+    default: return euclidean_distance_nosse(n, x, y);
+    }
+}
+
+template <>
+inline double euclidean_distance<double>(size_t n, const double* x, const double* y)
+{
+    switch (distance_kernel_state<>::active) {
+#ifdef LIBDBSCAN_X86_DISPATCH
+    case avx512_kernel: return euclidean_distance_avx512(n, x, y);
+    case avx2_kernel: return euclidean_distance_avx2(n, x, y);
+#endif
+#ifdef __SSE2__
+    case sse_kernel: return euclidean_distance_sse(n, x, y);
+#endif
+    default: return euclidean_distance_nosse(n, x, y);
+    }
+}
+
+template <typename TNum>
+TNum dot_product(size_t dim, const TNum* const x, const TNum* const y)
+{
+    // Dot product of x and y, using the active kernel for float and double
+    return dot_product_nosse<TNum>(dim, x, y);
+}
+
+template <>
+inline float dot_product<float>(size_t n, const float* x, const float* y)
+{
+    switch (distance_kernel_state<>::active) {
+#ifdef LIBDBSCAN_X86_DISPATCH
+    case avx512_kernel: return dot_product_avx512(n, x, y);
+    case avx2_kernel: return dot_product_avx2(n, x, y);
+#endif
+#ifdef __SSE__
+    case sse_kernel: return dot_product_sse(n, x, y);
+#endif
+    default: return dot_product_nosse(n, x, y);
+    }
+}
+
+template <>
+inline double dot_product<double>(size_t n, const double* x, const double* y)
+{
+    switch (distance_kernel_state<>::active) {
+#ifdef LIBDBSCAN_X86_DISPATCH
+    case avx512_kernel: return dot_product_avx512(n, x, y);
+    case avx2_kernel: return dot_product_avx2(n, x, y);
+#endif
+#ifdef __SSE2__
+    case sse_kernel: return dot_product_sse(n, x, y);
+#endif
+    default: return dot_product_nosse(n, x, y);
+    }
+}
+
+// Element types for a quantized copy of a corpus, see dbscan_quantized
+enum quantization_type {
+    int8_quantization,
+    fp16_quantization,
+    bf16_quantization
+};
+
+inline uint16_t float_to_half(float value)
+{
+    // IEEE half precision, rounding to nearest even; too big for half
+    // becomes infinity
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const uint32_t magnitude = bits & 0x7fffffff;
+    if (magnitude > 0x7f800000) {
+        return sign | 0x7e00;
+    }
+    if (magnitude >= 0x477ff000) {
+        return sign | 0x7c00;
+    }
+    if (magnitude < 0x38800000) {
+        // subnormal in half, in units of 2^-24, which is exact to scale by
+        float scaled;
+        std::memcpy(&scaled, &magnitude, sizeof(scaled));
+        return sign | static_cast<uint16_t>(
+            std::nearbyint(scaled * 16777216.0f));
+    }
+    // rebias the exponent, and round away the low 13 bits of the mantissa,
+    // carrying into the exponent if need be
+    const uint32_t rounded = magnitude + 0xfff + ((magnitude >> 13) & 1);
+    return sign | ((rounded - 0x38000000) >> 13);
+}
+
+inline float half_to_float(uint16_t half)
+{
+    const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    const uint32_t exponent = (half >> 10) & 0x1f;
+    const uint32_t mantissa = half & 0x3ff;
+    if (exponent == 0) {
+        const float value = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -value : value;
+    }
+    const uint32_t bits = sign | (mantissa << 13) | (exponent == 31 ?
+        0x7f800000 : (exponent + 112) << 23);
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline uint16_t float_to_bfloat(float value)
+{
+    // The top half of a float, rounding to nearest even
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return (bits >> 16) | 0x40;
+    }
+    return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+}
+
+inline float bfloat_to_float(uint16_t bfloat)
+{
+    const uint32_t bits = static_cast<uint32_t>(bfloat) << 16;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Squared euclidean distance between two quantized vectors, x and y being n
+// codes each, whose elements' differences are scaled by scales first. The
+// codes are passed untyped so that each quantization's kernels can be
+// picked through one function pointer type.
+typedef float (*quantized_distance_fn)(size_t n, const void* x,
+    const void* y, const float* scales);
+
+template <typename TCode, float (*decode)(TCode)>
+float quantized_distance_nosse(size_t n, const void* x_codes,
+        const void* y_codes, const float* scales)
+{
+    const TCode* x = static_cast<const TCode*>(x_codes);
+    const TCode* y = static_cast<const TCode*>(y_codes);
+    float result = 0.f;
+    for (size_t i = 0; i < n; ++i) {
+        const float num = (decode(x[i]) - decode(y[i])) * scales[i];
+        result += num * num;
+    }
+    return result;
+}
+
+inline float int8_to_float(int8_t code)
+{
+    return code;
+}
+
+#ifdef LIBDBSCAN_X86_DISPATCH
+
+__attribute__((target("avx2,fma")))
+inline float quantized_distance_int8_avx2(size_t n, const void* x_codes,
+        const void* y_codes, const float* scales)
+{
+    // Eight codes at a time, widened to 32 bits; their difference is exact
+    // in integers before it's converted and scaled
+    const int8_t* x = static_cast<const int8_t*>(x_codes);
+    const int8_t* y = static_cast<const int8_t*>(y_codes);
+    __m256 sum = _mm256_setzero_ps();
+    for (; n > 7; n -= 8) {
+        const __m256i _x = _mm256_cvtepi8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(x)));
+        const __m256i _y = _mm256_cvtepi8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(y)));
+        const __m256 delta = _mm256_mul_ps(
+            _mm256_cvtepi32_ps(_mm256_sub_epi32(_x, _y)),
+            _mm256_loadu_ps(scales));
+        sum = _mm256_fmadd_ps(delta, delta, sum);
+        x += 8;
+        y += 8;
+        scales += 8;
+    }
+    float distance = horizontal_sum_avx(sum);
+    if (n > 0) {
+        distance += quantized_distance_nosse<int8_t, int8_to_float>(n, x, y,
+            scales);
+    }
+    return distance;
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline float quantized_distance_fp16_avx2(size_t n, const void* x_codes,
+        const void* y_codes, const float* scales)
+{
+    // Eight halves at a time, converted with F16C
+    const uint16_t* x = static_cast<const uint16_t*>(x_codes);
+    const uint16_t* y = static_cast<const uint16_t*>(y_codes);
+    __m256 sum = _mm256_setzero_ps();
+    for (; n > 7; n -= 8) {
+        const __m256 _x = _mm256_cvtph_ps(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(x)));
+        const __m256 _y = _mm256_cvtph_ps(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(y)));
+        const __m256 delta = _mm256_mul_ps(_mm256_sub_ps(_x, _y),
+            _mm256_loadu_ps(scales));
+        sum = _mm256_fmadd_ps(delta, delta, sum);
+        x += 8;
+        y += 8;
+        scales += 8;
+    }
+    float distance = horizontal_sum_avx(sum);
+    if (n > 0) {
+        distance += quantized_distance_nosse<uint16_t, half_to_float>(n, x,
+            y, scales);
+    }
+    return distance;
+}
+
+__attribute__((target("avx2,fma")))
+inline float quantized_distance_bf16_avx2(size_t n, const void* x_codes,
+        const void* y_codes, const float* scales)
+{
+    // Eight bfloats at a time, widened into the top halves of floats
+    const uint16_t* x = static_cast<const uint16_t*>(x_codes);
+    const uint16_t* y = static_cast<const uint16_t*>(y_codes);
+    __m256 sum = _mm256_setzero_ps();
+    for (; n > 7; n -= 8) {
+        const __m256 _x = _mm256_castsi256_ps(_mm256_slli_epi32(
+            _mm256_cvtepu16_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(x))), 16));
+        const __m256 _y = _mm256_castsi256_ps(_mm256_slli_epi32(
+            _mm256_cvtepu16_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(y))), 16));
+        const __m256 delta = _mm256_mul_ps(_mm256_sub_ps(_x, _y),
+            _mm256_loadu_ps(scales));
+        sum = _mm256_fmadd_ps(delta, delta, sum);
+        x += 8;
+        y += 8;
+        scales += 8;
+    }
+    float distance = horizontal_sum_avx(sum);
+    if (n > 0) {
+        distance += quantized_distance_nosse<uint16_t, bfloat_to_float>(n, x,
+            y, scales);
+    }
+    return distance;
+}
+
 #endif
 
+inline quantized_distance_fn get_quantized_distance(quantization_type type)
+{
+    // The kernel for type under the active kernel; AVX2 covers AVX-512
+    // CPUs too, and narrower ones get the scalar kernel
+#ifdef LIBDBSCAN_X86_DISPATCH
+    if (distance_kernel_state<>::active >= avx2_kernel) {
+        switch (type) {
+        case fp16_quantization: return quantized_distance_fp16_avx2;
+        case bf16_quantization: return quantized_distance_bf16_avx2;
+        default: return quantized_distance_int8_avx2;
+        }
+    }
+#endif
+    switch (type) {
+    case fp16_quantization:
+        return quantized_distance_nosse<uint16_t, half_to_float>;
+    case bf16_quantization:
+        return quantized_distance_nosse<uint16_t, bfloat_to_float>;
+    default:
+        return quantized_distance_nosse<int8_t, int8_to_float>;
+    }
+}
+
 }
 
 #endif